@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# Runs the fixed benchmark workloads against the uninstrumented build and every mode of the
+# instrumented build, prints a comparison table and fails when the overhead exceeds its budget.
+#
+# Usage: run_bench.sh <trw_bench_off> <trw_bench> [work_dir]
+#
+# Overhead budgets (percent over the uninstrumented build) can be overridden through the environment:
+#   MAX_DISABLED_OVERHEAD  tracing compiled in but disabled   (default 10)
+#   MAX_ENABLED_OVERHEAD   tracing enabled, any sink          (default 400)
+# Instructions retired are compared when perf events are available, wall-clock throughput otherwise.
+
+if [ "$#" -lt 2 ]; then
+    echo "Usage: $0 <trw_bench_off> <trw_bench> [work_dir]"
+    exit 1
+fi
+
+bench_off="$1"
+bench_instrumented="$2"
+work_dir="${3:-.}"
+max_disabled="${MAX_DISABLED_OVERHEAD:-10}"
+max_enabled="${MAX_ENABLED_OVERHEAD:-400}"
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+cd "$work_dir" || exit 1
+
+if ! "$bench_off" --mode off >> "$results"; then
+    echo "Error: uninstrumented benchmark failed."
+    exit 1
+fi
+
+for mode in disabled null text binary hash; do
+    if ! "$bench_instrumented" --mode "$mode" --out "trw_bench.$mode.trace" >> "$results"; then
+        echo "Error: instrumented benchmark failed in mode '$mode'."
+        exit 1
+    fi
+    rm -f "trw_bench.$mode.trace"
+done
+
+awk -v max_disabled="$max_disabled" -v max_enabled="$max_enabled" -F'\t' '
+{
+    mode = $1; workload = $2
+    ops[mode, workload] = $3; secs[mode, workload] = $4; insts[mode, workload] = $5; allocs[mode, workload] = $6
+    if (!(workload in seen)) { seen[workload] = 1; order[n++] = workload }
+    if (!(mode in seenMode)) { seenMode[mode] = 1; modes[m++] = mode }
+}
+END {
+    printf "%-14s %-10s %12s %14s %12s %10s\n", "workload", "mode", "kops/s", "instr/op", "allocs/op", "overhead"
+    failed = 0
+    for (i = 0; i < n; i++) {
+        w = order[i]
+        for (j = 0; j < m; j++) {
+            mo = modes[j]
+            if (!((mo, w) in ops)) continue
+            kops = ops[mo, w] / secs[mo, w] / 1000
+            ipo = insts[mo, w] >= 0 ? sprintf("%.0f", insts[mo, w] / ops[mo, w]) : "n/a"
+            apo = allocs[mo, w] / ops[mo, w]
+
+            # Prefer instructions retired: it is far less noisy than wall-clock time.
+            if (insts[mo, w] > 0 && insts["off", w] > 0) {
+                overhead = (insts[mo, w] / insts["off", w] - 1) * 100
+            } else {
+                overhead = (secs[mo, w] / secs["off", w] - 1) * 100
+            }
+            budget = mo == "disabled" ? max_disabled : max_enabled
+            mark = ""
+            if (mo != "off" && overhead > budget) { mark = " FAIL"; failed = 1 }
+
+            printf "%-14s %-10s %12.1f %14s %12.2f %9.1f%%%s\n", w, mo, kops, ipo, apo, overhead, mark
+        }
+    }
+    exit failed
+}' "$results"
+status=$?
+
+if [ "$status" -ne 0 ]; then
+    echo "Error: instrumentation overhead exceeds its budget" \
+        "(disabled: ${max_disabled}%, enabled: ${max_enabled}%)."
+fi
+exit "$status"
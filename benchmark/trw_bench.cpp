@@ -0,0 +1,266 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sqlite3.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef SQLITE_TRW_INSTRUMENT
+#include <sqlite3TraceAdapter.h>
+#endif
+
+// Fixed workload sizes so that every build variant runs exactly the same statements.
+constexpr int NUM_ROWS = 20000;
+constexpr int ROWS_PER_TXN = 100;
+constexpr int NUM_SCANS = 20;
+const std::string DB_FILENAME = "trw_bench.db";
+
+// ------------ Allocation counting ----------
+// The benchmark is linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, which routes every
+// allocation made by the engine and the tracer through these wrappers.
+static std::atomic<unsigned long long> alloc_count{0};
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+}
+
+// ------------ Instruction counting ----------
+// Counts user-space instructions retired by this thread. Reports -1 when perf events are unavailable
+// (containers, perf_event_paranoid), in which case only throughput is compared.
+class InstructionCounter {
+public:
+    InstructionCounter() {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~InstructionCounter() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    void start() const {
+        if (fd_ < 0) return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    long long stop() const {
+        if (fd_ < 0) return -1;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        long long count = 0;
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) return -1;
+        return count;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+bool execute_sql(sqlite3* db, const std::string& sql) {
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        std::cerr << "SQL error: " << err_msg << "\n";
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+
+// Steps a prepared statement to completion and resets it for the next binding.
+void run_statement(sqlite3_stmt* stmt) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+    }
+    sqlite3_reset(stmt);
+}
+
+// ------------ Workloads ----------
+struct Workload {
+    std::string name;
+    // Number of logical operations (rows inserted, rows looked up, ...) the workload performs.
+    long long ops;
+    std::function<void(sqlite3*)> run;
+};
+
+void insert_rows(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "INSERT INTO employees (id, name, department, salary) VALUES (?1, ?2, ?3, ?4);", -1,
+                       &stmt, nullptr);
+    for (int i = 0; i < NUM_ROWS; ++i) {
+        if (i % ROWS_PER_TXN == 0) execute_sql(db, "BEGIN TRANSACTION;");
+        const std::string name = "employee-" + std::to_string(i);
+        sqlite3_bind_int(stmt, 1, i + 1);
+        sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, i % 2 ? "Engineering" : "HR", -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, 50000 + i % 1000);
+        run_statement(stmt);
+        if (i % ROWS_PER_TXN == ROWS_PER_TXN - 1) execute_sql(db, "COMMIT;");
+    }
+    sqlite3_finalize(stmt);
+}
+
+void point_selects(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "SELECT name, salary FROM employees WHERE id = ?1;", -1, &stmt, nullptr);
+    execute_sql(db, "BEGIN TRANSACTION;");
+    for (int i = 0; i < NUM_ROWS; ++i) {
+        sqlite3_bind_int(stmt, 1, (i * 7919) % NUM_ROWS + 1);
+        run_statement(stmt);
+    }
+    execute_sql(db, "COMMIT;");
+    sqlite3_finalize(stmt);
+}
+
+void update_rows(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "UPDATE employees SET salary = salary + 1 WHERE id = ?1;", -1, &stmt, nullptr);
+    for (int i = 0; i < NUM_ROWS; ++i) {
+        if (i % ROWS_PER_TXN == 0) execute_sql(db, "BEGIN TRANSACTION;");
+        sqlite3_bind_int(stmt, 1, (i * 7919) % NUM_ROWS + 1);
+        run_statement(stmt);
+        if (i % ROWS_PER_TXN == ROWS_PER_TXN - 1) execute_sql(db, "COMMIT;");
+    }
+    sqlite3_finalize(stmt);
+}
+
+void full_scans(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "SELECT SUM(salary) FROM employees WHERE department = 'HR';", -1, &stmt, nullptr);
+    execute_sql(db, "BEGIN TRANSACTION;");
+    for (int i = 0; i < NUM_SCANS; ++i) {
+        run_statement(stmt);
+    }
+    execute_sql(db, "COMMIT;");
+    sqlite3_finalize(stmt);
+}
+
+// ------------ Mode selection ----------
+// Configures the tracer for `mode`. Returns the trace file to close afterwards, if any.
+FILE* configure_tracing(const std::string& mode, const std::string& out_path) {
+#ifdef SQLITE_TRW_INSTRUMENT
+    setThreadId(0);
+    if (mode == "disabled") return nullptr;
+    if (mode == "null") {
+        setTraceSink(TRACE_SINK_NULL, nullptr);
+        sqlite3_trw_enable(1);
+        return nullptr;
+    }
+    FILE* out = std::fopen(out_path.c_str(), "wb");
+    if (!out) {
+        std::cerr << "Can't open trace output " << out_path << "\n";
+        std::exit(2);
+    }
+    if (mode == "text") {
+        setTraceSink(TRACE_SINK_TEXT, out);
+        sqlite3_trw_enable(1);
+        return out;
+    }
+    if (mode == "binary") {
+        setTraceSink(TRACE_SINK_BINARY, out);
+        sqlite3_trw_enable(1);
+        return out;
+    }
+    if (mode == "hash") {
+        // Binary sink in value hashing mode: only record hashes are kept.
+        setTraceSink(TRACE_SINK_BINARY, out);
+        setTraceCapture(TRACE_VALUE_NONE, 1);
+        sqlite3_trw_enable(1);
+        return out;
+    }
+    std::fclose(out);
+#else
+    if (mode == "off") return nullptr;
+#endif
+    std::cerr << "Mode " << mode << " is not available in this build.\n";
+    std::exit(2);
+}
+
+int main(int argc, char* argv[]) {
+#ifdef SQLITE_TRW_INSTRUMENT
+    std::string mode = "disabled";
+#else
+    std::string mode = "off";
+#endif
+    std::string out_path = "trw_bench.trace";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--mode") == 0) mode = argv[i + 1];
+        else if (std::strcmp(argv[i], "--out") == 0) out_path = argv[i + 1];
+    }
+
+    std::remove(DB_FILENAME.c_str());
+    sqlite3* db;
+    if (sqlite3_open(DB_FILENAME.c_str(), &db) != SQLITE_OK) {
+        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << "\n";
+        return 2;
+    }
+    // Keep disk I/O out of the measurement; only the VDBE and the tracer should show up.
+    execute_sql(db, "PRAGMA journal_mode = MEMORY; PRAGMA synchronous = OFF;");
+    execute_sql(db, R"SQL(
+    CREATE TABLE employees (
+        id INTEGER PRIMARY KEY,
+        name TEXT NOT NULL,
+        department TEXT NOT NULL,
+        salary INTEGER NOT NULL
+    );
+    )SQL");
+
+    FILE* trace_out = configure_tracing(mode, out_path);
+
+    const std::vector<Workload> workloads = {
+        {"insert", NUM_ROWS, insert_rows},
+        {"point_select", NUM_ROWS, point_selects},
+        {"update", NUM_ROWS, update_rows},
+        {"full_scan", static_cast<long long>(NUM_SCANS) * NUM_ROWS, full_scans},
+    };
+
+    // One tab-separated line per workload; run_bench.sh turns these into the comparison table.
+    InstructionCounter counter;
+    for (const auto& workload : workloads) {
+        const unsigned long long allocs_before = alloc_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        counter.start();
+        workload.run(db);
+        const long long instructions = counter.stop();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const unsigned long long allocs = alloc_count.load() - allocs_before;
+
+        std::printf("%s\t%s\t%lld\t%.6f\t%lld\t%llu\n", mode.c_str(), workload.name.c_str(), workload.ops,
+                    elapsed.count(), instructions, allocs);
+    }
+
+    sqlite3_close(db);
+    if (trace_out) std::fclose(trace_out);
+    std::remove(DB_FILENAME.c_str());
+    return 0;
+}
@@ -211,6 +211,11 @@ void thread_function(TransactionType type, const int thread_id) {
 }
 
 int main() {
+    // Before any connection is opened: every one of them gets the trw VFS and the trw_trace table.
+    if (sqlite3_trw_init() != SQLITE_OK) {
+        std::cerr << "Can't register the tracer's VFS and trw_trace module.\n";
+        return 1;
+    }
     initialize_database();
     enableTraceOutput();
 
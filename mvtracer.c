@@ -1,8 +1,13 @@
 #include "mvtracer.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
-Value* createValue(const void* val, const valToStringFunc func)
+Value* createValue(const void* val, const valFormatFunc format)
 {
     Value *res = malloc(sizeof(Value));
     if (!res)
@@ -11,19 +16,144 @@ Value* createValue(const void* val, const valToStringFunc func)
     }
 
     res->val = val;
-    res->func = func;
+    res->format = format;
+    res->len = -1;
+    res->fullLen = -1;
+    res->hash = 0;
+    res->inArena = 0;
 
     return res;
 }
 
 static void destroyValue(Value* val)
 {
-    if (val)
+    if (val && !val->inArena)
     {
         free(val);
     }
 }
 
+// ------------ Value Capture ----------
+struct TraceArenaChunk
+{
+    TraceArenaChunk *next;
+    size_t size;
+    size_t used;
+    // Keeps `data` 8-byte aligned.
+    uint64_t data[];
+};
+
+void *traceArenaAlloc(TraceArena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    TraceArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        size_t chunkSize = size > TRACE_ARENA_CHUNK_SIZE ? size : TRACE_ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(TraceArenaChunk) + chunkSize);
+        if (!chunk) return NULL;
+
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *res = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return res;
+}
+
+void traceArenaReset(TraceArena *arena)
+{
+    TraceArenaChunk *chunk = arena->chunks;
+    if (!chunk) return;
+
+    // Keep the oldest chunk: it is always a regular-sized one.
+    while (chunk->next)
+    {
+        TraceArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    chunk->used = 0;
+    arena->chunks = chunk;
+}
+
+void traceArenaDestroy(TraceArena *arena)
+{
+    while (arena->chunks)
+    {
+        TraceArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits.
+static uint64_t mix64(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+uint64_t traceHash64(const void *data, size_t len)
+{
+    static const uint64_t k0 = 0xa0761d6478bd642full;
+    static const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    static const uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+
+    const unsigned char *p = data;
+    uint64_t h = k0 ^ mix64(len, k1);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        h = mix64(read64(p + i) ^ k1, read64(p + i + 8) ^ h);
+    }
+    if (i + 8 <= len)
+    {
+        h = mix64(read64(p + i) ^ k1, h ^ k2);
+        i += 8;
+    }
+    if (i < len)
+    {
+        uint64_t tail = 0;
+        memcpy(&tail, p + i, len - i);
+        h = mix64(tail ^ k2, h ^ k1);
+    }
+    return mix64(h ^ k0, len ^ k2);
+}
+
+Value *captureValue(TraceArena *arena, const void *data, int len, int maxLen, int hash)
+{
+    if (len < 0 || (len > 0 && data == NULL)) len = 0;
+    int copyLen = maxLen == TRACE_VALUE_NONE ? 0 : maxLen != TRACE_VALUE_UNLIMITED && len > maxLen ? maxLen : len;
+
+    Value *res = traceArenaAlloc(arena, sizeof(Value) + (size_t)copyLen);
+    if (!res) return NULL;
+
+    char *copy = (char *)(res + 1);
+    if (copyLen > 0) memcpy(copy, data, copyLen);
+
+    res->val = maxLen == TRACE_VALUE_NONE ? NULL : copy;
+    res->format = NULL;
+    res->len = copyLen;
+    res->fullLen = len;
+    res->hash = hash ? traceHash64(data, len) : 0;
+    res->inArena = 1;
+
+    return res;
+}
+
 static TransactionOp* createTransactionOp(const OpType type, const int transactionId, const unsigned long objectId,
                                           const Value* writeVal)
 {
@@ -37,6 +167,12 @@ static TransactionOp* createTransactionOp(const OpType type, const int transacti
     transactionOp->transactionId = transactionId;
     transactionOp->objectId = objectId;
     transactionOp->writeVal = writeVal;
+    transactionOp->columns = 0;
+    transactionOp->table = 0;
+    transactionOp->upperBound = 0;
+    transactionOp->flags = 0;
+    transactionOp->threadId = 0;
+    transactionOp->statementId = TRACE_STATEMENT_NONE;
 
     return transactionOp;
 }
@@ -45,8 +181,7 @@ static void destroyTransactionOp(TransactionOp* transactionOp)
 {
     if (transactionOp)
     {
-        if (transactionOp->writeVal != NULL
-            && transactionOp->writeVal->val != NULL)
+        if (transactionOp->writeVal != NULL)
         {
             destroyValue(transactionOp->writeVal);
         }
@@ -65,6 +200,28 @@ TransactionOp* trackWrite(int transactionId, unsigned long objectId, Value *valu
     return createTransactionOp(WRITE, transactionId, objectId, value);
 }
 
+TransactionOp *trackKeyWrite(int transactionId, unsigned table, unsigned long objectId, unsigned flags)
+{
+    TransactionOp *transactionOp = createTransactionOp(WRITE, transactionId, objectId, NULL);
+    if (!transactionOp) return NULL;
+
+    transactionOp->table = table;
+    transactionOp->flags = flags;
+    return transactionOp;
+}
+
+TransactionOp *trackRange(int transactionId, unsigned table, int64_t lowerBound, int64_t upperBound,
+                          unsigned flags)
+{
+    TransactionOp *transactionOp = createTransactionOp(RANGE, transactionId, (unsigned long)lowerBound, NULL);
+    if (!transactionOp) return NULL;
+
+    transactionOp->table = table;
+    transactionOp->upperBound = upperBound;
+    transactionOp->flags = flags;
+    return transactionOp;
+}
+
 TransactionOp *trackBegin(int transactionId)
 {
     return createTransactionOp(BEGIN, transactionId, NULL, NULL);
@@ -75,82 +232,853 @@ TransactionOp *trackEnd(int transactionId)
     return createTransactionOp(COMMIT, transactionId, NULL, NULL);
 }
 
-void printTransactionOp(TransactionOp* transactionOp, FILE* pOut)
+TransactionOp *trackAbort(int transactionId)
+{
+    return createTransactionOp(ABORT, transactionId, 0, NULL);
+}
+
+TransactionOp *trackSavepoint(OpType type, int transactionId, int level, Value *name)
+{
+    return createTransactionOp(type, transactionId, (unsigned long)level, name);
+}
+
+const char *opTypeName(OpType type)
+{
+    switch (type)
+    {
+    case BEGIN:
+        return "BEGIN";
+    case COMMIT:
+        return "COMMIT";
+    case WRITE:
+        return "WRITE";
+    case READ:
+        return "READ";
+    case RANGE:
+        return "RANGE";
+    case ABORT:
+        return "ABORT";
+    case SAVEPOINT:
+        return "SAVEPOINT";
+    case RELEASE:
+        return "RELEASE";
+    case ROLLBACK_TO:
+        return "ROLLBACK_TO";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// ------------ Text Encoding ----------
+// printTransactionOp assembles each line in a per-thread buffer with the
+// appenders below rather than snprintf: the output is the same, byte for byte,
+// as the printf formats it replaced, which the tools parsing it rely on.
+// Longest line without its payload: the fields of a RANGE or of a READ, with
+// every number at its widest, stay well below this.
+#define TRACE_TEXT_LINE_MAX 256
+
+#if defined(__GLIBC__)
+#define traceFwrite fwrite_unlocked
+#else
+#define traceFwrite fwrite
+#endif
+
+static __thread char textLine[TRACE_TEXT_LINE_MAX];
+
+static const char digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+#define appendLiteral(p, s) appendBytes((p), (s), sizeof(s) - 1)
+
+static char *appendBytes(char *p, const char *s, size_t n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
+// %llu
+static char *appendUnsigned(char *p, uint64_t v)
+{
+    char digits[20];
+    char *d = digits + sizeof(digits);
+    while (v >= 100)
+    {
+        d -= 2;
+        memcpy(d, digitPairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        d -= 2;
+        memcpy(d, digitPairs + v * 2, 2);
+    } else
+    {
+        *--d = (char)('0' + v);
+    }
+    return appendBytes(p, d, digits + sizeof(digits) - d);
+}
+
+// %lld
+static char *appendSigned(char *p, int64_t v)
+{
+    if (v < 0)
+    {
+        *p++ = '-';
+        return appendUnsigned(p, 0 - (uint64_t)v);
+    }
+    return appendUnsigned(p, (uint64_t)v);
+}
+
+// %llx, or %0<width>llx with `width` > 1.
+static char *appendHex(char *p, uint64_t v, int width)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    int n = 1;
+    while (n < 16 && (v >> (4 * n)) != 0) n++;
+    if (n < width) n = width;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        p[i] = hexDigits[v & 0xf];
+        v >>= 4;
+    }
+    return p + n;
+}
+
+// "-inf" / "+inf" for unbounded ends, the key otherwise.
+static char *appendRangeKey(char *p, int64_t key, const char *unbounded)
+{
+    if (key == TRACE_KEY_MIN || key == TRACE_KEY_MAX) return appendBytes(p, unbounded, 4);
+    return appendSigned(p, key);
+}
+
+// "\n$$Op: <name>\t Tx: " by OpType; the last entry stands for unknown types.
+static const struct
+{
+    const char *text;
+    size_t len;
+} linePrefixes[OP_TYPE_COUNT + 1] = {
+#define LINE_PREFIX(name) {"\n$$Op: " name "\t Tx: ", sizeof("\n$$Op: " name "\t Tx: ") - 1}
+    LINE_PREFIX("BEGIN"),     LINE_PREFIX("COMMIT"),  LINE_PREFIX("WRITE"),
+    LINE_PREFIX("READ"),      LINE_PREFIX("RANGE"),   LINE_PREFIX("ABORT"),
+    LINE_PREFIX("SAVEPOINT"), LINE_PREFIX("RELEASE"), LINE_PREFIX("ROLLBACK_TO"),
+    LINE_PREFIX("UNKNOWN"),
+#undef LINE_PREFIX
+};
+
+size_t printTransactionOp(TransactionOp* transactionOp, FILE* pOut)
 {
     if (!transactionOp)
     {
         printf("Invalid TransactionOp pointer.\n");
-        return;
+        return 0;
     }
 
     if (!pOut)
     {
         // Nothing to print, just destroy.
         destroyTransactionOp(transactionOp);
-        return;
+        return 0;
     }
 
-    // Print operation type
-    const char* opTypeStr = "UNKNOWN";
-    switch (transactionOp->type)
+    const OpType type = transactionOp->type;
+    const size_t prefix = (unsigned)type < OP_TYPE_COUNT ? (size_t)type : OP_TYPE_COUNT;
+    char *p = appendBytes(textLine, linePrefixes[prefix].text, linePrefixes[prefix].len);
+    p = appendSigned(p, transactionOp->transactionId);
+    if (transactionOp->statementId != TRACE_STATEMENT_NONE)
     {
-    case BEGIN:
-        opTypeStr = "BEGIN";
-        break;
-    case COMMIT:
-        opTypeStr = "COMMIT";
-        break;
-    case WRITE:
-        opTypeStr = "WRITE";
-        break;
-    case READ:
-        opTypeStr = "READ";
-        break;
-    default:
-        break;
+        p = appendLiteral(p, "\t Stmt: ");
+        p = appendUnsigned(p, transactionOp->statementId);
+    }
+
+    // Print object ID if it's not a BEGIN or COMMIT operation
+    int indexWrite = type == WRITE && (transactionOp->flags & TRACE_FLAG_INDEX);
+    if (indexWrite)
+    {
+        p = appendLiteral(p, "\t Table: ");
+        p = appendUnsigned(p, transactionOp->table);
+        p = appendLiteral(p, "\t Key: ");
+        p = appendHex(p, transactionOp->objectId, 16);
+    } else if (type == WRITE || type == READ) {
+        // Printed with "%d" from the start: only the low 32 bits, as a signed number.
+        p = appendLiteral(p, "\t Obj: ");
+        p = appendSigned(p, (int32_t)(uint32_t)transactionOp->objectId);
     }
 
-    static const char *baseFormat = "\n$$Op: %s\t Tx: %d";
-    static const char *objFormat = "\t Obj: %d";
-    static const char *writeFormat = " \t wVal: %s";
+    // Row deletes and index maintenance; plain row writes keep the original format.
+    if (type == WRITE && (transactionOp->flags & (TRACE_FLAG_INDEX | TRACE_FLAG_DELETE)))
+    {
+        const char* kind = !indexWrite ? "delete"
+                           : transactionOp->flags & TRACE_FLAG_DELETE ? "index-delete" : "index-insert";
+        p = appendLiteral(p, " \t Kind: ");
+        p = appendBytes(p, kind, strlen(kind));
+    }
 
-    char formattedStr[512]; // Ensure it's large enough to fit the full string
+    if (type == RANGE)
+    {
+        p = appendLiteral(p, "\t Table: ");
+        p = appendUnsigned(p, transactionOp->table);
+        p = appendLiteral(p, "\t Lo: ");
+        p = appendRangeKey(p, (int64_t)transactionOp->objectId, "-inf");
+        p = appendLiteral(p, "\t Hi: ");
+        p = appendRangeKey(p, transactionOp->upperBound, "+inf");
+        p = appendLiteral(p, "\t Dir: ");
+        p = transactionOp->flags & TRACE_FLAG_BACKWARD ? appendLiteral(p, "desc") : appendLiteral(p, "asc");
+    }
 
-    int offset = snprintf(formattedStr, sizeof(formattedStr), baseFormat, opTypeStr, transactionOp->transactionId);
+    // A savepoint name or a write value ends the line; it goes straight to the stream.
+    const char* tail = NULL;
+    size_t tailLen = 0;
+    char* formatted = NULL;
 
-    // Print object ID if it's not a BEGIN or COMMIT operation
-    if (transactionOp->type == WRITE || transactionOp->type == READ) {
-        offset += snprintf(formattedStr + offset, sizeof(formattedStr) - offset, objFormat, transactionOp->objectId);
+    if (type == SAVEPOINT || type == RELEASE || type == ROLLBACK_TO)
+    {
+        const Value* name = transactionOp->writeVal;
+        p = appendLiteral(p, "\t Level: ");
+        p = appendUnsigned(p, transactionOp->objectId);
+        if (name != NULL && name->val != NULL && name->len >= 0)
+        {
+            const char* end = memchr(name->val, '\0', name->len);
+            p = appendLiteral(p, "\t Name: ");
+            tail = name->val;
+            tailLen = end ? (size_t)(end - tail) : (size_t)name->len;
+        }
+    }
+
+    if (type == READ && transactionOp->columns != 0)
+    {
+        p = appendLiteral(p, " \t Cols: 0x");
+        p = appendHex(p, transactionOp->columns, 1);
+    }
+
+    // Hashed values are logged as their 16 hex digit hash instead of the payload.
+    const Value* value = transactionOp->writeVal;
+    int hashOnly = value != NULL && value->len >= 0 && value->val == NULL;
+    if (type == READ && value != NULL && value->hash != 0)
+    {
+        p = appendLiteral(p, " \t rHash: ");
+        p = appendHex(p, value->hash, 16);
+    } else if (type == WRITE && hashOnly)
+    {
+        p = appendLiteral(p, " \t wHash: ");
+        p = appendHex(p, value->hash, 16);
+    } else if (type == WRITE && value != NULL && value->len >= 0)
+    {
+        // Like the `%s` formatting of aliased values, the payload ends at its first NUL.
+        const char* end = memchr(value->val, '\0', value->len);
+        p = appendLiteral(p, " \t wVal: ");
+        tail = value->val;
+        tailLen = end ? (size_t)(end - tail) : (size_t)value->len;
+    } else if (type == WRITE && value != NULL && value->format != NULL)
+    {
+        p = appendLiteral(p, " \t wVal: ");
+        if (value->val == NULL)
+        {
+            tail = "<NULL>";
+            tailLen = 6;
+        } else if (value->format == formatInt)
+        {
+            p = appendSigned(p, *(const int*)value->val);
+        } else if (value->format == formatInt64)
+        {
+            p = appendSigned(p, *(const int64_t*)value->val);
+        } else if (value->format == formatText)
+        {
+            tail = value->val;
+            tailLen = strlen(tail);
+        } else
+        {
+            // Other formatters write into what is left of the line, or into a
+            // buffer of their own when that is too small.
+            size_t room = (size_t)(textLine + TRACE_TEXT_LINE_MAX - p);
+            size_t n = value->format(value->val, p, room);
+            if (n < room)
+            {
+                p += n;
+            } else if ((formatted = malloc(n + 1)) != NULL)
+            {
+                value->format(value->val, formatted, n + 1);
+                tail = formatted;
+                tailLen = n;
+            }
+        }
+    }
+
+    flockfile(pOut);
+    size_t written = traceFwrite(textLine, 1, (size_t)(p - textLine), pOut);
+    if (tail) written += traceFwrite(tail, 1, tailLen, pOut);
+    written += traceFwrite("$$\n", 1, 3, pOut);
+    funlockfile(pOut);
+
+    free(formatted);
+    destroyTransactionOp(transactionOp);
+    return written;
+}
+
+static _Atomic uint64_t nextSeq = 0;
+
+static uint64_t monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void writeTraceFileHeader(FILE* pOut)
+{
+    if (!pOut) return;
+
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FORMAT_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, pOut);
+}
+
+static void fillTraceRecord(const TransactionOp* transactionOp, TraceRecord* record)
+{
+    memset(record, 0, sizeof(*record));
+    record->seq = atomic_fetch_add_explicit(&nextSeq, 1, memory_order_relaxed);
+    record->ts = monotonicNanos();
+    record->objectId = (int64_t)transactionOp->objectId;
+    record->upperBound = transactionOp->upperBound;
+    record->table = transactionOp->table;
+    record->flags = (uint8_t)transactionOp->flags;
+    record->valueHash = transactionOp->writeVal ? transactionOp->writeVal->hash : 0;
+    record->columns = transactionOp->columns;
+    record->transactionId = transactionOp->transactionId;
+    record->threadId = transactionOp->threadId;
+    record->statementId = transactionOp->statementId;
+    record->type = (uint8_t)transactionOp->type;
+}
+
+size_t writeTransactionOp(TransactionOp* transactionOp, FILE* pOut)
+{
+    return writeIndexedTransactionOp(transactionOp, pOut, NULL);
+}
+
+// ------------ Trace Index ----------
+struct TraceIndexWriter
+{
+    FILE *out;
+    uint32_t interval;
+    // Records indexed and entries written so far.
+    uint64_t records;
+    uint64_t entries;
+    // The block being filled; written once it holds `interval` records.
+    TraceIndexEntry block;
+    // Transactions that have begun and not ended yet, one per transaction id.
+    TraceIndexEntry *open;
+    int nOpen;
+    int nOpenAlloc;
+};
+
+TraceIndexWriter *traceIndexCreate(FILE *pIndex, uint32_t interval)
+{
+    TraceIndexWriter *index = calloc(1, sizeof(TraceIndexWriter));
+    if (!index) return NULL;
+
+    index->out = pIndex;
+    index->interval = interval ? interval : TRACE_INDEX_DEFAULT_INTERVAL;
+
+    TraceIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FORMAT_VERSION;
+    header.entrySize = sizeof(TraceIndexEntry);
+    header.interval = index->interval;
+    if (pIndex) fwrite(&header, sizeof(header), 1, pIndex);
+    return index;
+}
+
+static void writeIndexEntry(TraceIndexWriter *index, const TraceIndexEntry *entry)
+{
+    if (index->out) index->entries += fwrite(entry, sizeof(*entry), 1, index->out);
+}
+
+static void startIndexEntry(TraceIndexEntry *entry, TraceIndexEntryKind kind, const TraceRecord *record,
+                            uint64_t recordNo)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = (uint8_t)kind;
+    entry->transactionId = kind == TRACE_INDEX_TRANSACTION ? record->transactionId : 0;
+    entry->firstRecord = entry->lastRecord = recordNo;
+    entry->minSeq = entry->maxSeq = record->seq;
+}
+
+static void extendIndexEntry(TraceIndexEntry *entry, const TraceRecord *record, uint64_t recordNo)
+{
+    entry->lastRecord = recordNo;
+    if (record->seq < entry->minSeq) entry->minSeq = record->seq;
+    if (record->seq > entry->maxSeq) entry->maxSeq = record->seq;
+}
+
+// Writes the entry of open transaction `i` and forgets it.
+static void endIndexedTransaction(TraceIndexWriter *index, int i)
+{
+    writeIndexEntry(index, &index->open[i]);
+    index->open[i] = index->open[--index->nOpen];
+}
+
+static void indexRecord(TraceIndexWriter *index, const TraceRecord *record)
+{
+    uint64_t recordNo = index->records++;
+    if (recordNo % index->interval == 0) startIndexEntry(&index->block, TRACE_INDEX_BLOCK, record, recordNo);
+    else extendIndexEntry(&index->block, record, recordNo);
+    if (index->records % index->interval == 0) writeIndexEntry(index, &index->block);
+
+    // Few transactions are open at a time: one per traced connection or thread.
+    int i = 0;
+    while (i < index->nOpen && index->open[i].transactionId != record->transactionId) i++;
+    if (i < index->nOpen && record->type == BEGIN)
+    {
+        // The previous transaction with this id never ended in the trace.
+        endIndexedTransaction(index, i);
+        i = index->nOpen;
+    }
+
+    if (i < index->nOpen)
+    {
+        extendIndexEntry(&index->open[i], record, recordNo);
+    } else
+    {
+        if (index->nOpen == index->nOpenAlloc)
+        {
+            int nAlloc = index->nOpenAlloc ? 2 * index->nOpenAlloc : 16;
+            TraceIndexEntry *open = realloc(index->open, nAlloc * sizeof(TraceIndexEntry));
+            if (!open) return;
+            index->open = open;
+            index->nOpenAlloc = nAlloc;
+        }
+        startIndexEntry(&index->open[index->nOpen++], TRACE_INDEX_TRANSACTION, record, recordNo);
+    }
+
+    if (record->type == COMMIT || record->type == ABORT) endIndexedTransaction(index, i);
+}
+
+void traceIndexFinish(TraceIndexWriter *index)
+{
+    if (!index) return;
+
+    if (index->records % index->interval != 0) writeIndexEntry(index, &index->block);
+    while (index->nOpen > 0)
+    {
+        endIndexedTransaction(index, 0);
+    }
+
+    if (index->out)
+    {
+        TraceIndexTrailer trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, TRACE_INDEX_TRAILER_MAGIC, sizeof(trailer.magic));
+        trailer.entries = index->entries;
+        fwrite(&trailer, sizeof(trailer), 1, index->out);
+        fflush(index->out);
+    }
+    free(index->open);
+    free(index);
+}
+
+size_t writeIndexedTransactionOp(TransactionOp *transactionOp, FILE *pOut, TraceIndexWriter *index)
+{
+    if (!transactionOp) return 0;
+
+    size_t written = 0;
+    if (pOut)
+    {
+        TraceRecord record;
+        fillTraceRecord(transactionOp, &record);
+        // The index counts records, so it must see them in the order they land in the stream.
+        if (index) flockfile(pOut);
+        written = fwrite(&record, sizeof(record), 1, pOut) * sizeof(record);
+        if (index)
+        {
+            if (written) indexRecord(index, &record);
+            funlockfile(pOut);
+        }
+    }
+
+    destroyTransactionOp(transactionOp);
+    return written;
+}
+
+// ------------ Statement Table ----------
+static int isIdentifierChar(unsigned char c)
+{
+    return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+size_t normalizeSql(const char *sql, char *out)
+{
+    const unsigned char *p = (const unsigned char *)sql;
+    size_t n = 0;
+    int space = 0;
+
+    while (*p)
+    {
+        unsigned char c = *p;
+        if (isspace(c))
+        {
+            space = 1;
+            p++;
+            continue;
+        }
+        if (c == '-' && p[1] == '-')
+        {
+            while (*p && *p != '\n') p++;
+            space = 1;
+            continue;
+        }
+        if (c == '/' && p[1] == '*')
+        {
+            p += 2;
+            while (*p && !(p[0] == '*' && p[1] == '/')) p++;
+            if (*p) p += 2;
+            space = 1;
+            continue;
+        }
+        if (space && n > 0) out[n++] = ' ';
+        space = 0;
+
+        int afterIdentifier = n > 0 && isIdentifierChar((unsigned char)out[n - 1]);
+        if (c == '\'' || ((c == 'x' || c == 'X') && p[1] == '\'' && !afterIdentifier))
+        {
+            // String or blob literal; '' is an escaped quote.
+            p += c == '\'' ? 1 : 2;
+            while (*p)
+            {
+                if (*p++ != '\'') continue;
+                if (*p != '\'') break;
+                p++;
+            }
+            out[n++] = '?';
+        } else if (!afterIdentifier && (isdigit(c) || (c == '.' && isdigit(p[1]))))
+        {
+            // Numeric literal, hex and exponents included.
+            unsigned char last = 0;
+            while (isalnum(*p) || *p == '.' || *p == '_'
+                   || ((*p == '+' || *p == '-') && (last == 'e' || last == 'E')))
+            {
+                last = *p++;
+            }
+            out[n++] = '?';
+        } else if (c == '"' || c == '`' || c == '[')
+        {
+            // Quoted identifier, copied as is.
+            unsigned char close = c == '[' ? ']' : c;
+            out[n++] = (char)*p++;
+            while (*p)
+            {
+                out[n++] = (char)*p;
+                if (*p++ != close) continue;
+                if (close == ']' || *p != close) break;
+                out[n++] = (char)*p++;
+            }
+        } else if (c == '?')
+        {
+            // Numbered parameters keep their number.
+            out[n++] = (char)*p++;
+            while (isdigit(*p)) out[n++] = (char)*p++;
+        } else
+        {
+            out[n++] = (char)*p++;
+        }
+    }
+
+    while (n > 0 && (out[n - 1] == ';' || out[n - 1] == ' ')) n--;
+    out[n] = '\0';
+    return n;
+}
+
+// Statement ids are indexes into `statementSql` plus one. `statementSlots` is
+// an open addressing table of ids keyed by the hash of their normalized text.
+static pthread_mutex_t statementMutex = PTHREAD_MUTEX_INITIALIZER;
+static char **statementSql = NULL;
+static uint64_t *statementHashes = NULL;
+static size_t nStatements = 0;
+static size_t nStatementsAlloc = 0;
+static uint16_t *statementSlots = NULL;
+static size_t statementSlotMask = 0;
+
+// Ids of the raw SQL texts a thread interned last, keyed by traceHash64 of the text.
+#define STATEMENT_CACHE_SIZE 64
+
+typedef struct
+{
+    uint64_t hash;
+    uint16_t id;
+} StatementCacheEntry;
+
+static __thread StatementCacheEntry statementCache[STATEMENT_CACHE_SIZE];
+
+static uint16_t *findStatementSlot(uint64_t hash, const char *normalized)
+{
+    for (size_t i = hash & statementSlotMask;; i = (i + 1) & statementSlotMask)
+    {
+        uint16_t id = statementSlots[i];
+        if (id == TRACE_STATEMENT_NONE
+            || (statementHashes[id - 1] == hash && strcmp(statementSql[id - 1], normalized) == 0))
+        {
+            return &statementSlots[i];
+        }
+    }
+}
+
+// Keeps the slot table at most half full. Returns 0 if out of memory.
+static int growStatementTable()
+{
+    if (nStatements == nStatementsAlloc)
+    {
+        size_t nAlloc = nStatementsAlloc ? 2 * nStatementsAlloc : 64;
+        char **sqls = realloc(statementSql, nAlloc * sizeof(char *));
+        if (!sqls) return 0;
+        statementSql = sqls;
+        uint64_t *hashes = realloc(statementHashes, nAlloc * sizeof(uint64_t));
+        if (!hashes) return 0;
+        statementHashes = hashes;
+        nStatementsAlloc = nAlloc;
+    }
+
+    if (2 * (nStatements + 1) <= statementSlotMask) return 1;
+    size_t nSlots = statementSlotMask ? 2 * (statementSlotMask + 1) : 128;
+    uint16_t *slots = calloc(nSlots, sizeof(uint16_t));
+    if (!slots) return 0;
+    free(statementSlots);
+    statementSlots = slots;
+    statementSlotMask = nSlots - 1;
+    for (size_t i = 0; i < nStatements; i++)
+    {
+        *findStatementSlot(statementHashes[i], statementSql[i]) = (uint16_t)(i + 1);
     }
+    return 1;
+}
 
-    // Print write value if it's a WRITE operation
-    if (transactionOp->type == WRITE && transactionOp->writeVal->func != NULL) {
-        const char* valueStr = transactionOp->writeVal->func(transactionOp->writeVal->val);
-        offset += snprintf(formattedStr + offset, sizeof(formattedStr) - offset, writeFormat, valueStr ? valueStr : "<NULL>");
+uint16_t traceInternStatement(const char *sql)
+{
+    if (!sql) return TRACE_STATEMENT_NONE;
+
+    size_t len = strlen(sql);
+    uint64_t rawHash = traceHash64(sql, len);
+    StatementCacheEntry *cached = &statementCache[rawHash % STATEMENT_CACHE_SIZE];
+    if (cached->hash == rawHash && cached->id != TRACE_STATEMENT_NONE) return cached->id;
+
+    char *normalized = malloc(len + 1);
+    if (!normalized) return TRACE_STATEMENT_NONE;
+    uint64_t hash = traceHash64(normalized, normalizeSql(sql, normalized));
+
+    uint16_t id = TRACE_STATEMENT_NONE;
+    pthread_mutex_lock(&statementMutex);
+    uint16_t *slot = statementSlots ? findStatementSlot(hash, normalized) : NULL;
+    if (slot && *slot != TRACE_STATEMENT_NONE)
+    {
+        id = *slot;
+    } else if (nStatements < TRACE_MAX_STATEMENTS && growStatementTable())
+    {
+        statementSql[nStatements] = normalized;
+        statementHashes[nStatements] = hash;
+        nStatements++;
+        id = (uint16_t)nStatements;
+        *findStatementSlot(hash, normalized) = id;
+        normalized = NULL;
     }
+    pthread_mutex_unlock(&statementMutex);
+    free(normalized);
 
-    // Finally, add the newline and write to output
-    snprintf(formattedStr + offset, sizeof(formattedStr) - offset, "$$\n");
-    fprintf(pOut, "%s", formattedStr);
+    if (id != TRACE_STATEMENT_NONE)
+    {
+        cached->hash = rawHash;
+        cached->id = id;
+    }
+    return id;
+}
+
+const char *traceStatementSql(uint16_t id)
+{
+    pthread_mutex_lock(&statementMutex);
+    const char *sql = id != TRACE_STATEMENT_NONE && id <= nStatements ? statementSql[id - 1] : NULL;
+    pthread_mutex_unlock(&statementMutex);
+    return sql;
+}
+
+int writeStatementTable(FILE *pOut)
+{
+    if (!pOut) return 0;
+
+    pthread_mutex_lock(&statementMutex);
+    int n = (int)nStatements;
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(pOut, "%d\t%s\n", i + 1, statementSql[i]);
+    }
+    pthread_mutex_unlock(&statementMutex);
+    return n;
+}
+
+typedef struct
+{
+    // seq + 1 of the record in the slot, 0 while it is being written.
+    _Atomic uint64_t published;
+    TraceRecord record;
+} TraceRingSlot;
+
+struct TraceRing
+{
+    size_t mask;
+    _Atomic uint64_t end;
+    TraceRingSlot *slots;
+};
+
+TraceRing *traceRingCreate(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    TraceRing *ring = malloc(sizeof(TraceRing));
+    if (!ring) return NULL;
+
+    ring->slots = calloc(size, sizeof(TraceRingSlot));
+    if (!ring->slots)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->end, 0);
+    return ring;
+}
+
+void traceRingDestroy(TraceRing *ring)
+{
+    if (!ring) return;
+    free(ring->slots);
+    free(ring);
+}
+
+size_t traceRingCapacity(const TraceRing *ring)
+{
+    return ring->mask + 1;
+}
+
+uint64_t traceRingEnd(const TraceRing *ring)
+{
+    return atomic_load_explicit(&((TraceRing *)ring)->end, memory_order_acquire);
+}
+
+const TraceRecord *traceRingGet(const TraceRing *ring, uint64_t seq)
+{
+    TraceRingSlot *slot = &ring->slots[seq & ring->mask];
+    if (atomic_load_explicit(&slot->published, memory_order_acquire) != seq + 1) return NULL;
+    return &slot->record;
+}
+
+size_t appendTransactionOp(TransactionOp *transactionOp, TraceRing *ring)
+{
+    if (!transactionOp) return 0;
+
+    size_t written = 0;
+    if (ring)
+    {
+        TraceRecord record;
+        fillTraceRecord(transactionOp, &record);
+
+        TraceRingSlot *slot = &ring->slots[record.seq & ring->mask];
+        atomic_store_explicit(&slot->published, 0, memory_order_release);
+        slot->record = record;
+        atomic_store_explicit(&slot->published, record.seq + 1, memory_order_release);
+
+        uint64_t end = atomic_load_explicit(&ring->end, memory_order_relaxed);
+        while (end < record.seq + 1
+               && !atomic_compare_exchange_weak_explicit(&ring->end, &end, record.seq + 1, memory_order_release,
+                                                         memory_order_relaxed))
+        {
+        }
+        written = sizeof(record);
+    }
 
     destroyTransactionOp(transactionOp);
+    return written;
+}
+
+// Copies `len` bytes of `text` into `buf` under the `valFormatFunc` contract.
+static size_t copyFormatted(char *buf, size_t size, const char *text, size_t len)
+{
+    if (size > 0)
+    {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(buf, text, n);
+        buf[n] = '\0';
+    }
+    return len;
 }
 
-const char* intToString(const void* val)
+size_t formatValue(const Value *value, char *buf, size_t size)
 {
-    static char buffer[32];
-    snprintf(buffer, sizeof(buffer), "%d", *(int*)val);
-    return buffer;
+    if (value == NULL) return copyFormatted(buf, size, "", 0);
+    if (value->len >= 0 && value->val == NULL)
+    {
+        char hash[16];
+        appendHex(hash, value->hash, 16);
+        return copyFormatted(buf, size, hash, sizeof(hash));
+    }
+    if (value->len >= 0)
+    {
+        const char *end = memchr(value->val, '\0', value->len);
+        return copyFormatted(buf, size, value->val, end ? (size_t)(end - (const char *)value->val) : (size_t)value->len);
+    }
+    if (value->format == NULL) return copyFormatted(buf, size, "", 0);
+    if (value->val == NULL) return copyFormatted(buf, size, "<NULL>", 6);
+    return value->format(value->val, buf, size);
+}
+
+size_t formatInt(const void *val, char *buf, size_t size)
+{
+    char text[24];
+    return copyFormatted(buf, size, text, (size_t)(appendSigned(text, *(const int *)val) - text));
+}
+
+size_t formatInt64(const void *val, char *buf, size_t size)
+{
+    char text[24];
+    return copyFormatted(buf, size, text, (size_t)(appendSigned(text, *(const int64_t *)val) - text));
 }
 
-const char* floatToString(const void* val)
+size_t formatFloat(const void *val, char *buf, size_t size)
 {
-    static char buffer[32];
-    snprintf(buffer, sizeof(buffer), "%.2f", *(float*)val);
-    return buffer;
+    int n = snprintf(buf, size, "%.2f", *(const float *)val);
+    return n > 0 ? (size_t)n : 0;
 }
 
-const char* stringToString(const void* val)
+size_t formatDouble(const void *val, char *buf, size_t size)
 {
-    return val;
-}
\ No newline at end of file
+    int n = snprintf(buf, size, "%.17g", *(const double *)val);
+    return n > 0 ? (size_t)n : 0;
+}
+
+size_t formatText(const void *val, char *buf, size_t size)
+{
+    return copyFormatted(buf, size, val, strlen(val));
+}
+
+size_t formatBlob(const void *val, char *buf, size_t size)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    const TraceBlob *blob = val;
+    const unsigned char *data = blob->data;
+    size_t len = blob->len > 0 ? (size_t)blob->len : 0;
+    size_t total = 3 + 2 * len;
+    if (size == 0) return total;
+
+    // x'...' one character at a time, stopping when `buf` is full.
+    size_t n = 0;
+    for (size_t i = 0; i < total && n + 1 < size; i++)
+    {
+        char c;
+        if (i < 2) c = i == 0 ? 'x' : '\'';
+        else if (i == total - 1) c = '\'';
+        else c = hexDigits[(data[(i - 2) / 2] >> ((i - 2) % 2 ? 0 : 4)) & 0xf];
+        buf[n++] = c;
+    }
+    buf[n] = '\0';
+    return total;
+}
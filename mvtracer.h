@@ -1,20 +1,35 @@
 #ifndef MVTRACER_H
 #define MVTRACER_H
 #include <stdio.h>
-
-#endif //MVTRACER_H
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-typedef const char* (*valToStringFunc)(const void*);
+/**
+ * Formats the value at `val` into `buf` like snprintf: at most `size - 1` bytes
+ * and a terminating NUL (nothing if `size` is 0). Returns the length of the
+ * whole text, which is larger than `size - 1` when it was cut short.
+ * Formatters keep no state of their own, so any number of threads may format
+ * at the same time.
+ */
+typedef size_t (*valFormatFunc)(const void *val, char *buf, size_t size);
 
 typedef struct
 {
     const void* val;
-    valToStringFunc func;
+    valFormatFunc format;
+    // Number of bytes at `val` when it was captured by `captureValue`, -1 when `val`
+    // is an aliased pointer that `format` understands.
+    int len;
+    // Length of the original payload; larger than `len` when the capture was capped.
+    int fullLen;
+    // traceHash64 of the full payload, 0 when hashing is off.
+    uint64_t hash;
+    // Set when the Value lives in a TraceArena and is released with it.
+    int inArena;
 } Value;
 
 /**
@@ -25,7 +40,18 @@ typedef enum
     BEGIN,
     COMMIT,
     WRITE,
-    READ
+    READ,
+    // Key range covered by a scan or index range seek: [objectId, upperBound].
+    RANGE,
+    // Transaction rolled back; its writes never happened.
+    ABORT,
+    // Savepoint opened, released or rolled back to. `objectId` is its nesting
+    // level, 1 for the outermost savepoint of the transaction.
+    SAVEPOINT,
+    RELEASE,
+    ROLLBACK_TO,
+    // Number of operation types, not an operation itself.
+    OP_TYPE_COUNT
 } OpType;
 
 typedef struct
@@ -33,9 +59,34 @@ typedef struct
     OpType type;
     int transactionId;
     unsigned long objectId;
+    // Value written by a WRITE, or the hash of the record observed by a READ.
     Value* writeVal;
+    // Columns a READ accessed: bit `i` is column `i`, bit 63 stands for column 63 and above.
+    uint64_t columns;
+    // Root page of the b-tree the operation touched, 0 if unknown.
+    unsigned table;
+    // Thread that executed the operation (getThreadId), 0 if not set.
+    int threadId;
+    // Inclusive upper bound of a RANGE; its lower bound is `objectId`.
+    // TRACE_KEY_MIN / TRACE_KEY_MAX stand for unbounded ends.
+    int64_t upperBound;
+    // TRACE_FLAG_* bits.
+    unsigned flags;
+    // Statement that executed the operation (see traceInternStatement), TRACE_STATEMENT_NONE if unknown.
+    uint16_t statementId;
 } TransactionOp;
 
+#define TRACE_KEY_MIN INT64_MIN
+#define TRACE_KEY_MAX INT64_MAX
+
+// The RANGE was scanned in descending key order.
+#define TRACE_FLAG_BACKWARD 0x01
+// The RANGE or WRITE was on an index b-tree rather than a table's rowids. The
+// objectId of such a WRITE is the traceHash64 of the index key.
+#define TRACE_FLAG_INDEX 0x02
+// The WRITE removed the row or index entry (a tombstone) and carries no value.
+#define TRACE_FLAG_DELETE 0x04
+
 /**
 *
 */
@@ -46,28 +97,309 @@ TransactionOp *trackRead(int transactionId, unsigned long objectId);
 */
 TransactionOp *trackWrite(int transactionId, unsigned long objectId, Value *value);
 
+// WRITE without a value on `table`; `flags` holds TRACE_FLAG_DELETE and/or TRACE_FLAG_INDEX.
+TransactionOp *trackKeyWrite(int transactionId, unsigned table, unsigned long objectId, unsigned flags);
+
+// Maps a column index to its bit in `TransactionOp.columns`.
+#define TRACE_COLUMN_BIT(iCol) (1ull << ((unsigned)(iCol) < 63 ? (unsigned)(iCol) : 63))
+
+TransactionOp *trackRange(int transactionId, unsigned table, int64_t lowerBound, int64_t upperBound,
+                          unsigned flags);
+
 TransactionOp *trackBegin(int transactionId);
 
 TransactionOp *trackEnd(int transactionId);
 
-Value* createValue(const void* val, valToStringFunc func);
+TransactionOp *trackAbort(int transactionId);
+
+// SAVEPOINT, RELEASE or ROLLBACK_TO of the savepoint at `level`; `name` may be NULL.
+TransactionOp *trackSavepoint(OpType type, int transactionId, int level, Value *name);
+
+// Aliases `val`, which must stay valid until the operation is printed: the
+// text sink formats it with `format` only then.
+Value* createValue(const void* val, valFormatFunc format);
+
+/**
+ * Text of a WRITE's value as the text sink prints it after `wVal: `, formatted
+ * into `buf` with the `valFormatFunc` contract: the payload of a captured value
+ * up to its first NUL, the 16 hex digit hash of a hashed one, the formatter's
+ * output for an aliased one and "<NULL>" for an aliased NULL.
+ */
+size_t formatValue(const Value *value, char *buf, size_t size);
+
+// ------------ Value Capture ----------
+// Write payloads are copied into a per-transaction arena instead of aliasing
+// the VDBE's registers, so they stay valid until the arena is reset and can be
+// formatted after the opcode that produced them has moved on.
+#define TRACE_ARENA_CHUNK_SIZE (64 * 1024)
+// `maxLen` passed to `captureValue` to copy the whole payload.
+#define TRACE_VALUE_UNLIMITED 0
+// `maxLen` passed to `captureValue` to copy nothing. Combined with hashing, only
+// the 8-byte hash is kept and logged (value hashing mode).
+#define TRACE_VALUE_NONE (-1)
+
+typedef struct TraceArenaChunk TraceArenaChunk;
+
+typedef struct
+{
+    TraceArenaChunk *chunks;
+} TraceArena;
+
+// Returns 8-byte aligned memory that lives until the next reset. NULL if out of memory.
+void *traceArenaAlloc(TraceArena *arena, size_t size);
+
+// Releases everything allocated since the last reset, keeping one chunk for reuse.
+void traceArenaReset(TraceArena *arena);
+
+void traceArenaDestroy(TraceArena *arena);
+
+// Fast non-cryptographic 64-bit hash of `len` bytes.
+uint64_t traceHash64(const void *data, size_t len);
+
+/**
+ * Copies at most `maxLen` bytes of `data` (all of them for TRACE_VALUE_UNLIMITED)
+ * into `arena` and wraps them in a Value. With `hash` set, the hash of the full
+ * payload is computed as well. Returns NULL if out of memory.
+ */
+Value *captureValue(TraceArena *arena, const void *data, int len, int maxLen, int hash);
 
 /**
  * WARNING: This operation **REMOVES** the object in the input.
  * Prints to `pOut` a transaction in the format:
- * Op: <Operation> \t Tx: <Transaction> \t [obj: <Object ID>] [wVal: <write value>]
+ * Op: <Operation> \t Tx: <Transaction> \t [Stmt: <statement id>] \t [obj: <Object ID>] [wVal: <write value>] [Cols: <READ column bitmap>]
+ * In value hashing mode `wVal` becomes `wHash: <hex>` and READs get `rHash: <hex>`.
+ * RANGEs print as Op: RANGE \t Tx: <Transaction> \t Table: <root> \t Lo: <key> \t Hi: <key> \t Dir: <asc|desc>
+ * with `-inf` / `+inf` for unbounded ends.
+ * Deletes and index writes add `Kind: <delete|index-insert|index-delete>`; index writes print
+ * `Table: <root> \t Key: <key hash>` in place of `obj`.
+ * Savepoint events print as Op: <SAVEPOINT|RELEASE|ROLLBACK_TO> \t Tx: <Transaction> \t Level: <n> [Name: <name>].
  * After printing, it destroys the transactionOp object to prevent memory leaks.
+ * Returns the number of bytes written to `pOut`.
  */
-void printTransactionOp(TransactionOp* transactionOp, FILE *pOut);
+size_t printTransactionOp(TransactionOp* transactionOp, FILE *pOut);
+
+// Name of an OpType as printed by `printTransactionOp`, "UNKNOWN" if out of range.
+const char *opTypeName(OpType type);
+
+// ------------ Binary Trace Format ----------
+// A binary trace is one TraceFileHeader followed by fixed-size TraceRecords,
+// so record `i` always starts at `sizeof(TraceFileHeader) + i * recordSize`.
+#define TRACE_FILE_MAGIC "TRWB"
+#define TRACE_FORMAT_VERSION 7
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t recordSize;
+} TraceFileHeader;
 
-// ------------ Default ToString Functions ----------
-const char* intToString(const void* val);
+typedef struct
+{
+    // Process-wide sequence number; unique, and increasing within a thread.
+    uint64_t seq;
+    // CLOCK_MONOTONIC timestamp in nanoseconds.
+    uint64_t ts;
+    // Row id, or the lower bound of a RANGE.
+    int64_t objectId;
+    // Upper bound of a RANGE.
+    int64_t upperBound;
+    // traceHash64 of the record written (WRITE) or read (READ), 0 when not hashed.
+    uint64_t valueHash;
+    // Column bitmap of a READ (see TransactionOp.columns).
+    uint64_t columns;
+    int32_t transactionId;
+    // Root page of the table or index, 0 if unknown.
+    uint32_t table;
+    // OpType
+    uint8_t type;
+    // TRACE_FLAG_* bits.
+    uint8_t flags;
+    // TransactionOp.statementId
+    uint16_t statementId;
+    // TransactionOp.threadId
+    int32_t threadId;
+} TraceRecord;
 
-const char* floatToString(const void* val);
+void writeTraceFileHeader(FILE *pOut);
 
-const char* stringToString(const void* val);
+/**
+ * WARNING: This operation **REMOVES** the object in the input.
+ * Binary counterpart of `printTransactionOp`: appends one TraceRecord to `pOut`.
+ * Write values are represented by their hash only. Returns the number of bytes written.
+ */
+size_t writeTransactionOp(TransactionOp* transactionOp, FILE *pOut);
+// --------------------------------------------------
+
+// ------------ Trace Index ----------
+// A binary trace can be indexed in a side file (conventionally `<trace>.idx`)
+// so that readers seek to a seq range or a transaction instead of scanning.
+// The index is a TraceIndexHeader followed by TraceIndexEntries, appended as
+// the trace is written: a BLOCK entry every `interval` records with the seq
+// range they span, and a TRANSACTION entry with the records between a
+// transaction's BEGIN and its COMMIT or ABORT when it ends. Finishing the index
+// adds the last partial block, the transactions still open and a
+// TraceIndexTrailer; without the trailer only the BLOCK entries are complete.
+// Records are counted from 0, the first one after the trace's header.
+#define TRACE_INDEX_MAGIC "TRWI"
+#define TRACE_INDEX_TRAILER_MAGIC "TRWF"
+#define TRACE_INDEX_DEFAULT_INTERVAL 4096
+
+typedef struct
+{
+    char magic[4];
+    // TRACE_FORMAT_VERSION of the trace.
+    uint16_t version;
+    uint16_t entrySize;
+    // Records per BLOCK entry.
+    uint32_t interval;
+    uint32_t reserved;
+} TraceIndexHeader;
+
+typedef enum
+{
+    TRACE_INDEX_BLOCK = 1,
+    TRACE_INDEX_TRANSACTION = 2
+} TraceIndexEntryKind;
+
+typedef struct
+{
+    // Records [firstRecord, lastRecord] of the trace. A transaction's range may
+    // include records of transactions that ran concurrently.
+    uint64_t firstRecord;
+    uint64_t lastRecord;
+    // Smallest and largest seq of the block or of the transaction's records.
+    uint64_t minSeq;
+    uint64_t maxSeq;
+    // TRANSACTION entries only.
+    int32_t transactionId;
+    // TraceIndexEntryKind
+    uint8_t kind;
+    uint8_t reserved[3];
+} TraceIndexEntry;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t reserved;
+    // Number of TraceIndexEntries before the trailer.
+    uint64_t entries;
+} TraceIndexTrailer;
+
+typedef struct TraceIndexWriter TraceIndexWriter;
+
+/**
+ * Starts an index of the trace being written, into `pIndex` which stays owned by
+ * the caller. `interval` 0 uses TRACE_INDEX_DEFAULT_INTERVAL. Returns NULL if out
+ * of memory.
+ */
+TraceIndexWriter *traceIndexCreate(FILE *pIndex, uint32_t interval);
+
+// Writes the last block, the open transactions and the trailer, and frees `index`.
+void traceIndexFinish(TraceIndexWriter *index);
+
+/**
+ * WARNING: This operation **REMOVES** the object in the input.
+ * `writeTransactionOp` that also adds the record to `index`, which may be NULL.
+ * Several threads may write to one stream and index at once.
+ */
+size_t writeIndexedTransactionOp(TransactionOp *transactionOp, FILE *pOut, TraceIndexWriter *index);
+// --------------------------------------------------
+
+// ------------ Statement Table ----------
+// Operations carry the id of the statement that executed them: an index into a
+// process-wide table of normalized SQL, in which whitespace runs and comments
+// become one space and literals become `?`, so runs of a statement with
+// different constants share an id. Traces only hold the ids; the table is
+// written once, next to them (conventionally to `<trace>.sql`).
+#define TRACE_STATEMENT_NONE 0
+#define TRACE_MAX_STATEMENTS UINT16_MAX
+
+/**
+ * Writes the normalized form of `sql` to `out`, which must hold strlen(sql) + 1
+ * bytes: the result is never longer than its input. Returns its length.
+ */
+size_t normalizeSql(const char *sql, char *out);
+
+/**
+ * Id of the normalized `sql`, added to the table on first use. Safe to call
+ * from several threads; repeated calls with the same text are answered from a
+ * per-thread cache. TRACE_STATEMENT_NONE if `sql` is NULL, the table is full
+ * or out of memory.
+ */
+uint16_t traceInternStatement(const char *sql);
+
+// Normalized SQL of statement `id`, NULL if unknown. Statements are never removed.
+const char *traceStatementSql(uint16_t id);
+
+/**
+ * Writes the table as one `<id>\t<normalized sql>` line per statement, in id
+ * order. Returns the number of statements written.
+ */
+int writeStatementTable(FILE *pOut);
+// --------------------------------------------------
+
+// ------------ In-memory Trace Ring ----------
+// Fixed-capacity ring of TraceRecords that keeps the most recent ones. A record
+// lives in slot `seq % capacity`, so a record is found by its seq directly and
+// a ring shared with other sinks simply has empty slots for their records.
+// Records are read in place; a slot overwritten while being read may mix two
+// records, which `traceRingGet` detects on the next call.
+#define TRACE_RING_DEFAULT_CAPACITY (1 << 16)
+
+typedef struct TraceRing TraceRing;
+
+// `capacity` is rounded up to a power of two. Returns NULL if out of memory.
+TraceRing *traceRingCreate(size_t capacity);
+
+void traceRingDestroy(TraceRing *ring);
+
+size_t traceRingCapacity(const TraceRing *ring);
+
+// One past the largest seq appended so far.
+uint64_t traceRingEnd(const TraceRing *ring);
+
+// The record with sequence number `seq`, or NULL if it was never appended or has been overwritten.
+const TraceRecord *traceRingGet(const TraceRing *ring, uint64_t seq);
+
+/**
+ * WARNING: This operation **REMOVES** the object in the input.
+ * Ring counterpart of `writeTransactionOp`. Safe to call from several threads.
+ * Returns the number of bytes stored, 0 if `ring` is NULL.
+ */
+size_t appendTransactionOp(TransactionOp *transactionOp, TraceRing *ring);
+// --------------------------------------------------
+
+// ------------ Value Formatters ----------
+// `valFormatFunc`s for common types. The text sink appends int, int64_t and
+// text values directly, without calling them.
+// int, "%d".
+size_t formatInt(const void *val, char *buf, size_t size);
+
+// int64_t, "%lld".
+size_t formatInt64(const void *val, char *buf, size_t size);
+
+// float, "%.2f".
+size_t formatFloat(const void *val, char *buf, size_t size);
+
+// double, "%.17g": enough digits to read the same double back.
+size_t formatDouble(const void *val, char *buf, size_t size);
+
+// NUL-terminated string, as is.
+size_t formatText(const void *val, char *buf, size_t size);
+
+typedef struct
+{
+    const void *data;
+    int len;
+} TraceBlob;
+
+// TraceBlob, as an SQL blob literal: x'00ff...'.
+size_t formatBlob(const void *val, char *buf, size_t size);
 // --------------------------------------------------
 
 #ifdef __cplusplus
 }
 #endif
+
+#endif //MVTRACER_H
@@ -122,6 +122,9 @@ typedef unsigned short int u16;
 typedef sqlite3_int64 i64;
 typedef sqlite3_uint64 u64;
 typedef unsigned char u8;
+#ifdef SQLITE_TRW_INSTRUMENT
+# include "sqlite3TraceAdapter.h"
+#endif
 #if SQLITE_USER_AUTHENTICATION
 # include "sqlite3userauth.h"
 #endif
@@ -19423,6 +19426,11 @@ struct ShellState {
   FILE *in;              /* Read commands from this stream */
   FILE *out;             /* Write results here */
   FILE *traceOut;        /* Output for sqlite3_trace() */
+#ifdef SQLITE_TRW_INSTRUMENT
+  FILE *trwOut;          /* Output of the TRW tracer, if a file */
+  FILE *trwIndex;        /* Index of a binary trwOut */
+  u8 bTrwSink;           /* True once ".trw sink" has chosen a sink */
+#endif
   int nErr;              /* Number of errors seen */
   int mode;              /* An output mode setting */
   int modePrior;         /* Saved mode */
@@ -23010,6 +23018,25 @@ static const char *(azHelp[]) = {
   "                           Run \".testctrl\" with no arguments for details",
   ".timeout MS              Try opening locked tables for MS milliseconds",
   ".timer on|off            Turn SQL timer on or off",
+#ifdef SQLITE_TRW_INSTRUMENT
+  ".trw CMD ...             Control the read/write tracer",
+  "    on|off                  Start or stop tracing",
+  "    sink FILE               Trace as text to FILE (stdout by default)",
+  "    sink binary FILE        Trace binary records to FILE, indexed in FILE.idx",
+  "    sink ring|null          Keep records in the trw_trace ring, or drop them",
+  "    filter ARG ...          Trace only what every ARG matches:",
+  "       table=T1,T2              Tables T1, T2 and their indexes",
+  "       db=main,aux              Databases main and aux",
+  "       rowid=LO..HI             Table rows LO to HI",
+  "       op=READ,WRITE            Operations of these types",
+  "    filter off              Trace everything",
+  "    stats ?on|off|reset?    Show statistics, or time the opcode hooks",
+  "    statements ?FILE?       Show the SQL of the statement ids in the trace",
+  "    profile on|off|reset    Profile opcodes per statement (nExec/nCycle)",
+  "    profile report          Show the profile per opcode and statement",
+  "    profile folded FILE     Write the profile as folded stacks to FILE",
+  "    flush                   Flush the trace output",
+#endif
 #ifndef SQLITE_OMIT_TRACE
   ".trace ?OPTIONS?         Output each SQL statement as it is run",
   "    FILE                    Send output to FILE",
@@ -23576,6 +23603,10 @@ static void open_db(ShellState *p, int openFlags){
     sqlite3_db_config(
         p->db, SQLITE_DBCONFIG_STMT_SCANSTATUS, p->scanstatsOn, (int*)0
     );
+#ifdef SQLITE_TRW_INSTRUMENT
+    /* ".trw profile" reads the same per-op counters */
+    if( sqlite3_trw_profiling() ) sqlite3_trw_profile_db(p->db, 1);
+#endif
   }
 }
 
@@ -26077,6 +26108,338 @@ static int faultsim_callback(int iArg){
   return faultsim_state.iErr;
 }
 
+#ifdef SQLITE_TRW_INSTRUMENT
+/*
+** Switch the TRW tracer to a new sink.  pOut and pIndex, the index of a
+** binary pOut, become owned by the shell and the previous files, if any,
+** are closed.
+*/
+static void trw_set_sink(ShellState *p, TraceSinkType eSink, FILE *pOut,
+                         FILE *pIndex){
+  FILE *pOld = p->trwOut;
+  setTraceSink(eSink, pOut);
+  if( pIndex ) setTraceIndex(pIndex, 0);
+  if( p->trwIndex ) fclose(p->trwIndex);
+  p->trwIndex = pIndex;
+  p->trwOut = pOut;
+  p->bTrwSink = 1;
+  if( pOld && pOld!=pOut ){
+    fflush(pOld);
+    output_file_close(pOld);
+  }
+}
+
+/*
+** Finish the index of the TRW tracer's sink, if any, and close the files
+** the shell opened for it.  Called as the shell exits, as otherwise the
+** index would be left without its trailer.
+*/
+static void trw_close_sink(ShellState *p){
+  if( p->bTrwSink ) trw_set_sink(p, TRACE_SINK_NULL, 0, 0);
+}
+
+/*
+** Resolve a comma-separated list of table names (or root page numbers) into
+** the root pages of the tables and of their indexes, and install them as the
+** tracer's table filter.  Return non-zero on error.
+*/
+static int trw_filter_tables(ShellState *p, const char *zList){
+  unsigned *aRoot = 0;
+  int nRoot = 0;
+  int rc = 0;
+  char *zCopy = sqlite3_mprintf("%s", zList);
+  char *zName;
+  sqlite3_stmt *pStmt = 0;
+  shell_check_oom(zCopy);
+  rc = sqlite3_prepare_v2(p->db,
+          "SELECT rootpage FROM sqlite_schema"
+          " WHERE tbl_name=?1 COLLATE nocase AND rootpage>0", -1, &pStmt, 0);
+  if( rc ){
+    eputf("Error: %s\n", sqlite3_errmsg(p->db));
+    sqlite3_free(zCopy);
+    return 1;
+  }
+  for(zName=strtok(zCopy, ","); zName && rc==0; zName=strtok(0, ",")){
+    int nFound = 0;
+    if( IsDigit(zName[0]) ){
+      aRoot = sqlite3_realloc64(aRoot, (nRoot+1)*sizeof(aRoot[0]));
+      shell_check_oom(aRoot);
+      aRoot[nRoot++] = (unsigned)integerValue(zName);
+      continue;
+    }
+    sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+    while( sqlite3_step(pStmt)==SQLITE_ROW ){
+      aRoot = sqlite3_realloc64(aRoot, (nRoot+1)*sizeof(aRoot[0]));
+      shell_check_oom(aRoot);
+      aRoot[nRoot++] = (unsigned)sqlite3_column_int64(pStmt, 0);
+      nFound++;
+    }
+    sqlite3_reset(pStmt);
+    if( nFound==0 ){
+      eputf("Error: no such table: %s\n", zName);
+      rc = 1;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  if( rc==0 && nRoot==0 ){
+    eputz("Error: no tables given\n");
+    rc = 1;
+  }
+  if( rc==0 && sqlite3_trw_filter_tables(aRoot, nRoot) ){
+    shell_out_of_memory();
+  }
+  sqlite3_free(aRoot);
+  sqlite3_free(zCopy);
+  return rc;
+}
+
+/*
+** Resolve a comma-separated list of schema names ("main", "temp", attached
+** databases) into a bitmask of their indexes and install it as the tracer's
+** database filter.  Return non-zero on error.
+*/
+static int trw_filter_dbs(ShellState *p, const char *zList){
+  unsigned mask = 0;
+  int rc = 0;
+  char *zCopy = sqlite3_mprintf("%s", zList);
+  char *zName;
+  sqlite3_stmt *pStmt = 0;
+  shell_check_oom(zCopy);
+  rc = sqlite3_prepare_v2(p->db,
+          "SELECT seq FROM pragma_database_list WHERE name=?1 COLLATE nocase",
+          -1, &pStmt, 0);
+  if( rc ){
+    eputf("Error: %s\n", sqlite3_errmsg(p->db));
+    sqlite3_free(zCopy);
+    return 1;
+  }
+  for(zName=strtok(zCopy, ","); zName && rc==0; zName=strtok(0, ",")){
+    sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+    if( sqlite3_stricmp(zName, "temp")==0 ){
+      /* Not listed until something creates the temp database */
+      mask |= 1u << 1;
+    }else if( sqlite3_step(pStmt)==SQLITE_ROW && sqlite3_column_int(pStmt, 0)<32 ){
+      mask |= 1u << sqlite3_column_int(pStmt, 0);
+    }else{
+      eputf("Error: no such database: %s\n", zName);
+      rc = 1;
+    }
+    sqlite3_reset(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zCopy);
+  if( rc==0 && mask==0 ){
+    eputz("Error: no databases given\n");
+    rc = 1;
+  }
+  if( rc==0 ) sqlite3_trw_filter_schemas(mask);
+  return rc;
+}
+
+/*
+** Install the tracer's row id filter from "LO..HI".  Either bound may be
+** left out.  Return non-zero on error.
+*/
+static int trw_filter_rowids(const char *zRange){
+  const char *zDots = strstr(zRange, "..");
+  sqlite3_int64 iLo = TRACE_KEY_MIN, iHi = TRACE_KEY_MAX;
+  if( zDots==0 ){
+    eputf("Error: expected rowid=LO..HI, got %s\n", zRange);
+    return 1;
+  }
+  if( zDots>zRange ) iLo = integerValue(zRange);
+  if( zDots[2] ) iHi = integerValue(zDots+2);
+  if( iLo>iHi ){
+    eputf("Error: empty rowid range %s\n", zRange);
+    return 1;
+  }
+  sqlite3_trw_filter_rowids(iLo, iHi);
+  return 0;
+}
+
+/*
+** Install the tracer's operation filter from a comma-separated list of
+** operation type names.  Return non-zero on error.
+*/
+static int trw_filter_ops(const char *zList){
+  unsigned mask = 0;
+  int rc = 0;
+  char *zCopy = sqlite3_mprintf("%s", zList);
+  char *zName;
+  shell_check_oom(zCopy);
+  for(zName=strtok(zCopy, ","); zName && rc==0; zName=strtok(0, ",")){
+    int i;
+    for(i=0; i<OP_TYPE_COUNT; i++){
+      if( sqlite3_stricmp(zName, opTypeName((OpType)i))==0 ) break;
+    }
+    if( i==OP_TYPE_COUNT ){
+      eputf("Error: no such operation: %s\n", zName);
+      rc = 1;
+    }else{
+      mask |= 1u << i;
+    }
+  }
+  sqlite3_free(zCopy);
+  if( rc==0 && mask==0 ){
+    eputz("Error: no operations given\n");
+    rc = 1;
+  }
+  if( rc==0 ) sqlite3_trw_filter_ops(mask);
+  return rc;
+}
+
+/*
+** Print the tracer's statistics: events per operation type, output volume,
+** drops and, when the opcode hooks are being timed, their calls and cost.
+*/
+static void trw_show_stats(void){
+  TraceStats st;
+  TraceHookStats *pHooks;
+  unsigned long long nCall = 0, nNano = 0;
+  int i;
+  sqlite3_trw_stats(&st);
+  oputf("%-24s %s\n", "Tracing:", sqlite3_trw_enabled() ? "on" : "off");
+  for(i=0; i<OP_TYPE_COUNT; i++){
+    oputf("Events %-17s %llu\n", opTypeName((OpType)i), st.events[i]);
+  }
+  oputf("%-24s %llu\n", "Bytes written:", st.bytes);
+  oputf("%-24s %llu\n", "Dropped by filter:", st.dropped);
+  oputf("%-24s %llu\n", "Lost by sink:", st.lost);
+  if( !sqlite3_trw_hooks_profiled() ) return;
+  pHooks = sqlite3_malloc64(sizeof(*pHooks));
+  shell_check_oom(pHooks);
+  sqlite3_trw_hook_stats(pHooks);
+  for(i=0; i<256; i++){
+    if( pHooks->calls[i]==0 ) continue;
+    oputf("Hook %-19s %llu calls, %.1f ns/op\n", sqlite3OpcodeName(i),
+          pHooks->calls[i], (double)pHooks->nanos[i]/pHooks->calls[i]);
+    nCall += pHooks->calls[i];
+    nNano += pHooks->nanos[i];
+  }
+  oputf("%-24s %llu calls, %.1f ns/op\n", "Hook overhead:",
+        nCall, nCall ? (double)nNano/nCall : 0.0);
+  sqlite3_free(pHooks);
+}
+
+/*
+** Implementation of the ".trw" command.  Return non-zero on error.
+*/
+static int trw_command(ShellState *p, char **azArg, int nArg){
+  const char *zCmd = nArg>=2 ? azArg[1] : "";
+  int n = (int)strlen(zCmd);
+  if( n==0 ) goto trw_usage;
+  if( cli_strcmp(zCmd, "on")==0 || cli_strcmp(zCmd, "off")==0 ){
+    if( nArg!=2 ) goto trw_usage;
+    if( zCmd[1]=='n' && !p->bTrwSink ) trw_set_sink(p, TRACE_SINK_TEXT, stdout, 0);
+    sqlite3_trw_enable(zCmd[1]=='n');
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "sink", n)==0 ){
+    FILE *pOut;
+    if( nArg==3 && cli_strcmp(azArg[2], "null")==0 ){
+      trw_set_sink(p, TRACE_SINK_NULL, 0, 0);
+    }else if( nArg==3 && cli_strcmp(azArg[2], "ring")==0 ){
+      if( sqlite3_trw_ring()==0 ) shell_out_of_memory();
+      trw_set_sink(p, TRACE_SINK_RING, 0, 0);
+    }else if( nArg==4 && cli_strcmp(azArg[2], "binary")==0 ){
+      char *zIndex;
+      if( (pOut = output_file_open(azArg[3], 0))==0 ) return 1;
+      zIndex = sqlite3_mprintf("%s" TRACE_INDEX_SUFFIX, azArg[3]);
+      shell_check_oom(zIndex);
+      trw_set_sink(p, TRACE_SINK_BINARY, pOut, fopen(zIndex, "wb"));
+      sqlite3_free(zIndex);
+    }else if( nArg==3 ){
+      if( (pOut = output_file_open(azArg[2], 1))==0 ) return 1;
+      trw_set_sink(p, TRACE_SINK_TEXT, pOut, 0);
+    }else{
+      goto trw_usage;
+    }
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "filter", n)==0 ){
+    int i;
+    if( nArg<3 ) goto trw_usage;
+    if( nArg==3 && cli_strcmp(azArg[2], "off")==0 ){
+      sqlite3_trw_filter_tables(0, 0);
+      sqlite3_trw_filter_schemas(0);
+      sqlite3_trw_filter_rowids(TRACE_KEY_MIN, TRACE_KEY_MAX);
+      sqlite3_trw_filter_ops(0);
+      return 0;
+    }
+    open_db(p, 0);
+    for(i=2; i<nArg; i++){
+      const char *zArg = azArg[i];
+      int rc;
+      if( cli_strncmp(zArg, "table=", 6)==0 ){
+        rc = trw_filter_tables(p, zArg+6);
+      }else if( cli_strncmp(zArg, "db=", 3)==0 ){
+        rc = trw_filter_dbs(p, zArg+3);
+      }else if( cli_strncmp(zArg, "rowid=", 6)==0 ){
+        rc = trw_filter_rowids(zArg+6);
+      }else if( cli_strncmp(zArg, "op=", 3)==0 ){
+        rc = trw_filter_ops(zArg+3);
+      }else{
+        goto trw_usage;
+      }
+      if( rc ) return rc;
+    }
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "stats", n)==0 ){
+    if( nArg==2 ){
+      trw_show_stats();
+    }else if( nArg==3 && cli_strcmp(azArg[2], "reset")==0 ){
+      sqlite3_trw_reset_stats();
+    }else if( nArg==3 ){
+      sqlite3_trw_profile_hooks(booleanValue(azArg[2]));
+    }else{
+      goto trw_usage;
+    }
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "statements", n)==0 && nArg<=3 ){
+    FILE *pOut = nArg==3 ? output_file_open(azArg[2], 1) : stdout;
+    if( pOut==0 ) return 1;
+    writeStatementTable(pOut);
+    output_file_close(pOut);
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "profile", n)==0 && nArg>=3 ){
+    if( nArg==3 && cli_strcmp(azArg[2], "report")==0 ){
+      sqlite3_trw_profile_report(stdout);
+    }else if( nArg==3 && cli_strcmp(azArg[2], "reset")==0 ){
+      sqlite3_trw_profile_reset();
+    }else if( nArg==4 && cli_strcmp(azArg[2], "folded")==0 ){
+      FILE *pOut = output_file_open(azArg[3], 1);
+      if( pOut==0 ) return 1;
+      sqlite3_trw_profile_folded(pOut);
+      output_file_close(pOut);
+    }else if( nArg==3 ){
+      int on = booleanValue(azArg[2]);
+      if( sqlite3_trw_profile(on) ){
+        eputz("Error: opcode counters are not available in this build\n");
+        return 1;
+      }
+      /* The VDBE only counts for connections with STMT_SCANSTATUS on, which
+      ** open_db() turns off; ".scanstats on" keeps it on after profiling. */
+      open_db(p, 0);
+      sqlite3_trw_profile_db(p->db, on || p->scanstatsOn);
+    }else{
+      goto trw_usage;
+    }
+    return 0;
+  }
+  if( cli_strncmp(zCmd, "flush", n)==0 && nArg==2 ){
+    sqlite3_trw_flush();
+    return 0;
+  }
+trw_usage:
+  eputz("Usage: .trw on|off|sink|filter|stats|statements|profile|flush ...\n"
+        "   Run \".help trw\" for details\n");
+  return 1;
+}
+#endif /* SQLITE_TRW_INSTRUMENT */
+
 /*
 ** If an input line begins with "." then invoke this routine to
 ** process that line.
@@ -26631,7 +26994,12 @@ static int do_meta_command(char *zLine, ShellState *p){
 
 #ifndef SQLITE_SHELL_FIDDLE
   if( c=='e' && cli_strncmp(azArg[0], "exit", n)==0 ){
-    if( nArg>1 && (rc = (int)integerValue(azArg[1]))!=0 ) exit(rc);
+    if( nArg>1 && (rc = (int)integerValue(azArg[1]))!=0 ){
+#ifdef SQLITE_TRW_INSTRUMENT
+      trw_close_sink(p);
+#endif
+      exit(rc);
+    }
     rc = 2;
   }else
 #endif
@@ -28088,6 +28456,9 @@ static int do_meta_command(char *zLine, ShellState *p){
       sqlite3_db_config(
           p->db, SQLITE_DBCONFIG_STMT_SCANSTATUS, p->scanstatsOn, (int*)0
       );
+#ifdef SQLITE_TRW_INSTRUMENT
+      if( sqlite3_trw_profiling() ) sqlite3_trw_profile_db(p->db, 1);
+#endif
 #if !defined(SQLITE_ENABLE_STMT_SCANSTATUS)
       eputz("Warning: .scanstats not available in this build.\n");
 #elif !defined(SQLITE_ENABLE_BYTECODE_VTAB)
@@ -29331,6 +29702,12 @@ static int do_meta_command(char *zLine, ShellState *p){
     }
   }else
 
+#ifdef SQLITE_TRW_INSTRUMENT
+  if( c=='t' && n>=3 && cli_strncmp(azArg[0], "trw", n)==0 ){
+    rc = trw_command(p, azArg, nArg);
+  }else
+#endif
+
 #ifndef SQLITE_OMIT_TRACE
   if( c=='t' && cli_strncmp(azArg[0], "trace", n)==0 ){
     int mType = 0;
@@ -30622,6 +30999,13 @@ int SQLITE_CDECL wmain(int argc, wchar_t **wargv){
       exit(1);
     }
   }
+#ifdef SQLITE_TRW_INSTRUMENT
+  {
+    /* Wrap the default VFS so that PRAGMA trw_trace can toggle tracing. */
+    extern int sqlite3_trw_init(void);
+    sqlite3_trw_init();
+  }
+#endif
 
   if( data.pAuxDb->zDbFilename==0 ){
 #ifndef SQLITE_OMIT_MEMORYDB
@@ -30940,6 +31324,9 @@ int SQLITE_CDECL wmain(int argc, wchar_t **wargv){
       close_db(data.aAuxDb[i].db);
     }
   }
+#ifdef SQLITE_TRW_INSTRUMENT
+  trw_close_sink(&data);
+#endif
   find_home_dir(1);
   output_reset(&data);
   data.doXdgOpen = 0;
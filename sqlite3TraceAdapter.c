@@ -1,16 +1,31 @@
 #include "sqlite3TraceAdapter.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define COLUMN_OP_NAME "Column"
 #define ROW_ID_OP_NAME "Rowid"
 #define AUTOCOMMIT_OP_NAME "AutoCommit"
+#define CLOSE_OP_NAME "Close"
+#define HALT_OP_NAME "Halt"
+#define IDX_DELETE_OP_NAME "IdxDelete"
+#define SAVEPOINT_OP_NAME "Savepoint"
+#define TRANSACTION_OP_NAME "Transaction"
+#define INIT_OP_NAME "Init"
+#define PROGRAM_OP_NAME "Program"
 
-static const char* cursorOperations[9] = {
+static const char* cursorOperations[14] = {
     "Next",
     "Rewind",
     "Prev",
-    "SeekRowId",
+    "Last",
+    "SeekRowid",
+    "SeekGE",
+    "SeekGT",
+    "SeekLE",
+    "SeekLT",
     "Found",
     "NotFound",
     "IsUnique",
@@ -18,18 +33,47 @@ static const char* cursorOperations[9] = {
     "NoConflict"
 };
 
-int isCursorMovement(u8 opCode)
+static const char* openCursorOperations[2] = {
+    "OpenRead",
+    "OpenWrite"
+};
+
+// Opcodes that start a scan, and the direction they scan in.
+static const char* forwardScanOperations[3] = {
+    "Rewind",
+    "SeekGE",
+    "SeekGT"
+};
+
+static const char* backwardScanOperations[3] = {
+    "Last",
+    "SeekLE",
+    "SeekLT"
+};
+
+static const char* stepOperations[2] = {
+    "Next",
+    "Prev"
+};
+
+static int matchesAny(const char* const* names, int count, u8 opCode)
 {
-    int match = 0;
-    for (int i = 0; i < sizeof(cursorOperations) / sizeof(cursorOperations[0]); i++)
+    const char* name = sqlite3OpcodeName(opCode);
+    for (int i = 0; i < count; i++)
     {
-        match |= strcmp(cursorOperations[i], sqlite3OpcodeName(opCode)) == 0;
-        if (match) return 1;
+        if (strcmp(names[i], name) == 0) return 1;
     }
 
     return 0;
 }
 
+#define MATCHES_ANY(names, opCode) matchesAny(names, sizeof(names) / sizeof(names[0]), opCode)
+
+int isCursorMovement(u8 opCode)
+{
+    return MATCHES_ANY(cursorOperations, opCode);
+}
+
 int isColumnOp(u8 opCode)
 {
     return strcmp(sqlite3OpcodeName(opCode), COLUMN_OP_NAME) == 0;
@@ -45,6 +89,61 @@ int isAutocommitOp(u8 opCode)
     return strcmp(sqlite3OpcodeName(opCode), AUTOCOMMIT_OP_NAME) == 0;
 }
 
+int isOpenCursorOp(u8 opCode)
+{
+    return MATCHES_ANY(openCursorOperations, opCode);
+}
+
+int isCloseOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), CLOSE_OP_NAME) == 0;
+}
+
+int isHaltOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), HALT_OP_NAME) == 0;
+}
+
+int isForwardScanOp(u8 opCode)
+{
+    return MATCHES_ANY(forwardScanOperations, opCode);
+}
+
+int isBackwardScanOp(u8 opCode)
+{
+    return MATCHES_ANY(backwardScanOperations, opCode);
+}
+
+int isStepOp(u8 opCode)
+{
+    return MATCHES_ANY(stepOperations, opCode);
+}
+
+int isIdxDeleteOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), IDX_DELETE_OP_NAME) == 0;
+}
+
+int isSavepointOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), SAVEPOINT_OP_NAME) == 0;
+}
+
+int isTransactionOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), TRANSACTION_OP_NAME) == 0;
+}
+
+int isInitOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), INIT_OP_NAME) == 0;
+}
+
+int isProgramOp(u8 opCode)
+{
+    return strcmp(sqlite3OpcodeName(opCode), PROGRAM_OP_NAME) == 0;
+}
+
 int checkVdbeOp(VdbeOp *op, vdbeOpCheckPredicate predicate)
 {
     return predicate(op->opcode);
@@ -58,12 +157,20 @@ TraceState* initTraceState()
     traceState->readOp = NULL;
     traceState->writeOp = NULL;
     traceState->rowId = -1;
+    traceState->cursor = -1;
+    traceState->readHash = 0;
+    traceState->columns = 0;
 
     return traceState;
 }
 
+// Frees the state along with any operation it still holds.
 void freeTraceState(TraceState *traceState)
 {
+    if (!traceState) return;
+
+    if (traceState->readOp) printTransactionOp(traceState->readOp, NULL);
+    if (traceState->writeOp) printTransactionOp(traceState->writeOp, NULL);
     free(traceState);
 }
 
@@ -71,72 +178,1484 @@ void freeTraceState(TraceState *traceState)
 // ---- Actual Interceptor Implementation ---
 // ------------------------------------------
 
-__thread TraceState *currentTraceState = NULL;
+// Statements run from inside the step of another statement that are told apart.
+#define TRACE_MAX_NESTED_STATEMENTS 4
+
+// Tracing state of one connection, or of one thread for the process-wide context.
+typedef struct
+{
+    // Cursor of the latest read, which is pending while that cursor is `reading`.
+    // At most one read is pending. Reads through cursors that are not tracked
+    // are kept in `untracked`.
+    int readCursor;
+    TraceCursor untracked;
+    // Row named by setRowId for the next read, when `hasNextRowId`.
+    int hasNextRowId;
+    int64_t nextRowId;
+    // Write payloads of the current transaction.
+    TraceArena arena;
+    // Open cursors of the running statement, indexed by cursor number.
+    TraceCursor cursors[TRACE_MAX_CURSORS];
+    // Inside a transaction opened by BEGIN or by a SAVEPOINT outside of one.
+    int inTransaction;
+    // The transaction was opened by its outermost savepoint, so releasing that savepoint commits it.
+    int savepointTransaction;
+    // Names of the open savepoints, outermost first.
+    char **savepoints;
+    int nSavepoint;
+    int nSavepointAlloc;
+    // The transaction was opened for a single autocommit statement and ends with it.
+    int implicitTransaction;
+    // The current transaction has written something.
+    int wrote;
+    // Trigger sub-programs the statement is running in, and whether the next
+    // program to start is one of them (it was just entered through OP_Program).
+    int frameDepth;
+    int enteringFrame;
+    // Top-level statements started and not halted yet, innermost last, with
+    // their ids in the statement table. Operations are attributed to the
+    // innermost one; trigger programs to the statement that fired them.
+    struct
+    {
+        sqlite3_stmt *stmt;
+        uint16_t id;
+    } statements[TRACE_MAX_NESTED_STATEMENTS];
+    int nStatements;
+    uint16_t statementId;
+} TraceSession;
+
+static __thread TraceSession currentSession;
 FILE *traceFile = NULL;
 
-void sqlite3TraceInterceptor(VdbeOp *pOp)
+// Roots below this are looked up in a filter's bitmap, the others by binary search.
+#define TRACE_FILTER_BITMAP_ROOTS 4096
+
+// What a context records, checked where operations are captured so that a
+// rejected one costs no allocation, copy, hash or formatting.
+typedef struct
+{
+    // Bitmask of `1 << OpType` to record; 0 records every operation.
+    unsigned opTypeMask;
+    // Bitmask of the databases (iDb) to record; 0 records every database.
+    unsigned schemaMask;
+    // Root pages to record; nRoots == 0 records every table. Small roots are
+    // set in `rootBitmap`, the others are kept sorted in `largeRoots`.
+    int nRoots;
+    uint64_t rootBitmap[TRACE_FILTER_BITMAP_ROOTS / 64];
+    unsigned *largeRoots;
+    int nLargeRoots;
+    // Table rows to record, and the ranges that overlap them.
+    int64_t minRowId;
+    int64_t maxRowId;
+} TraceFilter;
+
+// TraceStats as a context keeps it. Every thread tracing into the process-wide
+// context counts into the same one, so the counters are updated atomically.
+typedef struct
+{
+    _Atomic unsigned long long events[OP_TYPE_COUNT];
+    _Atomic unsigned long long dropped;
+    _Atomic unsigned long long bytes;
+    _Atomic unsigned long long lost;
+} TraceCounters;
+
+#define TRACE_COUNT(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+
+struct TraceContext
+{
+    sqlite3 *db;
+    TraceSinkType sink;
+    FILE *out;
+    int enabled;
+    TraceFilter filter;
+    int nextTransactionId;
+    // Transaction the connection is currently in, assigned at BEGIN.
+    int transactionId;
+    // A connection runs on one thread at a time, so its session needs no TLS.
+    TraceSession session;
+    int maxValueBytes;
+    int hashValues;
+    TraceCounters stats;
+    char *buffer;
+    // Where the statement table goes when the context is destroyed: next to its own file.
+    char *statementsPath;
+    // Index of a BINARY sink's output, and the stream it is written to when the context owns it.
+    TraceIndexWriter *index;
+    FILE *indexOut;
+};
+
+// Process-wide context used by the legacy hooks and by connections without an attached context.
+// Its session lives in `currentSession` and its transactions are identified by thread id.
+static TraceContext defaultContext = {
+    .sink = TRACE_SINK_TEXT,
+    .filter = {.minRowId = TRACE_KEY_MIN, .maxRowId = TRACE_KEY_MAX},
+};
+
+// Number of enabled contexts, the default one included, plus one while the VDBE
+// profiler runs. Zero means every hook is a no-op.
+static _Atomic int traceActive = 0;
+
+// The VDBE profiler (see sqlite3_trw_profile) sees every opcode, traced or not.
+static _Atomic int vdbeProfiling = 0;
+
+#define TRACE_CLIENTDATA_KEY "trw"
+
+// The one check every hook pays while tracing is off.
+#define TRACE_DISABLED() __builtin_expect(!atomic_load_explicit(&traceActive, memory_order_relaxed), 1)
+
+static void ensureOpcodeConfig();
+
+static void setContextEnabled(TraceContext *ctx, int onoff)
+{
+    onoff = onoff != 0;
+    if (ctx->enabled == onoff) return;
+
+    if (onoff) ensureOpcodeConfig();
+    ctx->enabled = onoff;
+    atomic_fetch_add_explicit(&traceActive, onoff ? 1 : -1, memory_order_relaxed);
+}
+
+// Resolves the context of the connection executing the current VDBE.
+static TraceContext *lookupContext(sqlite3 *db)
+{
+    if (db != NULL)
+    {
+        TraceContext *ctx = sqlite3_get_clientdata(db, TRACE_CLIENTDATA_KEY);
+        if (ctx != NULL) return ctx->enabled ? ctx : NULL;
+    }
+    return defaultContext.enabled ? &defaultContext : NULL;
+}
+
+static TraceSession *sessionOf(TraceContext *ctx)
+{
+    return ctx == &defaultContext ? &currentSession : &ctx->session;
+}
+
+static int currentTransactionId(TraceContext *ctx)
+{
+    return ctx == &defaultContext ? getThreadId() : ctx->transactionId;
+}
+
+static int compareRoots(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int setFilterTables(TraceFilter *filter, const unsigned *roots, int n)
+{
+    unsigned *largeRoots = NULL;
+    int nLarge = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (roots[i] >= TRACE_FILTER_BITMAP_ROOTS) nLarge++;
+    }
+    if (nLarge > 0)
+    {
+        largeRoots = malloc(nLarge * sizeof(unsigned));
+        if (!largeRoots) return SQLITE_NOMEM;
+    }
+
+    memset(filter->rootBitmap, 0, sizeof(filter->rootBitmap));
+    nLarge = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (roots[i] < TRACE_FILTER_BITMAP_ROOTS) filter->rootBitmap[roots[i] / 64] |= 1ull << (roots[i] % 64);
+        else largeRoots[nLarge++] = roots[i];
+    }
+    if (nLarge > 1) qsort(largeRoots, nLarge, sizeof(unsigned), compareRoots);
+
+    free(filter->largeRoots);
+    filter->largeRoots = largeRoots;
+    filter->nLargeRoots = nLarge;
+    filter->nRoots = n > 0 ? n : 0;
+    return SQLITE_OK;
+}
+
+static int opFiltered(const TraceFilter *filter, OpType type)
+{
+    return filter->opTypeMask && !(filter->opTypeMask & (1u << type));
+}
+
+// Whether the b-tree rooted at `root` in database `iDb` is filtered out. Cursors
+// not open on a b-tree (root 0) always pass.
+static int treeFiltered(const TraceFilter *filter, int iDb, unsigned root)
+{
+    if (root == 0) return 0;
+    if (filter->schemaMask && (iDb < 0 || iDb >= 32 || !(filter->schemaMask & (1u << iDb)))) return 1;
+    if (filter->nRoots == 0) return 0;
+    if (root < TRACE_FILTER_BITMAP_ROOTS) return !(filter->rootBitmap[root / 64] >> (root % 64) & 1);
+    return bsearch(&root, filter->largeRoots, filter->nLargeRoots, sizeof(unsigned), compareRoots) == NULL;
+}
+
+// Row ids only filter table rows; index entries and unbounded index scans pass.
+static int rowsFiltered(const TraceFilter *filter, const TraceCursor *cursor, int64_t lo, int64_t hi)
+{
+    if (cursor && (cursor->flags & TRACE_FLAG_INDEX)) return 0;
+    return hi < filter->minRowId || lo > filter->maxRowId;
+}
+
+// Checks an operation about to be captured through `cursor` (NULL for none)
+// against the context's filter, and counts it as dropped if it is rejected.
+static int captureFiltered(TraceContext *ctx, OpType type, const TraceCursor *cursor)
+{
+    if (opFiltered(&ctx->filter, type) || (cursor && cursor->filtered))
+    {
+        TRACE_COUNT(ctx->stats.dropped, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static int captureRowsFiltered(TraceContext *ctx, const TraceCursor *cursor, int64_t lo, int64_t hi)
+{
+    if (rowsFiltered(&ctx->filter, cursor, lo, hi))
+    {
+        TRACE_COUNT(ctx->stats.dropped, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void emitTransactionOp(TraceContext *ctx, TransactionOp *transactionOp)
+{
+    if (!transactionOp) return;
+
+    TRACE_COUNT(ctx->stats.events[transactionOp->type], 1);
+    transactionOp->threadId = getThreadId();
+    transactionOp->statementId = sessionOf(ctx)->statementId;
+
+    size_t written;
+    switch (ctx->sink)
+    {
+    case TRACE_SINK_BINARY:
+        written = writeIndexedTransactionOp(transactionOp, ctx->out, ctx->index);
+        break;
+    case TRACE_SINK_RING:
+        written = appendTransactionOp(transactionOp, sqlite3_trw_ring());
+        break;
+    case TRACE_SINK_TEXT:
+        written = printTransactionOp(transactionOp, ctx->out);
+        break;
+    default:
+        printTransactionOp(transactionOp, NULL);
+        return;
+    }
+    TRACE_COUNT(ctx->stats.bytes, written);
+    if (written == 0) TRACE_COUNT(ctx->stats.lost, 1);
+}
+
+static TraceCursor *cursorOf(TraceSession *session, int iCursor)
 {
-    if (!pOp) return;
+    return iCursor >= 0 && iCursor < TRACE_MAX_CURSORS ? &session->cursors[iCursor] : NULL;
+}
+
+// Emits the range a cursor has covered since its scan started and stops the scan.
+static void finishScan(TraceContext *ctx, TraceCursor *cursor)
+{
+    if (!cursor->scanning) return;
+    cursor->scanning = 0;
+
+    // A step that did not reach another row ran off the end of the b-tree.
+    if (cursor->stepped)
+    {
+        if (cursor->flags & TRACE_FLAG_BACKWARD) cursor->lowerBound = TRACE_KEY_MIN;
+        else cursor->upperBound = TRACE_KEY_MAX;
+    }
+    // Nothing was visited and nothing bounds the scan: no range was read.
+    if (cursor->lowerBound > cursor->upperBound) return;
+    if (captureFiltered(ctx, RANGE, cursor)
+        || captureRowsFiltered(ctx, cursor, cursor->lowerBound, cursor->upperBound))
+    {
+        return;
+    }
+
+    emitTransactionOp(ctx, trackRange(currentTransactionId(ctx), cursor->root, cursor->lowerBound,
+                                      cursor->upperBound, cursor->flags));
+}
+
+static void startScan(TraceContext *ctx, TraceCursor *cursor, int backward)
+{
+    finishScan(ctx, cursor);
+
+    cursor->scanning = 1;
+    cursor->stepped = 0;
+    cursor->flags = (cursor->flags & TRACE_FLAG_INDEX) | (backward ? TRACE_FLAG_BACKWARD : 0);
+    // Empty until rows are visited; Rewind and Last open their starting end.
+    cursor->lowerBound = TRACE_KEY_MAX;
+    cursor->upperBound = TRACE_KEY_MIN;
+}
+
+// Extends the cursor's scan with a row it visited.
+static void visitRow(TraceCursor *cursor, int64_t rowId)
+{
+    if (!cursor->scanning || (cursor->flags & TRACE_FLAG_INDEX)) return;
+
+    cursor->stepped = 0;
+    if (rowId < cursor->lowerBound) cursor->lowerBound = rowId;
+    if (rowId > cursor->upperBound) cursor->upperBound = rowId;
+}
+
+// Where the read through cursor `iCursor` is kept.
+static TraceCursor *readCursorOf(TraceSession *session, int iCursor)
+{
+    TraceCursor *cursor = cursorOf(session, iCursor);
+    return cursor ? cursor : &session->untracked;
+}
+
+// Emits the pending read, if its row is known.
+static void flushRead(TraceContext *ctx, TraceSession *session)
+{
+    if (session->readCursor < 0) return;
+    TraceCursor *cursor = readCursorOf(session, session->readCursor);
+    if (!cursor->reading) return;
+    cursor->reading = 0;
+
+    TransactionOp *readOp = cursor->readOp;
+    cursor->readOp = NULL;
+    if (!cursor->onRow)
+    {
+        // Nothing named the row: the read cannot be attributed.
+        if (readOp) printTransactionOp(readOp, NULL);
+        return;
+    }
+
+    // A filtered read is still a visited row of the scan.
+    visitRow(cursor, cursor->rowId);
+    if (readOp == NULL)
+    {
+        // Filtered out at its first column.
+        TRACE_COUNT(ctx->stats.dropped, 1);
+    } else if (captureRowsFiltered(ctx, cursor, cursor->rowId, cursor->rowId))
+    {
+        printTransactionOp(readOp, NULL);
+    } else
+    {
+        readOp->objectId = cursor->rowId;
+        readOp->columns = cursor->columns;
+        readOp->table = cursor->root;
+        if (readOp->writeVal) readOp->writeVal->hash = cursor->readHash;
+        emitTransactionOp(ctx, readOp);
+    }
+}
 
-    if (checkVdbeOp(pOp, isCursorMovement))
+// The cursor left its row: its pending read ends and the next one needs the new row.
+static void moveCursor(TraceContext *ctx, TraceSession *session, int iCursor)
+{
+    if (session->readCursor == iCursor) flushRead(ctx, session);
+    TraceCursor *cursor = cursorOf(session, iCursor);
+    if (cursor) cursor->onRow = 0;
+}
+
+static void beginTransaction(TraceContext *ctx, TraceSession *session)
+{
+    if (ctx != &defaultContext)
+    {
+        ctx->transactionId = ctx->nextTransactionId++;
+    }
+    session->inTransaction = 1;
+    session->savepointTransaction = 0;
+    session->implicitTransaction = 0;
+    session->wrote = 0;
+    if (captureFiltered(ctx, BEGIN, NULL)) return;
+    emitTransactionOp(ctx, trackBegin(currentTransactionId(ctx)));
+}
+
+// Pops the savepoints nested deeper than `level`.
+static void truncateSavepoints(TraceSession *session, int level)
+{
+    while (session->nSavepoint > level)
+    {
+        free(session->savepoints[--session->nSavepoint]);
+    }
+}
+
+static void endTransaction(TraceContext *ctx, TraceSession *session, int rollback)
+{
+    int transactionId = currentTransactionId(ctx);
+    if (!captureFiltered(ctx, rollback ? ABORT : COMMIT, NULL))
+    {
+        emitTransactionOp(ctx, rollback ? trackAbort(transactionId) : trackEnd(transactionId));
+    }
+    // Everything the transaction captured has been emitted.
+    traceArenaReset(&session->arena);
+    truncateSavepoints(session, 0);
+    session->inTransaction = 0;
+    session->savepointTransaction = 0;
+    session->implicitTransaction = 0;
+}
+
+// Level of the innermost open savepoint called `zName`, 0 if there is none.
+static int findSavepoint(TraceSession *session, const char *zName)
+{
+    for (int i = session->nSavepoint - 1; i >= 0; i--)
     {
-        if (currentTraceState == NULL) return;
-        int p = currentTraceState->rowId != -1;
+        if (sqlite3_stricmp(session->savepoints[i], zName) == 0) return i + 1;
+    }
+    return 0;
+}
+
+static void emitSavepoint(TraceContext *ctx, TraceSession *session, OpType type, int level)
+{
+    if (captureFiltered(ctx, type, NULL)) return;
+    const char *zName = session->savepoints[level - 1];
+    Value *name = captureValue(&session->arena, zName, (int)strlen(zName), TRACE_VALUE_UNLIMITED, 1);
+    emitTransactionOp(ctx, trackSavepoint(type, currentTransactionId(ctx), level, name));
+}
+
+// Mirrors OP_Savepoint: a SAVEPOINT outside a transaction opens one, and releasing
+// that outermost savepoint commits it. ROLLBACK TO keeps the savepoint open.
+static void traceSavepoint(TraceContext *ctx, TraceSession *session, VdbeOp *pOp)
+{
+    const char *zName = pOp->p4.z;
+    if (zName == NULL) return;
 
-        if (currentTraceState->readOp != NULL && p)
+    if (pOp->p1 == SAVEPOINT_BEGIN)
+    {
+        if (!session->inTransaction)
         {
-            printTransactionOp(currentTraceState->readOp, traceFile);
+            beginTransaction(ctx, session);
+            session->savepointTransaction = 1;
         }
-
-        if (currentTraceState->writeOp != NULL && p)
+        if (session->nSavepoint == session->nSavepointAlloc)
         {
-            printTransactionOp(currentTraceState->writeOp, traceFile);
+            int nAlloc = session->nSavepointAlloc ? session->nSavepointAlloc * 2 : 4;
+            char **aNew = realloc(session->savepoints, nAlloc * sizeof(char *));
+            if (!aNew) return;
+            session->savepoints = aNew;
+            session->nSavepointAlloc = nAlloc;
         }
+        char *zCopy = strdup(zName);
+        if (!zCopy) return;
+        session->savepoints[session->nSavepoint++] = zCopy;
+        emitSavepoint(ctx, session, SAVEPOINT, session->nSavepoint);
+        return;
+    }
 
-        freeTraceState(currentTraceState);
-        currentTraceState = NULL;
-    } else if (checkVdbeOp(pOp, isColumnOp))
+    // An unknown name makes the statement fail without touching the transaction.
+    int level = findSavepoint(session, zName);
+    if (level == 0) return;
+
+    if (pOp->p1 == SAVEPOINT_RELEASE)
     {
-        // A read operation is done
-        if (currentTraceState == NULL)
-        {
-            currentTraceState = initTraceState();
-        }
+        emitSavepoint(ctx, session, RELEASE, level);
+        truncateSavepoints(session, level - 1);
+        if (level == 1 && session->savepointTransaction) endTransaction(ctx, session, 0);
+    } else if (pOp->p1 == SAVEPOINT_ROLLBACK)
+    {
+        emitSavepoint(ctx, session, ROLLBACK_TO, level);
+        truncateSavepoints(session, level);
+    }
+}
+
+// Ends the top-level statement: every cursor it opened is gone, and an implicit
+// transaction ends with it.
+static void endStatement(TraceContext *ctx, TraceSession *session, int failed)
+{
+    flushRead(ctx, session);
+    for (int i = 0; i < TRACE_MAX_CURSORS; i++)
+    {
+        finishScan(ctx, &session->cursors[i]);
+    }
+    memset(session->cursors, 0, sizeof(session->cursors));
+
+    if (session->implicitTransaction) endTransaction(ctx, session, failed);
+}
+
+// ------------------------------------------
+// ------------ Opcode Handlers -------------
+// ------------------------------------------
+// One handler per traced opcode, looked up through `opcodeHandlers`.
+
+typedef void (*TraceOpHandler)(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp);
+
+static void handleColumn(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    // Columns of the same row join its read; a column through another cursor ends it.
+    if (session->readCursor != pOp->p1) flushRead(ctx, session);
+    TraceCursor *cursor = readCursorOf(session, pOp->p1);
+    if (cursor == &session->untracked && session->readCursor != pOp->p1)
+    {
+        memset(cursor, 0, sizeof(*cursor));
+    }
+    // A row named for this column that is not the row being read is a new row.
+    if (cursor->reading && session->hasNextRowId)
+    {
+        if (!cursor->onRow || cursor->rowId != session->nextRowId) flushRead(ctx, session);
+        else session->hasNextRowId = 0;
+    }
 
-        currentTraceState->readOp = trackRead(getThreadId(), currentTraceState->rowId);
-    } else if (checkVdbeOp(pOp,isAutocommitOp))
+    if (!cursor->reading)
     {
-        // Autocommit flag false: Begin transaction
-        // Autocommit flag true: Commit transaction
-        if (pOp->p1)
+        cursor->reading = 1;
+        cursor->columns = 0;
+        cursor->readHash = 0;
+        cursor->rowIdSet = session->hasNextRowId;
+        if (session->hasNextRowId)
         {
-            printTransactionOp(trackEnd(getThreadId()), traceFile);
-        } else
+            cursor->onRow = 1;
+            cursor->rowId = session->nextRowId;
+            session->hasNextRowId = 0;
+        }
+        // A filtered read keeps its cursor but no operation; flushRead counts it as dropped.
+        if (!opFiltered(&ctx->filter, READ) && !cursor->filtered)
         {
-            printTransactionOp(trackBegin(getThreadId()), traceFile);
+            cursor->readOp = trackRead(currentTransactionId(ctx), (unsigned long)cursor->rowId);
         }
     }
+    session->readCursor = pOp->p1;
+    cursor->columns |= TRACE_COLUMN_BIT(pOp->p2);
 }
 
-void enableTraceOutput()
+static void handleAutoCommit(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    // Autocommit flag false: Begin transaction
+    // Autocommit flag true: Commit transaction, or roll it back if the rollback flag (p2) is set
+    if (pOp->p1)
+    {
+        endTransaction(ctx, session, pOp->p2);
+    } else if (session->implicitTransaction)
+    {
+        // BEGIN IMMEDIATE/EXCLUSIVE: the Transaction opcodes before it already began it.
+        session->implicitTransaction = 0;
+    } else
+    {
+        beginTransaction(ctx, session);
+    }
+}
+
+static void handleSavepoint(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
 {
-    traceFile = stdout;
+    traceSavepoint(ctx, session, pOp);
 }
 
-void setRowId(int rowId)
+static void handleOpenCursor(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    if (!cursor) return;
+
+    moveCursor(ctx, session, pOp->p1);
+    finishScan(ctx, cursor);
+    cursor->root = (unsigned)pOp->p2;
+    cursor->flags = pOp->p4type == P4_KEYINFO ? TRACE_FLAG_INDEX : 0;
+    // P3 is the database the b-tree is in.
+    cursor->filtered = treeFiltered(&ctx->filter, pOp->p3, cursor->root);
+}
+
+// Moving a cursor ends the row being read through it.
+static void handleCursorMovement(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    moveCursor(ctx, session, pOp->p1);
+}
+
+// Starts a scan. Rewind and Last start at an end of the b-tree. Index keys are
+// not comparable here, so an index scan covers the whole index unless the
+// amalgamation supplies an integer seek key (see setSeekKeyDb).
+static void beginScan(TraceContext *ctx, TraceSession *session, VdbeOp *pOp, int backward, int fromEnd)
 {
-    if (currentTraceState == NULL)
+    moveCursor(ctx, session, pOp->p1);
+
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    if (!cursor) return;
+
+    startScan(ctx, cursor, backward);
+    if ((fromEnd && !backward) || (cursor->flags & TRACE_FLAG_INDEX))
+    {
+        cursor->lowerBound = TRACE_KEY_MIN;
+    }
+    if ((fromEnd && backward) || (cursor->flags & TRACE_FLAG_INDEX))
     {
-        currentTraceState = initTraceState();
+        cursor->upperBound = TRACE_KEY_MAX;
     }
+}
 
-    currentTraceState->rowId = rowId;
+static void handleRewind(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    beginScan(ctx, session, pOp, 0, 1);
 }
 
-void interceptWrite(VdbeOp *pOp, int recordId, char* val)
+static void handleLast(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    beginScan(ctx, session, pOp, 1, 1);
+}
+
+static void handleSeekForward(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    beginScan(ctx, session, pOp, 0, 0);
+}
+
+static void handleSeekBackward(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    beginScan(ctx, session, pOp, 1, 0);
+}
+
+static void handleStep(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    moveCursor(ctx, session, pOp->p1);
+
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    if (cursor && cursor->scanning) cursor->stepped = 1;
+}
+
+static void handleClose(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    // Closing the cursor also ends the row being read through it.
+    moveCursor(ctx, session, pOp->p1);
+
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    if (!cursor) return;
+
+    finishScan(ctx, cursor);
+    cursor->root = 0;
+    cursor->filtered = 0;
+}
+
+// Statement boundaries. Every program starts with Init; one entered through
+// Program is a trigger running inside the current statement and its Halt
+// returns to the caller. Anything else ends the statement.
+static void handleProgram(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
 {
-    if (pOp == NULL) return;
+    session->enteringFrame = 1;
+}
 
-    Value *newVal = createValue(val, stringToString);
-    printTransactionOp(trackWrite(getThreadId(), recordId, newVal), traceFile);
-}
\ No newline at end of file
+// Identifies the top-level statement that just started on `db`: the one busy
+// statement, or when a statement is run from inside another one's step, the
+// one busy statement that has not started before.
+static void startStatement(TraceSession *session, sqlite3 *db)
+{
+    sqlite3_stmt *busy = NULL, *started = NULL;
+    int nBusy = 0, nStarted = 0;
+    for (sqlite3_stmt *stmt = sqlite3_next_stmt(db, NULL); stmt != NULL; stmt = sqlite3_next_stmt(db, stmt))
+    {
+        if (!sqlite3_stmt_busy(stmt)) continue;
+        busy = stmt;
+        nBusy++;
+        int outer = 0;
+        for (int i = 0; i < session->nStatements; i++)
+        {
+            if (session->statements[i].stmt == stmt) outer = 1;
+        }
+        if (outer) continue;
+        started = stmt;
+        nStarted++;
+    }
+    // A finalized statement's memory may be reused by the next one, so a
+    // single busy statement is the new one even if it looks like an outer one.
+    sqlite3_stmt *stmt = nBusy == 1 ? busy : nStarted == 1 ? started : NULL;
+    if (nBusy == 1) session->nStatements = 0;
+
+    session->statementId = stmt ? traceInternStatement(sqlite3_sql(stmt)) : TRACE_STATEMENT_NONE;
+    if (session->nStatements == TRACE_MAX_NESTED_STATEMENTS)
+    {
+        memmove(session->statements, session->statements + 1,
+                (TRACE_MAX_NESTED_STATEMENTS - 1) * sizeof(session->statements[0]));
+        session->nStatements--;
+    }
+    session->statements[session->nStatements].stmt = stmt;
+    session->statements[session->nStatements].id = session->statementId;
+    session->nStatements++;
+}
+
+// The statement that was running when the halted one started resumes.
+static void haltStatement(TraceSession *session)
+{
+    if (session->nStatements > 0) session->nStatements--;
+    session->statementId = session->nStatements > 0 ? session->statements[session->nStatements - 1].id
+                                                      : TRACE_STATEMENT_NONE;
+}
+
+static void handleInit(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    if (session->enteringFrame)
+    {
+        session->frameDepth++;
+        session->enteringFrame = 0;
+        return;
+    }
+    // A new statement. The previous one never halted: it failed, or it was
+    // reset before running to completion, which only readers are.
+    session->frameDepth = 0;
+    if (session->implicitTransaction) endStatement(ctx, session, session->wrote);
+    if (db != NULL) startStatement(session, db);
+}
+
+static void handleTransaction(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    // Outside BEGIN the connection is in autocommit mode and the statement
+    // is its own transaction. A connection found inside a transaction the
+    // tracer has not seen begin is left alone.
+    if (session->inTransaction || (db != NULL && !sqlite3_get_autocommit(db))) return;
+    beginTransaction(ctx, session);
+    session->implicitTransaction = 1;
+}
+
+static void handleHalt(TraceContext *ctx, TraceSession *session, sqlite3 *db, VdbeOp *pOp)
+{
+    // Ending the statement also ends the row being read.
+    flushRead(ctx, session);
+
+    if (session->frameDepth > 0 && pOp->p1 == SQLITE_OK)
+    {
+        session->frameDepth--;
+        return;
+    }
+    session->frameDepth = 0;
+    endStatement(ctx, session, pOp->p1 != SQLITE_OK);
+    haltStatement(session);
+}
+
+static const struct
+{
+    const char *name;
+    TraceOpHandler handler;
+} traceHandlers[] = {
+    {"Column", handleColumn},
+    {"AutoCommit", handleAutoCommit},
+    {"Savepoint", handleSavepoint},
+    {"OpenRead", handleOpenCursor},
+    {"OpenWrite", handleOpenCursor},
+    {"Rewind", handleRewind},
+    {"Last", handleLast},
+    {"SeekGE", handleSeekForward},
+    {"SeekGT", handleSeekForward},
+    {"SeekLE", handleSeekBackward},
+    {"SeekLT", handleSeekBackward},
+    {"Next", handleStep},
+    {"Prev", handleStep},
+    {"SeekRowid", handleCursorMovement},
+    {"Found", handleCursorMovement},
+    {"NotFound", handleCursorMovement},
+    {"IsUnique", handleCursorMovement},
+    {"NotExists", handleCursorMovement},
+    {"NoConflict", handleCursorMovement},
+    {"Close", handleClose},
+    {"Program", handleProgram},
+    {"Init", handleInit},
+    {"Transaction", handleTransaction},
+    {"Halt", handleHalt},
+};
+
+// ------------------------------------------
+// ------- Opcode Configuration -------------
+// ------------------------------------------
+// The opcodes to trace come from a JSON file (imptInsts.json) or the
+// environment and are compiled into a 256-bit mask plus a handler table.
+// Handlers are resolved lazily: the first time an opcode reaches the
+// interceptor its name is looked up once, after which an untraced opcode
+// costs one bit test and a traced one an indirect call.
+
+#define TRACE_CONFIG_FILE "imptInsts.json"
+#define TRACE_CONFIG_PATH_ENV "TRW_CONFIG"
+#define TRACE_OPCODES_ENV "TRW_OPCODES"
+#define TRACE_CONFIG_MAX_SIZE (64 * 1024)
+#define TRACE_MAX_CONFIG_OPCODES 256
+#define TRACE_OPCODE_NAME_SIZE 32
+
+typedef struct
+{
+    // -1 when the list was not given.
+    int n;
+    char names[TRACE_MAX_CONFIG_OPCODES][TRACE_OPCODE_NAME_SIZE];
+} TraceOpcodeList;
+
+// The tracer's own bookkeeping runs on these, whatever the configuration says:
+// transaction boundaries (implicit ones included), statement ids, trigger
+// frames, savepoints and cursor state. Leaving one out would silently break
+// every other event.
+static const char *const bookkeepingOpcodes[] = {
+    "Init", "Program", "Transaction", "AutoCommit", "Savepoint", "OpenRead", "OpenWrite", "Close", "Halt",
+};
+
+// "important" opcodes are always traced; "traced" narrows the rest, all handled opcodes when absent.
+static TraceOpcodeList importantOpcodes = {.n = -1};
+static TraceOpcodeList tracedOpcodes = {.n = -1};
+static int opcodeConfigLoaded = 0;
+static pthread_once_t opcodeConfigOnce = PTHREAD_ONCE_INIT;
+
+// Bit set: the opcode is traced or not resolved yet.
+static _Atomic uint64_t opcodeMask[4] = {~0ull, ~0ull, ~0ull, ~0ull};
+// NULL: not resolved yet.
+static _Atomic(TraceOpHandler) opcodeHandlers[256];
+
+static int inOpcodeList(const TraceOpcodeList *list, const char *name)
+{
+    for (int i = 0; i < list->n; i++)
+    {
+        if (strcmp(list->names[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+static int isBookkeepingOpcode(const char *name)
+{
+    for (size_t i = 0; i < sizeof(bookkeepingOpcodes) / sizeof(bookkeepingOpcodes[0]); i++)
+    {
+        if (strcmp(bookkeepingOpcodes[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+static TraceOpHandler resolveOpcode(u8 opCode)
+{
+    const char *name = sqlite3OpcodeName(opCode);
+    TraceOpHandler handler = NULL;
+
+    if (tracedOpcodes.n < 0 || inOpcodeList(&tracedOpcodes, name) || inOpcodeList(&importantOpcodes, name)
+        || isBookkeepingOpcode(name))
+    {
+        for (size_t i = 0; i < sizeof(traceHandlers) / sizeof(traceHandlers[0]); i++)
+        {
+            if (strcmp(traceHandlers[i].name, name) == 0)
+            {
+                handler = traceHandlers[i].handler;
+                break;
+            }
+        }
+    }
+
+    if (handler)
+    {
+        atomic_store_explicit(&opcodeHandlers[opCode], handler, memory_order_relaxed);
+    } else
+    {
+        atomic_fetch_and_explicit(&opcodeMask[opCode >> 6], ~(1ull << (opCode & 63)), memory_order_relaxed);
+    }
+    return handler;
+}
+
+static int isTracedOpcode(u8 opCode)
+{
+    return (atomic_load_explicit(&opcodeMask[opCode >> 6], memory_order_relaxed) >> (opCode & 63)) & 1;
+}
+
+static void resetOpcodeDispatch()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        atomic_store_explicit(&opcodeHandlers[i], NULL, memory_order_relaxed);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        atomic_store_explicit(&opcodeMask[i], ~0ull, memory_order_relaxed);
+    }
+}
+
+static int addOpcodeName(TraceOpcodeList *list, const char *name, size_t len)
+{
+    if (len == 0) return 1;
+    if (len >= TRACE_OPCODE_NAME_SIZE || list->n >= TRACE_MAX_CONFIG_OPCODES) return 0;
+
+    if (list->n < 0) list->n = 0;
+    memcpy(list->names[list->n], name, len);
+    list->names[list->n][len] = '\0';
+    list->n++;
+    return 1;
+}
+
+// Parses a comma-separated list of opcode names.
+static int parseOpcodeNames(const char *zNames, TraceOpcodeList *list)
+{
+    list->n = 0;
+    while (*zNames)
+    {
+        zNames += strspn(zNames, " \t\n,");
+        size_t len = strcspn(zNames, " \t\n,");
+        if (!addOpcodeName(list, zNames, len)) return 0;
+        zNames += len;
+    }
+    return 1;
+}
+
+static const char *skipSpace(const char *z)
+{
+    return z + strspn(z, " \t\r\n");
+}
+
+// Reads the array of strings stored under `key` in a flat JSON object. Returns
+// 1 if it was found, 0 if not and -1 if it is malformed.
+static int parseOpcodeArray(const char *zJson, const char *key, TraceOpcodeList *list)
+{
+    char quoted[TRACE_OPCODE_NAME_SIZE + 2];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+
+    const char *z = strstr(zJson, quoted);
+    if (z == NULL) return 0;
+
+    z = skipSpace(z + strlen(quoted));
+    if (*z != ':') return -1;
+    z = skipSpace(z + 1);
+    if (*z != '[') return -1;
+
+    list->n = 0;
+    for (z = skipSpace(z + 1); *z != ']'; z = skipSpace(z))
+    {
+        if (*z != '"') return -1;
+        const char *zEnd = strchr(z + 1, '"');
+        if (zEnd == NULL || !addOpcodeName(list, z + 1, (size_t)(zEnd - z - 1))) return -1;
+
+        z = skipSpace(zEnd + 1);
+        if (*z == ',') z++;
+        else if (*z != ']') return -1;
+    }
+    return 1;
+}
+
+static int loadOpcodeConfig(const char *zPath, int required)
+{
+    TraceOpcodeList important = {.n = -1};
+    TraceOpcodeList traced = {.n = -1};
+    int rc = SQLITE_OK;
+
+    FILE *pFile = zPath ? fopen(zPath, "r") : NULL;
+    if (pFile)
+    {
+        char *zJson = malloc(TRACE_CONFIG_MAX_SIZE + 1);
+        size_t n = zJson ? fread(zJson, 1, TRACE_CONFIG_MAX_SIZE, pFile) : 0;
+        fclose(pFile);
+        if (!zJson) return SQLITE_NOMEM;
+        zJson[n] = '\0';
+
+        if (parseOpcodeArray(zJson, "important", &important) < 0
+            || parseOpcodeArray(zJson, "traced", &traced) < 0)
+        {
+            rc = SQLITE_ERROR;
+        }
+        free(zJson);
+    } else if (required)
+    {
+        rc = SQLITE_ERROR;
+    }
+
+    const char *zOpcodes = getenv(TRACE_OPCODES_ENV);
+    if (rc == SQLITE_OK && zOpcodes && !parseOpcodeNames(zOpcodes, &traced))
+    {
+        rc = SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK) return rc;
+
+    importantOpcodes = important;
+    tracedOpcodes = traced;
+    opcodeConfigLoaded = 1;
+    resetOpcodeDispatch();
+    return SQLITE_OK;
+}
+
+static void loadDefaultOpcodeConfig()
+{
+    if (opcodeConfigLoaded) return;
+
+    const char *zPath = getenv(TRACE_CONFIG_PATH_ENV);
+    if (loadOpcodeConfig(zPath ? zPath : TRACE_CONFIG_FILE, zPath != NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "trw: can't load opcode configuration %s, tracing every handled opcode\n",
+                zPath ? zPath : TRACE_CONFIG_FILE);
+    }
+}
+
+static void ensureOpcodeConfig()
+{
+    pthread_once(&opcodeConfigOnce, loadDefaultOpcodeConfig);
+}
+
+int sqlite3_trw_configure(const char *zPath)
+{
+    if (zPath == NULL)
+    {
+        opcodeConfigLoaded = 0;
+        loadDefaultOpcodeConfig();
+        return SQLITE_OK;
+    }
+    return loadOpcodeConfig(zPath, 1);
+}
+
+static void traceOp(TraceContext *ctx, sqlite3 *db, VdbeOp *pOp)
+{
+    TraceOpHandler handler = atomic_load_explicit(&opcodeHandlers[pOp->opcode], memory_order_relaxed);
+    if (handler == NULL) handler = resolveOpcode(pOp->opcode);
+    if (handler) handler(ctx, sessionOf(ctx), db, pOp);
+}
+
+static void traceRowId(TraceContext *ctx, i64 rowId)
+{
+    TraceSession *session = sessionOf(ctx);
+    TraceCursor *cursor = session->readCursor >= 0 ? readCursorOf(session, session->readCursor) : NULL;
+    if (cursor && cursor->reading && !cursor->rowIdSet)
+    {
+        cursor->onRow = 1;
+        cursor->rowId = rowId;
+        cursor->rowIdSet = 1;
+        return;
+    }
+    session->hasNextRowId = 1;
+    session->nextRowId = rowId;
+}
+
+static void traceReadRecord(TraceContext *ctx, const void *pData, int nData)
+{
+    TraceSession *session = sessionOf(ctx);
+    TraceCursor *cursor = session->readCursor >= 0 ? readCursorOf(session, session->readCursor) : NULL;
+    if (cursor && cursor->reading) cursor->readHash = traceHash64(pData, nData > 0 ? (size_t)nData : 0);
+}
+
+static void traceSeekKey(TraceContext *ctx, VdbeOp *pOp, i64 key)
+{
+    TraceCursor *cursor = cursorOf(sessionOf(ctx), pOp->p1);
+    if (!cursor || !cursor->scanning) return;
+
+    if (cursor->flags & TRACE_FLAG_BACKWARD) cursor->upperBound = key;
+    else cursor->lowerBound = key;
+}
+
+static void traceWrite(TraceContext *ctx, VdbeOp *pOp, i64 recordId, const void *pData, int nData)
+{
+    TraceSession *session = sessionOf(ctx);
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    session->wrote = 1;
+    if (captureFiltered(ctx, WRITE, cursor) || captureRowsFiltered(ctx, cursor, recordId, recordId)) return;
+
+    Value *newVal = captureValue(&session->arena, pData, nData, ctx->maxValueBytes, ctx->hashValues);
+    if (!newVal) return;
+
+    TransactionOp *writeOp = trackWrite(currentTransactionId(ctx), recordId, newVal);
+    if (!writeOp) return;
+
+    writeOp->table = cursor ? cursor->root : 0;
+    emitTransactionOp(ctx, writeOp);
+}
+
+static void traceDelete(TraceContext *ctx, VdbeOp *pOp, i64 recordId)
+{
+    TraceSession *session = sessionOf(ctx);
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    session->wrote = 1;
+    if (captureFiltered(ctx, WRITE, cursor) || captureRowsFiltered(ctx, cursor, recordId, recordId)) return;
+    emitTransactionOp(ctx, trackKeyWrite(currentTransactionId(ctx), cursor ? cursor->root : 0,
+                                         (unsigned long)recordId, TRACE_FLAG_DELETE));
+}
+
+static void traceIndexWrite(TraceContext *ctx, VdbeOp *pOp, const void *pKey, int nKey)
+{
+    TraceSession *session = sessionOf(ctx);
+    TraceCursor *cursor = cursorOf(session, pOp->p1);
+    session->wrote = 1;
+    if (captureFiltered(ctx, WRITE, cursor)) return;
+    unsigned flags = TRACE_FLAG_INDEX | (checkVdbeOp(pOp, isIdxDeleteOp) ? TRACE_FLAG_DELETE : 0);
+    uint64_t keyHash = traceHash64(pKey, nKey > 0 ? (size_t)nKey : 0);
+    emitTransactionOp(ctx, trackKeyWrite(currentTransactionId(ctx), cursor ? cursor->root : 0,
+                                         (unsigned long)keyHash, flags));
+}
+
+void sqlite3TraceInterceptor(VdbeOp *pOp)
+{
+    sqlite3TraceInterceptorDb(NULL, pOp);
+}
+
+// Opcode hook profile (see sqlite3_trw_profile_hooks), indexed by opcode.
+static _Atomic int hookProfiling = 0;
+static _Atomic unsigned long long hookCalls[256];
+static _Atomic unsigned long long hookNanos[256];
+
+static uint64_t hookClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void traceOpProfiled(TraceContext *ctx, sqlite3 *db, VdbeOp *pOp)
+{
+    uint64_t start = hookClock();
+    traceOp(ctx, db, pOp);
+    atomic_fetch_add_explicit(&hookNanos[pOp->opcode], hookClock() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hookCalls[pOp->opcode], 1, memory_order_relaxed);
+}
+
+static void traceOpcode(sqlite3 *db, VdbeOp *pOp)
+{
+    if (!isTracedOpcode(pOp->opcode)) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (!ctx) return;
+    if (__builtin_expect(atomic_load_explicit(&hookProfiling, memory_order_relaxed), 0))
+    {
+        traceOpProfiled(ctx, db, pOp);
+    } else
+    {
+        traceOp(ctx, db, pOp);
+    }
+}
+
+void sqlite3TraceInterceptorDb(sqlite3 *db, VdbeOp *pOp)
+{
+    sqlite3TraceInterceptorProgram(db, pOp, NULL, 0);
+}
+
+void sqlite3TraceInterceptorProgram(sqlite3 *db, VdbeOp *pOp, VdbeOp *aOp, int nOp)
+{
+    if (TRACE_DISABLED() || !pOp) return;
+
+    if (__builtin_expect(atomic_load_explicit(&vdbeProfiling, memory_order_relaxed), 0))
+    {
+        uint64_t start = traceProfileClock();
+        uint64_t statement = traceProfileOp(db, pOp, aOp && nOp > 0 ? aOp + nOp : NULL);
+        uint64_t traced = traceProfileClock();
+        traceOpcode(db, pOp);
+        traceProfileHook(statement, pOp->opcode, traceProfileClock() - traced, traced - start);
+        return;
+    }
+    traceOpcode(db, pOp);
+}
+
+sqlite3_stmt *traceRunningStatement(sqlite3 *db)
+{
+    sqlite3_stmt *running = NULL;
+    for (sqlite3_stmt *stmt = sqlite3_next_stmt(db, NULL); stmt != NULL; stmt = sqlite3_next_stmt(db, stmt))
+    {
+        if (!sqlite3_stmt_busy(stmt)) continue;
+        if (running) return NULL;
+        running = stmt;
+    }
+    return running;
+}
+
+int sqlite3_trw_profile(int onoff)
+{
+    onoff = onoff != 0;
+    if (onoff && !traceProfileSupported()) return SQLITE_ERROR;
+    if (atomic_exchange_explicit(&vdbeProfiling, onoff, memory_order_relaxed) != onoff)
+    {
+        atomic_fetch_add_explicit(&traceActive, onoff ? 1 : -1, memory_order_relaxed);
+    }
+    return SQLITE_OK;
+}
+
+int sqlite3_trw_profile_db(sqlite3 *db, int onoff)
+{
+    if (db == NULL) return SQLITE_MISUSE;
+    if (onoff && !traceProfileSupported()) return SQLITE_ERROR;
+    return sqlite3_db_config(db, SQLITE_DBCONFIG_STMT_SCANSTATUS, onoff != 0, (int *)0);
+}
+
+int sqlite3_trw_profiling()
+{
+    return atomic_load_explicit(&vdbeProfiling, memory_order_relaxed);
+}
+
+void enableTraceOutput()
+{
+    setTraceSink(TRACE_SINK_TEXT, stdout);
+    sqlite3_trw_enable(1);
+}
+
+void setTraceCapture(int maxValueBytes, int hashValues)
+{
+    defaultContext.maxValueBytes = maxValueBytes;
+    defaultContext.hashValues = hashValues;
+}
+
+void setTraceSink(TraceSinkType sink, FILE *pOut)
+{
+    setTraceIndex(NULL, 0);
+    traceFile = sink == TRACE_SINK_NULL || sink == TRACE_SINK_RING ? NULL : pOut;
+    defaultContext.sink = sink;
+    defaultContext.out = traceFile;
+
+    if (sink == TRACE_SINK_BINARY)
+    {
+        writeTraceFileHeader(traceFile);
+    }
+}
+
+int setTraceIndex(FILE *pIndex, unsigned interval)
+{
+    traceIndexFinish(defaultContext.index);
+    defaultContext.index = NULL;
+    if (pIndex == NULL || defaultContext.sink != TRACE_SINK_BINARY) return SQLITE_OK;
+
+    defaultContext.index = traceIndexCreate(pIndex, interval);
+    return defaultContext.index ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static TraceRing *processRing = NULL;
+static pthread_once_t processRingOnce = PTHREAD_ONCE_INIT;
+
+static void createProcessRing()
+{
+    processRing = traceRingCreate(TRACE_RING_DEFAULT_CAPACITY);
+}
+
+TraceRing *sqlite3_trw_ring()
+{
+    pthread_once(&processRingOnce, createProcessRing);
+    return processRing;
+}
+
+void sqlite3_trw_enable(int onoff)
+{
+    setContextEnabled(&defaultContext, onoff);
+}
+
+int sqlite3_trw_enabled()
+{
+    return defaultContext.enabled;
+}
+
+void sqlite3_trw_flush()
+{
+    if (defaultContext.out) fflush(defaultContext.out);
+}
+
+static void readCounters(TraceContext *ctx, TraceStats *pStats)
+{
+    for (int i = 0; i < OP_TYPE_COUNT; i++)
+    {
+        pStats->events[i] = atomic_load_explicit(&ctx->stats.events[i], memory_order_relaxed);
+    }
+    pStats->dropped = atomic_load_explicit(&ctx->stats.dropped, memory_order_relaxed);
+    pStats->bytes = atomic_load_explicit(&ctx->stats.bytes, memory_order_relaxed);
+    pStats->lost = atomic_load_explicit(&ctx->stats.lost, memory_order_relaxed);
+}
+
+static void clearCounters(TraceContext *ctx)
+{
+    for (int i = 0; i < OP_TYPE_COUNT; i++)
+    {
+        atomic_store_explicit(&ctx->stats.events[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&ctx->stats.dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&ctx->stats.bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&ctx->stats.lost, 0, memory_order_relaxed);
+}
+
+void sqlite3_trw_stats(TraceStats *pStats)
+{
+    if (pStats) readCounters(&defaultContext, pStats);
+}
+
+void sqlite3_trw_reset_stats()
+{
+    clearCounters(&defaultContext);
+    for (int i = 0; i < 256; i++)
+    {
+        atomic_store_explicit(&hookCalls[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&hookNanos[i], 0, memory_order_relaxed);
+    }
+}
+
+void sqlite3_trw_profile_hooks(int onoff)
+{
+    atomic_store_explicit(&hookProfiling, onoff != 0, memory_order_relaxed);
+}
+
+int sqlite3_trw_hooks_profiled()
+{
+    return atomic_load_explicit(&hookProfiling, memory_order_relaxed);
+}
+
+void sqlite3_trw_hook_stats(TraceHookStats *pStats)
+{
+    if (!pStats) return;
+    for (int i = 0; i < 256; i++)
+    {
+        pStats->calls[i] = atomic_load_explicit(&hookCalls[i], memory_order_relaxed);
+        pStats->nanos[i] = atomic_load_explicit(&hookNanos[i], memory_order_relaxed);
+    }
+}
+
+int sqlite3_trw_filter_tables(const unsigned *roots, int n)
+{
+    return setFilterTables(&defaultContext.filter, roots, n);
+}
+
+void sqlite3_trw_filter_schemas(unsigned schemaMask)
+{
+    defaultContext.filter.schemaMask = schemaMask;
+}
+
+void sqlite3_trw_filter_rowids(int64_t minRowId, int64_t maxRowId)
+{
+    defaultContext.filter.minRowId = minRowId;
+    defaultContext.filter.maxRowId = maxRowId;
+}
+
+void sqlite3_trw_filter_ops(unsigned opTypeMask)
+{
+    defaultContext.filter.opTypeMask = opTypeMask;
+}
+
+static void destroyContext(void *p)
+{
+    TraceContext *ctx = p;
+
+    setContextEnabled(ctx, 0);
+    // A read still pending when the connection closes never ended; it is dropped.
+    TraceCursor *reading = ctx->session.readCursor >= 0 ? readCursorOf(&ctx->session, ctx->session.readCursor) : NULL;
+    if (reading && reading->reading && reading->readOp) printTransactionOp(reading->readOp, NULL);
+    traceArenaDestroy(&ctx->session.arena);
+    truncateSavepoints(&ctx->session, 0);
+    free(ctx->session.savepoints);
+    free(ctx->filter.largeRoots);
+    if (ctx->statementsPath)
+    {
+        FILE *statements = fopen(ctx->statementsPath, "w");
+        writeStatementTable(statements);
+        if (statements) fclose(statements);
+        sqlite3_free(ctx->statementsPath);
+    }
+    traceIndexFinish(ctx->index);
+    if (ctx->indexOut) fclose(ctx->indexOut);
+    if (ctx->buffer)
+    {
+        // The stream was opened by the context and uses its buffer.
+        fclose(ctx->out);
+        free(ctx->buffer);
+    } else if (ctx->out)
+    {
+        fflush(ctx->out);
+    }
+    free(ctx);
+}
+
+TraceContext *sqlite3_trw_attach(sqlite3 *db, const TraceContextConfig *config)
+{
+    if (db == NULL || config == NULL) return NULL;
+
+    TraceContext *ctx = calloc(1, sizeof(TraceContext));
+    if (!ctx) return NULL;
+
+    ctx->db = db;
+    ctx->sink = config->sink;
+    ctx->filter.opTypeMask = config->opTypeMask;
+    ctx->filter.schemaMask = config->schemaMask;
+    ctx->filter.minRowId = config->filterRowIds ? config->minRowId : TRACE_KEY_MIN;
+    ctx->filter.maxRowId = config->filterRowIds ? config->maxRowId : TRACE_KEY_MAX;
+    if (setFilterTables(&ctx->filter, config->tables, config->nTables) != SQLITE_OK)
+    {
+        free(ctx);
+        return NULL;
+    }
+    ctx->maxValueBytes = config->maxValueBytes;
+    ctx->hashValues = config->hashValues;
+    ctx->nextTransactionId = config->transactionIdBase;
+    ctx->transactionId = config->transactionIdBase;
+
+    int fileSink = config->sink == TRACE_SINK_TEXT || config->sink == TRACE_SINK_BINARY;
+    if (fileSink && config->path != NULL)
+    {
+        // A private stream and buffer per context: connections never share a stdio lock.
+        size_t bufferSize = config->bufferSize > 0 ? config->bufferSize : TRACE_CONTEXT_BUFFER_SIZE;
+        ctx->out = fopen(config->path, config->sink == TRACE_SINK_BINARY ? "wb" : "w");
+        ctx->buffer = ctx->out ? malloc(bufferSize) : NULL;
+        if (!ctx->buffer)
+        {
+            if (ctx->out) fclose(ctx->out);
+            free(ctx);
+            return NULL;
+        }
+        setvbuf(ctx->out, ctx->buffer, _IOFBF, bufferSize);
+        ctx->statementsPath = sqlite3_mprintf("%s" TRACE_STATEMENTS_SUFFIX, config->path);
+    } else if (fileSink)
+    {
+        ctx->out = config->out;
+    }
+
+    if (ctx->sink == TRACE_SINK_BINARY)
+    {
+        writeTraceFileHeader(ctx->out);
+        if (config->path != NULL && config->indexInterval >= 0)
+        {
+            char *zIndex = sqlite3_mprintf("%s" TRACE_INDEX_SUFFIX, config->path);
+            ctx->indexOut = zIndex ? fopen(zIndex, "wb") : NULL;
+            ctx->index = ctx->indexOut ? traceIndexCreate(ctx->indexOut, (uint32_t)config->indexInterval) : NULL;
+            sqlite3_free(zIndex);
+        }
+    }
+
+    // SQLite destroys the previous context, if any, and this one when the connection closes.
+    if (sqlite3_set_clientdata(db, TRACE_CLIENTDATA_KEY, ctx, destroyContext) != SQLITE_OK)
+    {
+        destroyContext(ctx);
+        return NULL;
+    }
+    setContextEnabled(ctx, 1);
+    return ctx;
+}
+
+void sqlite3_trw_detach(sqlite3 *db)
+{
+    if (db == NULL) return;
+    sqlite3_set_clientdata(db, TRACE_CLIENTDATA_KEY, NULL, NULL);
+}
+
+void sqlite3_trw_context_enable(TraceContext *ctx, int onoff)
+{
+    if (ctx) setContextEnabled(ctx, onoff);
+}
+
+void sqlite3_trw_context_stats(TraceContext *ctx, TraceStats *pStats)
+{
+    if (ctx && pStats) readCounters(ctx, pStats);
+}
+
+void setRowId(int rowId)
+{
+    setRowIdDb(NULL, rowId);
+}
+
+void setRowIdDb(sqlite3 *db, i64 rowId)
+{
+    if (TRACE_DISABLED()) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx) traceRowId(ctx, rowId);
+}
+
+void interceptWrite(VdbeOp *pOp, int recordId, char* val)
+{
+    interceptWriteDb(NULL, pOp, recordId, val);
+}
+
+void interceptWriteDb(sqlite3 *db, VdbeOp *pOp, int recordId, char* val)
+{
+    interceptWriteRecord(db, pOp, recordId, val, val ? (int)strlen(val) : 0);
+}
+
+void interceptWriteRecord(sqlite3 *db, VdbeOp *pOp, i64 recordId, const void *pData, int nData)
+{
+    if (TRACE_DISABLED() || pOp == NULL) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx) traceWrite(ctx, pOp, recordId, pData, nData);
+}
+
+void interceptDelete(sqlite3 *db, VdbeOp *pOp, i64 recordId)
+{
+    if (TRACE_DISABLED() || pOp == NULL || (pOp->p2 & OPFLAG_ISNOOP)) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx) traceDelete(ctx, pOp, recordId);
+}
+
+void interceptIndexWrite(sqlite3 *db, VdbeOp *pOp, const void *pKey, int nKey)
+{
+    if (TRACE_DISABLED() || pOp == NULL) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx) traceIndexWrite(ctx, pOp, pKey, nKey);
+}
+
+void interceptReadRecord(sqlite3 *db, VdbeOp *pOp, const void *pData, int nData)
+{
+    if (TRACE_DISABLED() || pOp == NULL) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx && ctx->hashValues) traceReadRecord(ctx, pData, nData);
+}
+
+void setSeekKeyDb(sqlite3 *db, VdbeOp *pOp, i64 key)
+{
+    if (TRACE_DISABLED() || pOp == NULL) return;
+
+    TraceContext *ctx = lookupContext(db);
+    if (ctx) traceSeekKey(ctx, pOp, key);
+}
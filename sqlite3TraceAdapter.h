@@ -23,19 +23,75 @@ int isColumnOp(u8 opCode);
 // isRowId - check if given instruction is a `RowId` operation.
 int isRowId(u8 opCode);
 
+// isOpenCursorOp - check if given instruction opens a cursor on a b-tree (`OpenRead`, `OpenWrite`).
+int isOpenCursorOp(u8 opCode);
+
+// isCloseOp - check if given instruction is a `Close` operation.
+int isCloseOp(u8 opCode);
+
+// isHaltOp - check if given instruction is a `Halt` operation.
+int isHaltOp(u8 opCode);
+
+// isForwardScanOp / isBackwardScanOp - check if given instruction starts an
+// ascending (`Rewind`, `SeekGE`, `SeekGT`) or descending (`Last`, `SeekLE`, `SeekLT`) scan.
+int isForwardScanOp(u8 opCode);
+
+int isBackwardScanOp(u8 opCode);
+
+// isStepOp - check if given instruction steps a scan (`Next`, `Prev`).
+int isStepOp(u8 opCode);
+
+// isIdxDeleteOp - check if given instruction is an `IdxDelete` operation.
+int isIdxDeleteOp(u8 opCode);
+
+// isSavepointOp - check if given instruction is a `Savepoint` operation.
+int isSavepointOp(u8 opCode);
+
+// isTransactionOp - check if given instruction is a `Transaction` operation.
+int isTransactionOp(u8 opCode);
+
+// isInitOp - check if given instruction is an `Init` operation, the first one of every program.
+int isInitOp(u8 opCode);
+
+// isProgramOp - check if given instruction is a `Program` operation (runs a trigger sub-program).
+int isProgramOp(u8 opCode);
+
 
 
 /**
  * Main driver
  * -----------
+ * Called by the amalgamation for every executed opcode.
  * Stateful trace logger that catches EVERY read and write operation.
  * In SQLite3, a record read is done by and only by the `column` VDBE
  * operation on the record the specified cursor is pointing at.
  * While `column` does not tell which record is being read, we can
  * maintain the cursor state and know the recordId from other instruction.
+ * All `column` operations on a row are folded into one READ carrying the
+ * bitmap of the columns accessed. The read is pending on its cursor and is
+ * emitted when that cursor moves or closes, or when a `column` reads through
+ * another cursor, as the inner loop of a join does.
+ * A statement run in autocommit mode never executes `AutoCommit`; its first
+ * `Transaction` opens an implicit transaction and its `Halt` commits it (or
+ * aborts it on error), so every statement is traced inside BEGIN/COMMIT.
  */
 void sqlite3TraceInterceptor(VdbeOp *pOp);
 
+/**
+ * Connection-aware variant of `sqlite3TraceInterceptor`. `db` is the executing
+ * VDBE's handle (`p->db`); the opcode is traced into the context attached to it,
+ * or into the process-wide context if none is attached.
+ */
+void sqlite3TraceInterceptorDb(sqlite3 *db, VdbeOp *pOp);
+
+/**
+ * `sqlite3TraceInterceptorDb` that also gets the bounds of the program `pOp`
+ * belongs to (`p->aOp`, `p->nOp`, which OP_Program switches to the trigger
+ * program it runs). The VDBE profiler only registers statements whose bounds
+ * it knows, so it never reads past the end of their program.
+ */
+void sqlite3TraceInterceptorProgram(sqlite3 *db, VdbeOp *pOp, VdbeOp *aOp, int nOp);
+
 
 /**
 * Tracer state management struct. Mainly used for tracking
@@ -50,19 +106,363 @@ typedef struct {
 
  // Current rowId.
  int rowId;
+
+ // Hash of the record the current read observed, when value hashing is on.
+ uint64_t readHash;
+
+ // Columns read from the current row so far (see TRACE_COLUMN_BIT).
+ uint64_t columns;
+
+ // Cursor the current row was read through.
+ int cursor;
 } TraceState;
 
+// Cursors numbered at or above this are not tracked for ranges or tables.
+#define TRACE_MAX_CURSORS 64
+
+/**
+* Range read bookkeeping for one VDBE cursor. A scan starts at Rewind, Last or
+* a Seek, grows with every row read through the cursor and ends when the
+* cursor is re-positioned, closed or the statement halts; it is then emitted
+* as a RANGE. A Next/Prev that is not followed by another row ran off the end
+* of the b-tree, which leaves that end of the range unbounded.
+*/
+typedef struct {
+ // Root page of the b-tree the cursor is open on, 0 when closed.
+ unsigned root;
+ // The cursor is on row `rowId`; cleared when it moves.
+ int onRow;
+ int64_t rowId;
+ // A read of the current row is pending: the columns loaded so far, the hash
+ // of its record and, unless the filter dropped it, its operation. `rowIdSet`
+ // tells whether setRowId has named the row since the read started.
+ int reading;
+ int rowIdSet;
+ TransactionOp *readOp;
+ uint64_t columns;
+ uint64_t readHash;
+ // TRACE_FLAG_BACKWARD | TRACE_FLAG_INDEX
+ unsigned flags;
+ int scanning;
+ // The last operation on the cursor was a step.
+ int stepped;
+ int64_t lowerBound;
+ int64_t upperBound;
+ // The context's filter drops everything done through the cursor.
+ int filtered;
+} TraceCursor;
+
 TraceState* initTraceState();
 
-// Sets the rowId of the current state
+// Legacy hook: rowids outside the int range cannot be named through it.
 void setRowId(int rowId);
 
+// Names the row of the pending read, when it has not been named since it
+// started, else of the next `column` to start one. Called once per row, either
+// before its first `column` or after it, with the full 64-bit rowid so the READ
+// matches the writes and ranges of the same row.
+void setRowIdDb(sqlite3 *db, i64 rowId);
+
 // Intercepts write inside an "Insert" opcode
 void interceptWrite(VdbeOp *pOp, int recordId, char* val);
 
-// Enables trace output to stdout.
+void interceptWriteDb(sqlite3 *db, VdbeOp *pOp, int recordId, char* val);
+
+/**
+ * Intercepts the write of an "Insert" opcode with the full serialized record
+ * from its data register (`pData->z`, `pData->n`). The record is copied into
+ * the transaction's arena, subject to the capture settings, before returning.
+ * The string hooks above forward here with `strlen(val)` bytes.
+ */
+void interceptWriteRecord(sqlite3 *db, VdbeOp *pOp, i64 recordId, const void *pData, int nData);
+
+/**
+ * Intercepts a "Delete" opcode removing row `recordId` from the table under its
+ * cursor (`pC->movetoTarget` or the cursor's integer key). Logged as a WRITE with
+ * TRACE_FLAG_DELETE. Deletes flagged OPFLAG_ISNOOP remove nothing and are ignored.
+ */
+void interceptDelete(sqlite3 *db, VdbeOp *pOp, i64 recordId);
+
+/**
+ * Intercepts an "IdxInsert" or "IdxDelete" opcode with the serialized index key
+ * it inserts (`pIn2->z`, `pIn2->n`) or the entry it found to delete. Logged as a
+ * WRITE on the index with TRACE_FLAG_INDEX (and TRACE_FLAG_DELETE for IdxDelete)
+ * whose objectId is the key's traceHash64; the key itself is never copied.
+ */
+void interceptIndexWrite(sqlite3 *db, VdbeOp *pOp, const void *pKey, int nKey);
+
+/**
+ * Intercepts the integer key a SeekGE/SeekGT/SeekLE/SeekLT opcode positions
+ * its cursor with, which becomes the bound the range scan starts from. Without
+ * it, a table scan starts at the first row it reads and an index scan is
+ * treated as covering the whole index.
+ */
+void setSeekKeyDb(sqlite3 *db, VdbeOp *pOp, i64 key);
+
+/**
+ * Intercepts the record a "Column" opcode loads for the row under its cursor,
+ * once per row: the whole `pC->payloadSize` bytes, read off the overflow pages
+ * when `pC->aRow` only holds the first `pC->szRow` of them. Only used when value
+ * hashing is on: the READ of that row is logged with the record's hash.
+ */
+void interceptReadRecord(sqlite3 *db, VdbeOp *pOp, const void *pData, int nData);
+
+// Enables tracing with output to stdout.
 void enableTraceOutput();
 
+/**
+* Output format for traced operations.
+* NULL builds every operation and drops it at the sink, TEXT is the
+* `printTransactionOp` format and BINARY is the `writeTransactionOp` format.
+* RING keeps the latest binary records in memory (see `sqlite3_trw_ring`).
+*/
+typedef enum
+{
+    TRACE_SINK_NULL,
+    TRACE_SINK_TEXT,
+    TRACE_SINK_BINARY,
+    TRACE_SINK_RING
+} TraceSinkType;
+
+// The process-wide ring every RING sink appends to, created on first use with
+// TRACE_RING_DEFAULT_CAPACITY records. NULL if out of memory.
+TraceRing *sqlite3_trw_ring();
+
+// Caps captured write payloads of the process-wide context at `maxValueBytes`
+// (TRACE_VALUE_UNLIMITED for no cap) and optionally hashes written and read records.
+// `setTraceCapture(TRACE_VALUE_NONE, 1)` is value hashing mode: only hashes are logged.
+void setTraceCapture(int maxValueBytes, int hashValues);
+
+// Routes trace output to `pOut` using `sink`. A BINARY sink writes the file header first;
+// the index of the previous sink, if any, is finished (see `setTraceIndex`).
+// a RING sink ignores `pOut`.
+// Does not turn tracing on by itself; see `sqlite3_trw_enable`. The statement
+// table the records refer to is written by the caller (see `writeStatementTable`).
+void setTraceSink(TraceSinkType sink, FILE *pOut);
+
+/**
+ * Indexes the process-wide BINARY sink's output into `pIndex` (see
+ * traceIndexCreate), every `interval` records or TRACE_INDEX_DEFAULT_INTERVAL
+ * for 0. Call right after `setTraceSink`, before anything is traced. The index
+ * is finished by the next call, with NULL to stop indexing, or by `setTraceSink`;
+ * `pIndex` stays owned by the caller.
+ */
+int setTraceIndex(FILE *pIndex, unsigned interval);
+
+// ------------ Runtime Control ----------
+/**
+ * Turns tracing on or off for the whole process. While tracing is off every
+ * hook returns after a single branch: no opcode is classified and nothing is
+ * allocated. Pending per-thread state is kept and flushed once tracing resumes.
+ */
+void sqlite3_trw_enable(int onoff);
+
+int sqlite3_trw_enabled();
+
+// Flushes the process-wide context's output stream.
+void sqlite3_trw_flush();
+
+/**
+ * Loads the set of traced opcodes from a JSON file such as imptInsts.json:
+ *   {"important": ["Transaction", ...], "traced": ["Column", ...]}
+ * Opcodes in either list are traced; without "traced", every opcode the tracer
+ * has a handler for is. The TRW_OPCODES environment variable, a comma-separated
+ * list of opcode names, replaces "traced". Names without a handler are ignored.
+ * The opcodes the tracer keeps its state with are traced whatever the lists
+ * say: Init, Program, Transaction, AutoCommit, Savepoint, OpenRead, OpenWrite,
+ * Close and Halt.
+ * With `zPath` NULL the file named by TRW_CONFIG is used, else imptInsts.json in
+ * the working directory if it exists. Runs with NULL the first time tracing is
+ * enabled unless called before. Returns SQLITE_ERROR, keeping the previous
+ * configuration, if the file cannot be read or parsed.
+ */
+int sqlite3_trw_configure(const char *zPath);
+
+/**
+ * Registers the "trw" VFS shim as the default VFS so that
+ * `PRAGMA trw_trace` and `PRAGMA trw_trace=on|off` control tracing from SQL.
+ * Call once, after sqlite3_initialize() and before opening connections.
+ */
+int sqlite3_trw_init();
+
+/**
+ * Registers the `trw_trace` virtual table module on `db`. `sqlite3_trw_init`
+ * installs it as an auto extension, so every connection opened afterwards has it.
+ *   SELECT * FROM trw_trace;                               -- the in-memory ring
+ *   CREATE VIRTUAL TABLE t USING trw_trace('trace.bin');   -- a binary trace file
+ * Columns: seq, ts, txn, thread, op, "table", rowid, value_hash, stmt, sql. `sql`
+ * is the statement's normalized SQL, from the process's statement table for the
+ * ring and from the file's statement table (TRACE_STATEMENTS_SUFFIX), if any,
+ * for a file. Constraints on seq ranges and on txn are evaluated against the
+ * buffers, which are read in place; a file with an index (TRACE_INDEX_SUFFIX)
+ * is only read where the index says matching records can be.
+ */
+int sqlite3_trw_vtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+// ------------ Per-connection Contexts ----------
+// Default stdio buffer of a context that opens its own output file.
+#define TRACE_CONTEXT_BUFFER_SIZE (1 << 20)
+
+typedef struct TraceContext TraceContext;
+
+typedef struct
+{
+    // Operations recorded per OpType.
+    unsigned long long events[OP_TYPE_COUNT];
+    // Operations discarded by the context's filter.
+    unsigned long long dropped;
+    // Bytes handed to the sink, and recorded operations the sink failed to take
+    // (short writes, no ring). A NULL sink writes nothing and loses nothing.
+    unsigned long long bytes;
+    unsigned long long lost;
+} TraceStats;
+
+// Statistics of the process-wide context.
+void sqlite3_trw_stats(TraceStats *pStats);
+
+// Clears the process-wide context's statistics and the opcode hook profile.
+void sqlite3_trw_reset_stats();
+
+/**
+ * Capture-time filters of the process-wide context. They are checked where an
+ * operation is captured, before it is allocated, its value copied or hashed,
+ * or anything formatted; what they reject counts as dropped. Operations on no
+ * table, such as BEGIN and COMMIT, only go through the op type filter.
+ * Call them while no statement is being traced: cursors already open keep the
+ * decision taken when they were opened.
+ */
+
+// Records only the b-trees rooted at `roots`; n == 0 records every table. Root
+// pages are numbered per database, see sqlite3_trw_filter_schemas.
+int sqlite3_trw_filter_tables(const unsigned *roots, int n);
+
+// Records only the schemas in `schemaMask`: bit i for database i of the
+// connection (0 main, 1 temp, then attached databases); 0 records them all.
+void sqlite3_trw_filter_schemas(unsigned schemaMask);
+
+// Records only table rows with minRowId <= rowid <= maxRowId, and the ranges
+// that overlap them. TRACE_KEY_MIN, TRACE_KEY_MAX records every row. Index
+// entries are not filtered by row.
+void sqlite3_trw_filter_rowids(int64_t minRowId, int64_t maxRowId);
+
+// Records only the operations in `opTypeMask` (`1 << OpType`); 0 records them all.
+void sqlite3_trw_filter_ops(unsigned opTypeMask);
+
+typedef struct
+{
+    // Opcode hook invocations and the nanoseconds spent in them, indexed by opcode.
+    unsigned long long calls[256];
+    unsigned long long nanos[256];
+} TraceHookStats;
+
+// Times every traced opcode hook while on. Off by default: it costs two clock reads per hook.
+void sqlite3_trw_profile_hooks(int onoff);
+
+int sqlite3_trw_hooks_profiled();
+
+void sqlite3_trw_hook_stats(TraceHookStats *pStats);
+
+// ------------ VDBE Profiler ----------
+/**
+ * Aggregates the VDBE's own per-op counters (VdbeOp.nExec / nCycle) per opcode
+ * and per statement across all connections and threads, and measures the cost
+ * of the interceptor with the same clock, so that it can be reported apart
+ * from the cost of the opcodes it intercepts. The counters of a program are
+ * consumed when it halts: sqlite3_stmt_scanstatus() sees them reset.
+ * Works whether or not tracing is enabled. Returns SQLITE_ERROR when the
+ * amalgamation is built without SQLITE_ENABLE_STMT_SCANSTATUS or VDBE_PROFILE.
+ * Unless built with VDBE_PROFILE, the VDBE only counts for connections that
+ * have SQLITE_DBCONFIG_STMT_SCANSTATUS on, which is off by default: turn it on
+ * for every profiled connection with sqlite3_trw_profile_db.
+ */
+int sqlite3_trw_profile(int onoff);
+
+// Turns SQLITE_DBCONFIG_STMT_SCANSTATUS on or off for `db`, which makes the
+// VDBE keep the op counters of the connection's statements from their next
+// sqlite3_step(). Returns SQLITE_ERROR when the counters are not built in.
+int sqlite3_trw_profile_db(sqlite3 *db, int onoff);
+
+int sqlite3_trw_profiling();
+
+void sqlite3_trw_profile_reset();
+
+// Per-opcode totals, then per-statement totals with the statement's SQL.
+void sqlite3_trw_profile_report(FILE *pOut);
+
+/**
+ * Writes the profile as folded stacks for flamegraph tools:
+ *   <statement hash>;<opcode> <vdbe cycles>
+ *   <statement hash>;<opcode>;trw_hook <hook cycles>
+ * Statements are hashed from their SQL text (traceHash64), or from their
+ * bytecode when the connection runs several statements at once.
+ * Without a cycle counter the weights are executions and there are no hook frames.
+ */
+void sqlite3_trw_profile_folded(FILE *pOut);
+
+// Internal to the profiler, called by the interceptor.
+uint64_t traceProfileClock();
+// `end` is one past the last op of pOp's program, NULL if unknown.
+uint64_t traceProfileOp(sqlite3 *db, VdbeOp *pOp, VdbeOp *end);
+void traceProfileHook(uint64_t statement, u8 opcode, uint64_t hookCycles, uint64_t profileCycles);
+int traceProfileSupported();
+
+// The statement of `db` being stepped, or NULL if none or several are.
+sqlite3_stmt *traceRunningStatement(sqlite3 *db);
+
+// Appended to a trace file's name to name the statement table and the index written next to it.
+#define TRACE_STATEMENTS_SUFFIX ".sql"
+#define TRACE_INDEX_SUFFIX ".idx"
+
+typedef struct
+{
+    TraceSinkType sink;
+    // File the context opens, owns and buffers itself. The statement table is
+    // written to `path` TRACE_STATEMENTS_SUFFIX when the context is destroyed. When NULL, output goes to `out`,
+    // which stays owned by the caller.
+    const char *path;
+    FILE *out;
+    // Bitmask of `1 << OpType` to record; 0 records every operation.
+    unsigned opTypeMask;
+    // The other capture-time filters, as sqlite3_trw_filter_* sets them for the
+    // process-wide context: the schemas (0 for all) and table roots (none for
+    // all) to record and, when `filterRowIds` is set, the rows.
+    unsigned schemaMask;
+    const unsigned *tables;
+    int nTables;
+    int filterRowIds;
+    int64_t minRowId;
+    int64_t maxRowId;
+    // First transaction id handed out by the context's allocator. Give contexts that
+    // share an analysis disjoint ranges.
+    int transactionIdBase;
+    // Size of the private buffer for `path`; 0 uses TRACE_CONTEXT_BUFFER_SIZE.
+    size_t bufferSize;
+    // Cap on captured write payloads; TRACE_VALUE_UNLIMITED (0) copies them whole,
+    // TRACE_VALUE_NONE copies nothing.
+    int maxValueBytes;
+    // Hash every written and read record (see traceHash64).
+    int hashValues;
+    // A BINARY sink with a `path` is indexed into `path` TRACE_INDEX_SUFFIX every
+    // `indexInterval` records; 0 uses TRACE_INDEX_DEFAULT_INTERVAL and -1 writes no index.
+    int indexInterval;
+} TraceContextConfig;
+
+/**
+ * Attaches a tracer context to `db`. From then on the connection is traced into
+ * the context's own sink, with its own filter, transaction id allocator and
+ * statistics, whether or not process-wide tracing is enabled. Attaching again
+ * replaces the previous context; closing the connection destroys it.
+ * Only the `...Db` hooks can see the context. Returns NULL on failure.
+ */
+TraceContext *sqlite3_trw_attach(sqlite3 *db, const TraceContextConfig *config);
+
+void sqlite3_trw_detach(sqlite3 *db);
+
+void sqlite3_trw_context_enable(TraceContext *ctx, int onoff);
+
+void sqlite3_trw_context_stats(TraceContext *ctx, TraceStats *pStats);
+// --------------------------------------------------
+
 #ifdef __cplusplus
 }
 #endif
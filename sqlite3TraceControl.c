@@ -0,0 +1,295 @@
+#include "sqlite3TraceAdapter.h"
+#include <string.h>
+
+// ------------------------------------------
+// ---- PRAGMA trw_trace via a VFS shim -----
+// ------------------------------------------
+// Pragmas unknown to SQLite are first offered to the database file through
+// SQLITE_FCNTL_PRAGMA. The "trw" VFS wraps the default VFS and answers
+// `PRAGMA trw_trace` / `PRAGMA trw_trace=on|off` on main database files, so
+// tracing can be toggled from SQL without touching the amalgamation's pragma
+// table. In-memory databases have no file and therefore do not see the pragma.
+// The forwarding methods are version 3, as are the unix and win32 VFSes.
+
+#define TRACE_CONTROL_VFS_NAME "trw"
+#define TRACE_PRAGMA_NAME "trw_trace"
+
+typedef struct
+{
+    sqlite3_file base;
+    // The wrapped file, allocated directly after this struct.
+    sqlite3_file *pReal;
+} TraceControlFile;
+
+static sqlite3_vfs traceControlVfs;
+
+static sqlite3_vfs *realVfs()
+{
+    return (sqlite3_vfs *)traceControlVfs.pAppData;
+}
+
+static sqlite3_file *realFile(sqlite3_file *pFile)
+{
+    return ((TraceControlFile *)pFile)->pReal;
+}
+
+// Parses an on/off pragma argument. Returns -1 if it is neither.
+static int parseSwitch(const char *zArg)
+{
+    if (sqlite3_stricmp(zArg, "on") == 0 || sqlite3_stricmp(zArg, "true") == 0 || strcmp(zArg, "1") == 0)
+    {
+        return 1;
+    }
+    if (sqlite3_stricmp(zArg, "off") == 0 || sqlite3_stricmp(zArg, "false") == 0 || strcmp(zArg, "0") == 0)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+static int handleTracePragma(char **azArg)
+{
+    if (azArg[2] != NULL)
+    {
+        int onoff = parseSwitch(azArg[2]);
+        if (onoff < 0)
+        {
+            azArg[0] = sqlite3_mprintf("%s expects on or off", TRACE_PRAGMA_NAME);
+            return SQLITE_ERROR;
+        }
+        sqlite3_trw_enable(onoff);
+    }
+
+    azArg[0] = sqlite3_mprintf("%s", sqlite3_trw_enabled() ? "on" : "off");
+    return SQLITE_OK;
+}
+
+static int controlClose(sqlite3_file *pFile)
+{
+    return realFile(pFile)->pMethods->xClose(realFile(pFile));
+}
+
+static int controlRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+    return realFile(pFile)->pMethods->xRead(realFile(pFile), zBuf, iAmt, iOfst);
+}
+
+static int controlWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+    return realFile(pFile)->pMethods->xWrite(realFile(pFile), zBuf, iAmt, iOfst);
+}
+
+static int controlTruncate(sqlite3_file *pFile, sqlite3_int64 size)
+{
+    return realFile(pFile)->pMethods->xTruncate(realFile(pFile), size);
+}
+
+static int controlSync(sqlite3_file *pFile, int flags)
+{
+    return realFile(pFile)->pMethods->xSync(realFile(pFile), flags);
+}
+
+static int controlFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize)
+{
+    return realFile(pFile)->pMethods->xFileSize(realFile(pFile), pSize);
+}
+
+static int controlLock(sqlite3_file *pFile, int eLock)
+{
+    return realFile(pFile)->pMethods->xLock(realFile(pFile), eLock);
+}
+
+static int controlUnlock(sqlite3_file *pFile, int eLock)
+{
+    return realFile(pFile)->pMethods->xUnlock(realFile(pFile), eLock);
+}
+
+static int controlCheckReservedLock(sqlite3_file *pFile, int *pResOut)
+{
+    return realFile(pFile)->pMethods->xCheckReservedLock(realFile(pFile), pResOut);
+}
+
+static int controlFileControl(sqlite3_file *pFile, int op, void *pArg)
+{
+    if (op == SQLITE_FCNTL_PRAGMA)
+    {
+        char **azArg = (char **)pArg;
+        if (sqlite3_stricmp(azArg[1], TRACE_PRAGMA_NAME) == 0)
+        {
+            return handleTracePragma(azArg);
+        }
+    }
+    return realFile(pFile)->pMethods->xFileControl(realFile(pFile), op, pArg);
+}
+
+static int controlSectorSize(sqlite3_file *pFile)
+{
+    return realFile(pFile)->pMethods->xSectorSize(realFile(pFile));
+}
+
+static int controlDeviceCharacteristics(sqlite3_file *pFile)
+{
+    return realFile(pFile)->pMethods->xDeviceCharacteristics(realFile(pFile));
+}
+
+static int controlShmMap(sqlite3_file *pFile, int iPg, int pgsz, int bExtend, void volatile **pp)
+{
+    return realFile(pFile)->pMethods->xShmMap(realFile(pFile), iPg, pgsz, bExtend, pp);
+}
+
+static int controlShmLock(sqlite3_file *pFile, int offset, int n, int flags)
+{
+    return realFile(pFile)->pMethods->xShmLock(realFile(pFile), offset, n, flags);
+}
+
+static void controlShmBarrier(sqlite3_file *pFile)
+{
+    realFile(pFile)->pMethods->xShmBarrier(realFile(pFile));
+}
+
+static int controlShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+    return realFile(pFile)->pMethods->xShmUnmap(realFile(pFile), deleteFlag);
+}
+
+static int controlFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp)
+{
+    return realFile(pFile)->pMethods->xFetch(realFile(pFile), iOfst, iAmt, pp);
+}
+
+static int controlUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *p)
+{
+    return realFile(pFile)->pMethods->xUnfetch(realFile(pFile), iOfst, p);
+}
+
+// Methods of every io_methods version, in their order from xClose on.
+#define CONTROL_IO_METHODS_V1                                                                                        \
+    controlClose, controlRead, controlWrite, controlTruncate, controlSync, controlFileSize, controlLock,            \
+        controlUnlock, controlCheckReservedLock, controlFileControl, controlSectorSize, controlDeviceCharacteristics
+#define CONTROL_IO_METHODS_V2 CONTROL_IO_METHODS_V1, controlShmMap, controlShmLock, controlShmBarrier, controlShmUnmap
+#define CONTROL_IO_METHODS_V3 CONTROL_IO_METHODS_V2, controlFetch, controlUnfetch
+
+// One table per io_methods version: a wrapped file offers exactly the methods
+// of the file it wraps, so nothing is forwarded to a method the real file lacks.
+static const sqlite3_io_methods traceControlIoMethods[] = {
+    {1, CONTROL_IO_METHODS_V1},
+    {2, CONTROL_IO_METHODS_V2},
+    {3, CONTROL_IO_METHODS_V3},
+};
+
+static const sqlite3_io_methods *controlIoMethods(const sqlite3_io_methods *pReal)
+{
+    if (pReal == NULL) return NULL;
+    int iVersion = pReal->iVersion < 1 ? 1 : pReal->iVersion > 3 ? 3 : pReal->iVersion;
+    return &traceControlIoMethods[iVersion - 1];
+}
+
+static int controlOpen(sqlite3_vfs *pVfs, sqlite3_filename zName, sqlite3_file *pFile, int flags, int *pOutFlags)
+{
+    // Only main database files receive pragmas. Everything else is opened
+    // straight into `pFile` and never goes through the forwarding methods.
+    if (!(flags & SQLITE_OPEN_MAIN_DB))
+    {
+        return realVfs()->xOpen(realVfs(), zName, pFile, flags, pOutFlags);
+    }
+
+    TraceControlFile *p = (TraceControlFile *)pFile;
+    p->pReal = (sqlite3_file *)&p[1];
+    int rc = realVfs()->xOpen(realVfs(), zName, p->pReal, flags, pOutFlags);
+    // A failed open leaves no methods, so SQLite will not call xClose on the wrapper either.
+    p->base.pMethods = controlIoMethods(p->pReal->pMethods);
+    return rc;
+}
+
+static int controlDelete(sqlite3_vfs *pVfs, const char *zName, int syncDir)
+{
+    return realVfs()->xDelete(realVfs(), zName, syncDir);
+}
+
+static int controlAccess(sqlite3_vfs *pVfs, const char *zName, int flags, int *pResOut)
+{
+    return realVfs()->xAccess(realVfs(), zName, flags, pResOut);
+}
+
+static int controlFullPathname(sqlite3_vfs *pVfs, const char *zName, int nOut, char *zOut)
+{
+    return realVfs()->xFullPathname(realVfs(), zName, nOut, zOut);
+}
+
+static void *controlDlOpen(sqlite3_vfs *pVfs, const char *zFilename)
+{
+    return realVfs()->xDlOpen(realVfs(), zFilename);
+}
+
+static void controlDlError(sqlite3_vfs *pVfs, int nByte, char *zErrMsg)
+{
+    realVfs()->xDlError(realVfs(), nByte, zErrMsg);
+}
+
+static void (*controlDlSym(sqlite3_vfs *pVfs, void *p, const char *zSym))(void)
+{
+    return realVfs()->xDlSym(realVfs(), p, zSym);
+}
+
+static void controlDlClose(sqlite3_vfs *pVfs, void *pHandle)
+{
+    realVfs()->xDlClose(realVfs(), pHandle);
+}
+
+static int controlRandomness(sqlite3_vfs *pVfs, int nByte, char *zBufOut)
+{
+    return realVfs()->xRandomness(realVfs(), nByte, zBufOut);
+}
+
+static int controlSleep(sqlite3_vfs *pVfs, int nMicro)
+{
+    return realVfs()->xSleep(realVfs(), nMicro);
+}
+
+static int controlCurrentTime(sqlite3_vfs *pVfs, double *pTimeOut)
+{
+    return realVfs()->xCurrentTime(realVfs(), pTimeOut);
+}
+
+static int controlGetLastError(sqlite3_vfs *pVfs, int nErr, char *zErr)
+{
+    return realVfs()->xGetLastError(realVfs(), nErr, zErr);
+}
+
+static int controlCurrentTimeInt64(sqlite3_vfs *pVfs, sqlite3_int64 *pTimeOut)
+{
+    return realVfs()->xCurrentTimeInt64(realVfs(), pTimeOut);
+}
+
+int sqlite3_trw_init()
+{
+    if (traceControlVfs.zName != NULL) return SQLITE_OK;
+
+    sqlite3_vfs *pReal = sqlite3_vfs_find(NULL);
+    if (pReal == NULL) return SQLITE_ERROR;
+
+    traceControlVfs.iVersion = 2;
+    traceControlVfs.szOsFile = (int)sizeof(TraceControlFile) + pReal->szOsFile;
+    traceControlVfs.mxPathname = pReal->mxPathname;
+    traceControlVfs.zName = TRACE_CONTROL_VFS_NAME;
+    traceControlVfs.pAppData = pReal;
+    traceControlVfs.xOpen = controlOpen;
+    traceControlVfs.xDelete = controlDelete;
+    traceControlVfs.xAccess = controlAccess;
+    traceControlVfs.xFullPathname = controlFullPathname;
+    traceControlVfs.xDlOpen = controlDlOpen;
+    traceControlVfs.xDlError = controlDlError;
+    traceControlVfs.xDlSym = controlDlSym;
+    traceControlVfs.xDlClose = controlDlClose;
+    traceControlVfs.xRandomness = controlRandomness;
+    traceControlVfs.xSleep = controlSleep;
+    traceControlVfs.xCurrentTime = controlCurrentTime;
+    traceControlVfs.xGetLastError = controlGetLastError;
+    traceControlVfs.xCurrentTimeInt64 = pReal->iVersion >= 2 ? controlCurrentTimeInt64 : NULL;
+    if (traceControlVfs.xCurrentTimeInt64 == NULL) traceControlVfs.iVersion = 1;
+
+    // Every connection opened from here on gets `trw_trace`.
+    int rc = sqlite3_auto_extension((void (*)(void))sqlite3_trw_vtab_init);
+    if (rc != SQLITE_OK) return rc;
+    return sqlite3_vfs_register(&traceControlVfs, 1);
+}
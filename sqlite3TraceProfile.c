@@ -0,0 +1,521 @@
+#include "sqlite3TraceAdapter.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// ------------------------------------------
+// ------------ VDBE profiler ---------------
+// ------------------------------------------
+// With SQLITE_ENABLE_STMT_SCANSTATUS (or VDBE_PROFILE) the VDBE counts, in
+// every VdbeOp, how often the op ran (nExec) and the cycles it took (nCycle).
+// The profiler registers each program as its Init runs and, when the program
+// halts, adds the counters of all its ops to a process-wide table keyed by
+// statement and opcode, then zeroes them so the next run starts from scratch.
+// A statement is identified by the hash of its SQL text when the connection
+// tells which statement is starting, else by the hash of its bytecode.
+// Trigger programs are charged to the statement that fired them.
+//
+// The interceptor runs inside the cycle window of the op it intercepts, so its
+// own cost is measured with the same clock and reported separately: the VDBE
+// cycles of an opcode are its nCycle minus the hook cycles spent on it, the
+// tracer's and the profiler's. Only the tracer's are reported as hook cost.
+// A program only has known bounds once its Init has been seen, so statements
+// already running when profiling starts, or reset before they halt, are skipped.
+// So are all statements when the amalgamation calls sqlite3TraceInterceptorDb,
+// which does not pass the length of the program.
+
+#if defined(SQLITE_ENABLE_STMT_SCANSTATUS) || defined(VDBE_PROFILE)
+#define TRACE_OP_COUNTERS 1
+#else
+#define TRACE_OP_COUNTERS 0
+#endif
+
+// Programs a thread can be inside of at once: statements stepped from within
+// other statements and the trigger programs they run.
+#define PROFILE_MAX_PROGRAMS 16
+// Longest statement trailer (Transaction, TableLock, factored constants) searched for its closing Goto.
+#define PROFILE_MAX_TRAILER 4096
+// Longest trigger program accepted between its Init and its Halt.
+#define PROFILE_MAX_TRIGGER (1 << 20)
+
+#define PROFILE_HOOK_FRAME "trw_hook"
+
+typedef struct
+{
+    unsigned long long exec;
+    unsigned long long cycles;
+    unsigned long long hookCalls;
+    unsigned long long hookCycles;
+    // The profiler's own bookkeeping, which is neither VDBE nor tracer cost.
+    unsigned long long profileCycles;
+} ProfileCounters;
+
+typedef struct
+{
+    uint64_t hash;
+    // 0 marks a free slot; opcodes are stored plus one.
+    int opcode;
+    ProfileCounters counters;
+} ProfileEntry;
+
+typedef struct
+{
+    uint64_t hash;
+    unsigned long long runs;
+    // NULL when the statement was identified by its bytecode.
+    char *sql;
+} ProfileStatement;
+
+typedef struct
+{
+    VdbeOp *base;
+    // Closing Goto of a statement's trailer; NULL for a trigger program, which ends at its Halt.
+    VdbeOp *end;
+    uint64_t hash;
+} ProfileProgram;
+
+typedef struct
+{
+    ProfileProgram programs[PROFILE_MAX_PROGRAMS];
+    int nProgram;
+    // The last op was a Program, so the next Init starts a trigger program.
+    int enteringFrame;
+    // Hook cost not yet added to the process-wide table, for statement `hookHash`.
+    uint64_t hookHash;
+    unsigned long long hookCalls[256];
+    unsigned long long hookCycles[256];
+    unsigned long long profileCycles[256];
+} ProfileThread;
+
+static __thread ProfileThread profileThread;
+
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static ProfileEntry *entries = NULL;
+static size_t nEntries = 0;
+static size_t entryCapacity = 0;
+static ProfileStatement *statements = NULL;
+static size_t nStatements = 0;
+static size_t statementCapacity = 0;
+
+enum
+{
+    PROFILE_OP_UNRESOLVED,
+    PROFILE_OP_OTHER,
+    PROFILE_OP_INIT,
+    PROFILE_OP_PROGRAM,
+    PROFILE_OP_HALT,
+    PROFILE_OP_GOTO
+};
+
+static _Atomic unsigned char opcodeKinds[256];
+
+static int opcodeKind(u8 opCode)
+{
+    int kind = atomic_load_explicit(&opcodeKinds[opCode], memory_order_relaxed);
+    if (kind != PROFILE_OP_UNRESOLVED) return kind;
+
+    if (isInitOp(opCode)) kind = PROFILE_OP_INIT;
+    else if (isProgramOp(opCode)) kind = PROFILE_OP_PROGRAM;
+    else if (isHaltOp(opCode)) kind = PROFILE_OP_HALT;
+    else if (strcmp(sqlite3OpcodeName(opCode), "Goto") == 0) kind = PROFILE_OP_GOTO;
+    else kind = PROFILE_OP_OTHER;
+    atomic_store_explicit(&opcodeKinds[opCode], kind, memory_order_relaxed);
+    return kind;
+}
+
+uint64_t traceProfileClock()
+{
+    // The clock sqlite3Hwtime() uses for nCycle; without one both are 0.
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static size_t entrySlot(uint64_t hash, int opcode)
+{
+    uint64_t h = hash ^ ((uint64_t)opcode * 0x9e3779b97f4a7c15ull);
+    return (size_t)(h ^ (h >> 29)) & (entryCapacity - 1);
+}
+
+// The counters of `opcode` in statement `hash`, created on first use. Called with profileMutex held.
+static ProfileCounters *profileCounters(uint64_t hash, u8 opcode)
+{
+    if (2 * (nEntries + 1) > entryCapacity)
+    {
+        size_t capacity = entryCapacity ? 2 * entryCapacity : 1024;
+        ProfileEntry *grown = calloc(capacity, sizeof(ProfileEntry));
+        if (!grown) return NULL;
+
+        ProfileEntry *old = entries;
+        size_t oldCapacity = entryCapacity;
+        entries = grown;
+        entryCapacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (!old[i].opcode) continue;
+            size_t slot = entrySlot(old[i].hash, old[i].opcode);
+            while (entries[slot].opcode) slot = (slot + 1) & (entryCapacity - 1);
+            entries[slot] = old[i];
+        }
+        free(old);
+    }
+
+    size_t slot = entrySlot(hash, opcode + 1);
+    while (entries[slot].opcode && (entries[slot].hash != hash || entries[slot].opcode != opcode + 1))
+    {
+        slot = (slot + 1) & (entryCapacity - 1);
+    }
+    if (!entries[slot].opcode)
+    {
+        entries[slot].hash = hash;
+        entries[slot].opcode = opcode + 1;
+        nEntries++;
+    }
+    return &entries[slot].counters;
+}
+
+// The statement `hash`, created on first use. Called with profileMutex held.
+static ProfileStatement *profileStatement(uint64_t hash)
+{
+    if (2 * (nStatements + 1) > statementCapacity)
+    {
+        size_t capacity = statementCapacity ? 2 * statementCapacity : 256;
+        ProfileStatement *grown = calloc(capacity, sizeof(ProfileStatement));
+        if (!grown) return NULL;
+
+        ProfileStatement *old = statements;
+        size_t oldCapacity = statementCapacity;
+        statements = grown;
+        statementCapacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (!old[i].hash) continue;
+            size_t slot = (size_t)old[i].hash & (statementCapacity - 1);
+            while (statements[slot].hash) slot = (slot + 1) & (statementCapacity - 1);
+            statements[slot] = old[i];
+        }
+        free(old);
+    }
+
+    // Statement hashes are never 0, which marks free slots.
+    size_t slot = (size_t)hash & (statementCapacity - 1);
+    while (statements[slot].hash && statements[slot].hash != hash) slot = (slot + 1) & (statementCapacity - 1);
+    if (!statements[slot].hash)
+    {
+        statements[slot].hash = hash;
+        nStatements++;
+    }
+    return &statements[slot];
+}
+
+static void flushHookCost(ProfileThread *t)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        if (!t->hookCalls[i]) continue;
+        ProfileCounters *counters = profileCounters(t->hookHash, (u8)i);
+        if (counters)
+        {
+            counters->hookCalls += t->hookCalls[i];
+            counters->hookCycles += t->hookCycles[i];
+            counters->profileCycles += t->profileCycles[i];
+        }
+        t->hookCalls[i] = 0;
+        t->hookCycles[i] = 0;
+        t->profileCycles[i] = 0;
+    }
+}
+
+// Adds the counters of the ops in [first, last] to statement `hash` and zeroes them.
+// `current` is the op being executed: its cycles are still being counted.
+static void collectOps(uint64_t hash, VdbeOp *first, VdbeOp *last, VdbeOp *current)
+{
+#if TRACE_OP_COUNTERS
+    for (VdbeOp *op = first; op <= last; op++)
+    {
+        if (op->nExec == 0) continue;
+        ProfileCounters *counters = profileCounters(hash, op->opcode);
+        if (!counters) return;
+        counters->exec += op->nExec;
+        op->nExec = 0;
+        if (op != current)
+        {
+            counters->cycles += op->nCycle;
+            op->nCycle = 0;
+        }
+    }
+#endif
+}
+
+static uint64_t mixHash(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+// Identifies a statement without SQL text by its bytecode; p4 operands are pointers and left out.
+static uint64_t programHash(const VdbeOp *first, const VdbeOp *last)
+{
+    uint64_t h = 0;
+    for (const VdbeOp *op = first; op <= last; op++)
+    {
+        h = mixHash(h, op->opcode | (uint64_t)op->p5 << 8);
+        h = mixHash(h, (uint32_t)op->p1 | (uint64_t)(uint32_t)op->p2 << 32);
+        h = mixHash(h, (uint32_t)op->p3);
+    }
+    return h ? h : 1;
+}
+
+// Every statement ends with a trailer that Init jumps to and that jumps back to op 1.
+// The search stops at `end`, one past the program's last op.
+static VdbeOp *findTrailerEnd(VdbeOp *init, VdbeOp *end)
+{
+    if (!end || init->p2 <= 0 || init->p2 >= end - init) return NULL;
+    VdbeOp *last = end - init - init->p2 > PROFILE_MAX_TRAILER ? init + init->p2 + PROFILE_MAX_TRAILER : end;
+    for (VdbeOp *op = init + init->p2; op < last; op++)
+    {
+        if (opcodeKind(op->opcode) == PROFILE_OP_GOTO && op->p2 == 1) return op;
+    }
+    return NULL;
+}
+
+static uint64_t currentHash(const ProfileThread *t)
+{
+    return t->nProgram > 0 ? t->programs[t->nProgram - 1].hash : 0;
+}
+
+static void removePrograms(ProfileThread *t, int from, int count)
+{
+    memmove(&t->programs[from], &t->programs[from + count],
+            (t->nProgram - from - count) * sizeof(ProfileProgram));
+    t->nProgram -= count;
+}
+
+static void pushProgram(ProfileThread *t, VdbeOp *base, VdbeOp *end, uint64_t hash)
+{
+    // A program that starts over is not running any more under its earlier entry.
+    for (int i = t->nProgram - 1; i >= 0; i--)
+    {
+        if (t->programs[i].base == base) removePrograms(t, i, 1);
+    }
+    if (t->nProgram == PROFILE_MAX_PROGRAMS) removePrograms(t, 0, 1);
+    t->programs[t->nProgram++] = (ProfileProgram){base, end, hash};
+}
+
+static uint64_t statementHash(sqlite3 *db, VdbeOp *init, VdbeOp *end)
+{
+    sqlite3_stmt *stmt = db ? traceRunningStatement(db) : NULL;
+    const char *sql = stmt ? sqlite3_sql(stmt) : NULL;
+    uint64_t hash = sql ? traceHash64(sql, strlen(sql)) : programHash(init, end);
+    if (!hash) hash = 1;
+
+    pthread_mutex_lock(&profileMutex);
+    ProfileStatement *statement = profileStatement(hash);
+    if (statement && sql && !statement->sql) statement->sql = strdup(sql);
+    if (statement) statement->runs++;
+    pthread_mutex_unlock(&profileMutex);
+    return hash;
+}
+
+static void enterProgram(ProfileThread *t, sqlite3 *db, VdbeOp *pOp, VdbeOp *programEnd)
+{
+    if (t->enteringFrame)
+    {
+        t->enteringFrame = 0;
+        pushProgram(t, pOp, NULL, currentHash(t));
+        return;
+    }
+
+    VdbeOp *end = findTrailerEnd(pOp, programEnd);
+    if (!end) return;
+    pushProgram(t, pOp, end, statementHash(db, pOp, end));
+}
+
+static void haltProgram(ProfileThread *t, VdbeOp *pOp)
+{
+    // The most recent statement holding the Halt is the one running it; later ones never halted.
+    for (int i = t->nProgram - 1; i >= 0; i--)
+    {
+        ProfileProgram *program = &t->programs[i];
+        if (program->end && program->base <= pOp && pOp <= program->end)
+        {
+            pthread_mutex_lock(&profileMutex);
+            collectOps(program->hash, program->base, program->end, pOp);
+            flushHookCost(t);
+            pthread_mutex_unlock(&profileMutex);
+            removePrograms(t, i, t->nProgram - i);
+            return;
+        }
+    }
+
+    // Otherwise it ends the innermost trigger program.
+    ProfileProgram *top = t->nProgram > 0 ? &t->programs[t->nProgram - 1] : NULL;
+    if (top && !top->end && top->base <= pOp && pOp - top->base < PROFILE_MAX_TRIGGER)
+    {
+        pthread_mutex_lock(&profileMutex);
+        collectOps(top->hash, top->base, pOp, pOp);
+        pthread_mutex_unlock(&profileMutex);
+        t->nProgram--;
+    }
+}
+
+uint64_t traceProfileOp(sqlite3 *db, VdbeOp *pOp, VdbeOp *end)
+{
+    ProfileThread *t = &profileThread;
+    switch (opcodeKind(pOp->opcode))
+    {
+    case PROFILE_OP_INIT:
+        enterProgram(t, db, pOp, end);
+        break;
+    case PROFILE_OP_PROGRAM:
+        t->enteringFrame = 1;
+        break;
+    case PROFILE_OP_HALT:
+    {
+        // The Halt itself is charged to the program it ends.
+        uint64_t hash = currentHash(t);
+        haltProgram(t, pOp);
+        return hash;
+    }
+    default:
+        break;
+    }
+    return currentHash(t);
+}
+
+void traceProfileHook(uint64_t hash, u8 opcode, uint64_t hookCycles, uint64_t profileCycles)
+{
+    ProfileThread *t = &profileThread;
+    if (hash != t->hookHash)
+    {
+        pthread_mutex_lock(&profileMutex);
+        flushHookCost(t);
+        pthread_mutex_unlock(&profileMutex);
+        t->hookHash = hash;
+    }
+    t->hookCalls[opcode]++;
+    t->hookCycles[opcode] += hookCycles;
+    t->profileCycles[opcode] += profileCycles;
+}
+
+int traceProfileSupported()
+{
+    return TRACE_OP_COUNTERS;
+}
+
+void sqlite3_trw_profile_reset()
+{
+    pthread_mutex_lock(&profileMutex);
+    for (size_t i = 0; i < statementCapacity; i++) free(statements[i].sql);
+    free(statements);
+    free(entries);
+    statements = NULL;
+    entries = NULL;
+    nStatements = statementCapacity = 0;
+    nEntries = entryCapacity = 0;
+    pthread_mutex_unlock(&profileMutex);
+}
+
+// Hook cost still buffered by the calling thread is added before reporting.
+static void flushCallingThread()
+{
+    pthread_mutex_lock(&profileMutex);
+    flushHookCost(&profileThread);
+    pthread_mutex_unlock(&profileMutex);
+}
+
+static unsigned long long vdbeCycles(const ProfileCounters *counters)
+{
+    unsigned long long hook = counters->hookCycles + counters->profileCycles;
+    return counters->cycles > hook ? counters->cycles - hook : 0;
+}
+
+static void addCounters(ProfileCounters *total, const ProfileCounters *counters)
+{
+    total->exec += counters->exec;
+    total->cycles += counters->cycles;
+    total->hookCalls += counters->hookCalls;
+    total->hookCycles += counters->hookCycles;
+    total->profileCycles += counters->profileCycles;
+}
+
+void sqlite3_trw_profile_report(FILE *pOut)
+{
+    if (!pOut) return;
+    flushCallingThread();
+
+    pthread_mutex_lock(&profileMutex);
+    ProfileCounters byOpcode[256];
+    memset(byOpcode, 0, sizeof(byOpcode));
+    for (size_t i = 0; i < entryCapacity; i++)
+    {
+        if (!entries[i].opcode) continue;
+        addCounters(&byOpcode[entries[i].opcode - 1], &entries[i].counters);
+    }
+
+    fprintf(pOut, "%-16s %14s %18s %14s %18s\n", "opcode", "exec", "vdbe_cycles", "hook_calls", "hook_cycles");
+    for (int i = 0; i < 256; i++)
+    {
+        const ProfileCounters *c = &byOpcode[i];
+        if (!c->exec && !c->hookCalls) continue;
+        fprintf(pOut, "%-16s %14llu %18llu %14llu %18llu\n", sqlite3OpcodeName(i), c->exec, vdbeCycles(c),
+                c->hookCalls, c->hookCycles);
+    }
+
+    fprintf(pOut, "\n%-16s %10s %14s %18s %18s  %s\n", "statement", "runs", "exec", "vdbe_cycles", "hook_cycles",
+            "sql");
+    for (size_t s = 0; s < statementCapacity; s++)
+    {
+        const ProfileStatement *statement = &statements[s];
+        if (!statement->hash) continue;
+
+        unsigned long long exec = 0, cycles = 0, hookCycles = 0;
+        for (size_t i = 0; i < entryCapacity; i++)
+        {
+            if (!entries[i].opcode || entries[i].hash != statement->hash) continue;
+            exec += entries[i].counters.exec;
+            cycles += vdbeCycles(&entries[i].counters);
+            hookCycles += entries[i].counters.hookCycles;
+        }
+        fprintf(pOut, "%016llx %10llu %14llu %18llu %18llu  %s\n", (unsigned long long)statement->hash,
+                statement->runs, exec, cycles, hookCycles,
+                statement->sql ? statement->sql : "<bytecode>");
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
+
+void sqlite3_trw_profile_folded(FILE *pOut)
+{
+    if (!pOut) return;
+    flushCallingThread();
+
+    pthread_mutex_lock(&profileMutex);
+    // Without a cycle counter the stacks are weighted by executions and the hook has no frame.
+    int haveCycles = 0;
+    for (size_t i = 0; i < entryCapacity && !haveCycles; i++)
+    {
+        haveCycles = entries[i].opcode && entries[i].counters.cycles;
+    }
+
+    for (size_t i = 0; i < entryCapacity; i++)
+    {
+        const ProfileEntry *entry = &entries[i];
+        if (!entry->opcode) continue;
+
+        const char *name = sqlite3OpcodeName(entry->opcode - 1);
+        unsigned long long self = haveCycles ? vdbeCycles(&entry->counters) : entry->counters.exec;
+        if (self) fprintf(pOut, "%016llx;%s %llu\n", (unsigned long long)entry->hash, name, self);
+        if (haveCycles && entry->counters.hookCycles)
+        {
+            fprintf(pOut, "%016llx;%s;%s %llu\n", (unsigned long long)entry->hash, name, PROFILE_HOOK_FRAME,
+                    entry->counters.hookCycles);
+        }
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
@@ -0,0 +1,646 @@
+#include "sqlite3TraceAdapter.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ------------------------------------------
+// ------ trw_trace virtual table -----------
+// ------------------------------------------
+// `trw_trace` is eponymous and reads the process-wide ring. Created with a
+// file argument, it maps a binary trace instead. Either way rows are the
+// TraceRecords themselves: nothing is copied or decoded until a column is read.
+// The ring keeps a record in slot `seq % capacity`, so a seq range on it turns
+// into a range of slots and a scan of it comes out in seq order. A trace file
+// is in write order, which is only nearly seq order. It is scanned whole unless
+// it has an index (TRACE_INDEX_SUFFIX): then a seq range only visits the blocks
+// that overlap it, and a txn only the records its transactions span.
+
+#define TRACE_VTAB_NAME "trw_trace"
+#define TRACE_VTAB_SCHEMA \
+    "CREATE TABLE x(seq INTEGER, ts INTEGER, txn INTEGER, thread INTEGER, op TEXT, \"table\" INTEGER, " \
+    "rowid INTEGER, value_hash INTEGER, stmt INTEGER, sql TEXT)"
+
+enum
+{
+    TRACE_COL_SEQ,
+    TRACE_COL_TS,
+    TRACE_COL_TXN,
+    TRACE_COL_THREAD,
+    TRACE_COL_OP,
+    TRACE_COL_TABLE,
+    TRACE_COL_ROWID,
+    TRACE_COL_VALUE_HASH,
+    TRACE_COL_STMT,
+    TRACE_COL_SQL
+};
+
+// idxNum bits: how the seq bounds and the txn are passed to xFilter, in argv order.
+#define TRACE_PLAN_SEQ_EQ 0x01
+#define TRACE_PLAN_SEQ_GT 0x02
+#define TRACE_PLAN_SEQ_GE 0x04
+#define TRACE_PLAN_SEQ_LT 0x08
+#define TRACE_PLAN_SEQ_LE 0x10
+#define TRACE_PLAN_TXN_EQ 0x20
+
+typedef struct
+{
+    sqlite3_vtab base;
+    // The process-wide ring, or NULL for a mapped file.
+    TraceRing *ring;
+    void *map;
+    size_t mapSize;
+    const TraceRecord *records;
+    uint64_t count;
+    // A file's statement table, indexed by statement id; NULL if it has none.
+    char **statements;
+    int nStatements;
+    // A file's index, NULL if it has none. Only a finished index lists every transaction.
+    void *indexMap;
+    size_t indexMapSize;
+    const TraceIndexEntry *indexEntries;
+    uint64_t nIndexEntries;
+    int indexFinished;
+} TraceVtab;
+
+// Records [first, end) of a file to visit.
+typedef struct
+{
+    uint64_t first;
+    uint64_t end;
+} TraceSpan;
+
+typedef struct
+{
+    sqlite3_vtab_cursor base;
+    // Ring: the seq of the current record. File: its index.
+    uint64_t pos;
+    // One past the last position to visit.
+    uint64_t end;
+    // Inclusive seq bounds, empty when seqLo > seqHi.
+    sqlite3_int64 seqLo;
+    sqlite3_int64 seqHi;
+    int hasTxn;
+    int32_t txn;
+    const TraceRecord *pRecord;
+    // File spans still to visit after [pos, end).
+    TraceSpan *spans;
+    int nSpans;
+    int iSpan;
+} TraceVtabCursor;
+
+static const TraceRecord *recordAt(TraceVtab *pTab, uint64_t pos)
+{
+    return pTab->ring ? traceRingGet(pTab->ring, pos) : &pTab->records[pos];
+}
+
+// Maps a binary trace written by a BINARY sink. A trailing partial record is ignored.
+static int mapTraceFile(TraceVtab *pTab, const char *zPath, char **pzErr)
+{
+    int fd = open(zPath, O_RDONLY);
+    if (fd < 0)
+    {
+        *pzErr = sqlite3_mprintf("%s: cannot open %s", TRACE_VTAB_NAME, zPath);
+        return SQLITE_CANTOPEN;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceFileHeader))
+    {
+        close(fd);
+        *pzErr = sqlite3_mprintf("%s: %s is not a trace", TRACE_VTAB_NAME, zPath);
+        return SQLITE_ERROR;
+    }
+
+    pTab->mapSize = (size_t)st.st_size;
+    pTab->map = mmap(NULL, pTab->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pTab->map == MAP_FAILED)
+    {
+        pTab->map = NULL;
+        *pzErr = sqlite3_mprintf("%s: cannot map %s", TRACE_VTAB_NAME, zPath);
+        return SQLITE_IOERR;
+    }
+
+    const TraceFileHeader *header = pTab->map;
+    if (memcmp(header->magic, TRACE_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != TRACE_FORMAT_VERSION || header->recordSize != sizeof(TraceRecord))
+    {
+        *pzErr = sqlite3_mprintf("%s: %s is not a version %d trace", TRACE_VTAB_NAME, zPath, TRACE_FORMAT_VERSION);
+        return SQLITE_ERROR;
+    }
+
+    pTab->records = (const TraceRecord *)((const char *)pTab->map + sizeof(TraceFileHeader));
+    pTab->count = (pTab->mapSize - sizeof(TraceFileHeader)) / sizeof(TraceRecord);
+    return SQLITE_OK;
+}
+
+// Loads the `<id>\t<sql>` lines written by writeStatementTable next to the
+// trace. A missing table is not an error: the sql column is NULL then.
+static int loadStatementTable(TraceVtab *pTab, const char *zTracePath)
+{
+    char *zPath = sqlite3_mprintf("%s" TRACE_STATEMENTS_SUFFIX, zTracePath);
+    if (!zPath) return SQLITE_NOMEM;
+    FILE *in = fopen(zPath, "r");
+    sqlite3_free(zPath);
+    if (!in) return SQLITE_OK;
+
+    int rc = SQLITE_OK;
+    char *zLine = NULL;
+    size_t nLine = 0;
+    ssize_t len;
+    while ((len = getline(&zLine, &nLine, in)) > 0)
+    {
+        char *zSql = strchr(zLine, '\t');
+        int id = atoi(zLine);
+        if (!zSql || id <= 0 || id > TRACE_MAX_STATEMENTS) continue;
+        if (zLine[len - 1] == '\n') zLine[len - 1] = '\0';
+
+        if (id >= pTab->nStatements)
+        {
+            char **azNew = sqlite3_realloc64(pTab->statements, (sqlite3_uint64)(id + 1) * sizeof(char *));
+            if (!azNew)
+            {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            memset(azNew + pTab->nStatements, 0, (size_t)(id + 1 - pTab->nStatements) * sizeof(char *));
+            pTab->statements = azNew;
+            pTab->nStatements = id + 1;
+        }
+        sqlite3_free(pTab->statements[id]);
+        pTab->statements[id] = sqlite3_mprintf("%s", zSql + 1);
+        if (!pTab->statements[id])
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+    }
+    free(zLine);
+    fclose(in);
+    return rc;
+}
+
+// Maps the index written next to the trace, if any. An index that is not for
+// this format is ignored like a missing one.
+static void mapTraceIndex(TraceVtab *pTab, const char *zTracePath)
+{
+    char *zPath = sqlite3_mprintf("%s" TRACE_INDEX_SUFFIX, zTracePath);
+    int fd = zPath ? open(zPath, O_RDONLY) : -1;
+    sqlite3_free(zPath);
+    if (fd < 0) return;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TraceIndexHeader))
+    {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    size_t size = (size_t)st.st_size;
+    const TraceIndexHeader *header = map;
+    if (memcmp(header->magic, TRACE_INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != TRACE_FORMAT_VERSION || header->entrySize != sizeof(TraceIndexEntry))
+    {
+        munmap(map, size);
+        return;
+    }
+
+    pTab->indexMap = map;
+    pTab->indexMapSize = size;
+    pTab->indexEntries = (const TraceIndexEntry *)((const char *)map + sizeof(TraceIndexHeader));
+    pTab->nIndexEntries = (size - sizeof(TraceIndexHeader)) / sizeof(TraceIndexEntry);
+
+    const TraceIndexTrailer *trailer = (const TraceIndexTrailer *)((const char *)map + size) - 1;
+    if (size >= sizeof(TraceIndexHeader) + sizeof(TraceIndexTrailer)
+        && memcmp(trailer->magic, TRACE_INDEX_TRAILER_MAGIC, sizeof(trailer->magic)) == 0
+        && sizeof(TraceIndexHeader) + trailer->entries * sizeof(TraceIndexEntry) + sizeof(TraceIndexTrailer) == size)
+    {
+        pTab->nIndexEntries = trailer->entries;
+        pTab->indexFinished = 1;
+    }
+}
+
+static void freeTraceVtab(TraceVtab *pTab)
+{
+    if (pTab->map) munmap(pTab->map, pTab->mapSize);
+    if (pTab->indexMap) munmap(pTab->indexMap, pTab->indexMapSize);
+    for (int i = 0; i < pTab->nStatements; i++)
+    {
+        sqlite3_free(pTab->statements[i]);
+    }
+    sqlite3_free(pTab->statements);
+    sqlite3_free(pTab);
+}
+
+static int traceVtabConnect(sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab,
+                            char **pzErr)
+{
+    int rc = sqlite3_declare_vtab(db, TRACE_VTAB_SCHEMA);
+    if (rc != SQLITE_OK) return rc;
+
+    TraceVtab *pTab = sqlite3_malloc(sizeof(TraceVtab));
+    if (!pTab) return SQLITE_NOMEM;
+    memset(pTab, 0, sizeof(TraceVtab));
+
+    // argv[3], if present, is the trace file, optionally quoted.
+    if (argc > 3)
+    {
+        char *zPath = sqlite3_mprintf("%s", argv[3]);
+        if (!zPath)
+        {
+            freeTraceVtab(pTab);
+            return SQLITE_NOMEM;
+        }
+        size_t n = strlen(zPath);
+        if (n >= 2 && (zPath[0] == '\'' || zPath[0] == '"') && zPath[n - 1] == zPath[0])
+        {
+            memmove(zPath, zPath + 1, n - 2);
+            zPath[n - 2] = '\0';
+        }
+        rc = mapTraceFile(pTab, zPath, pzErr);
+        if (rc == SQLITE_OK) rc = loadStatementTable(pTab, zPath);
+        if (rc == SQLITE_OK) mapTraceIndex(pTab, zPath);
+        sqlite3_free(zPath);
+    } else
+    {
+        pTab->ring = sqlite3_trw_ring();
+        if (!pTab->ring) rc = SQLITE_NOMEM;
+    }
+
+    if (rc != SQLITE_OK)
+    {
+        freeTraceVtab(pTab);
+        return rc;
+    }
+    *ppVtab = &pTab->base;
+    return SQLITE_OK;
+}
+
+static int traceVtabDisconnect(sqlite3_vtab *pVtab)
+{
+    freeTraceVtab((TraceVtab *)pVtab);
+    return SQLITE_OK;
+}
+
+static int traceVtabBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    TraceVtab *pTab = (TraceVtab *)pVtab;
+    // Constraint index used for each plan bit, in the argv order xFilter reads them.
+    static const int planBits[] = {TRACE_PLAN_SEQ_EQ, TRACE_PLAN_SEQ_GT, TRACE_PLAN_SEQ_GE,
+                                   TRACE_PLAN_SEQ_LT, TRACE_PLAN_SEQ_LE, TRACE_PLAN_TXN_EQ};
+    int used[6] = {-1, -1, -1, -1, -1, -1};
+
+    for (int i = 0; i < pInfo->nConstraint; i++)
+    {
+        const struct sqlite3_index_constraint *pCons = &pInfo->aConstraint[i];
+        if (!pCons->usable) continue;
+
+        int slot = -1;
+        if (pCons->iColumn == TRACE_COL_SEQ)
+        {
+            switch (pCons->op)
+            {
+            case SQLITE_INDEX_CONSTRAINT_EQ:
+                slot = 0;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_GT:
+                slot = 1;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_GE:
+                slot = 2;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+                slot = 3;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LE:
+                slot = 4;
+                break;
+            default:
+                break;
+            }
+        } else if (pCons->iColumn == TRACE_COL_TXN && pCons->op == SQLITE_INDEX_CONSTRAINT_EQ)
+        {
+            slot = 5;
+        }
+        if (slot >= 0 && used[slot] < 0) used[slot] = i;
+    }
+
+    int idxNum = 0;
+    int argvIndex = 0;
+    for (int slot = 0; slot < 6; slot++)
+    {
+        if (used[slot] < 0) continue;
+        idxNum |= planBits[slot];
+        // Non-integer arguments only narrow the scan conservatively, so SQLite
+        // still checks every row it gets.
+        pInfo->aConstraintUsage[used[slot]].argvIndex = ++argvIndex;
+    }
+    pInfo->idxNum = idxNum;
+
+    double rows = pTab->ring ? (double)traceRingCapacity(pTab->ring) : (double)pTab->count;
+    if (idxNum & TRACE_PLAN_SEQ_EQ) rows = 1;
+    else if (idxNum & ~TRACE_PLAN_TXN_EQ) rows /= 4;
+    // A seq range or a txn only shortens ring scans and scans of indexed files.
+    double cost = pTab->ring || pTab->indexMap ? rows : (double)pTab->count;
+    if (idxNum & TRACE_PLAN_TXN_EQ) rows /= 10;
+    if (pTab->indexMap && (idxNum & TRACE_PLAN_TXN_EQ)) cost = rows;
+    pInfo->estimatedCost = cost;
+    pInfo->estimatedRows = (sqlite3_int64)(rows > 1 ? rows : 1);
+    if ((idxNum & TRACE_PLAN_SEQ_EQ) && pTab->ring) pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+
+    // Ring scans come out in seq order.
+    if (pTab->ring && pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == TRACE_COL_SEQ && !pInfo->aOrderBy[0].desc)
+    {
+        pInfo->orderByConsumed = 1;
+    }
+    return SQLITE_OK;
+}
+
+static int traceVtabOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    TraceVtabCursor *pCur = sqlite3_malloc(sizeof(TraceVtabCursor));
+    if (!pCur) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(TraceVtabCursor));
+    *ppCursor = &pCur->base;
+    return SQLITE_OK;
+}
+
+static int traceVtabClose(sqlite3_vtab_cursor *pCursor)
+{
+    sqlite3_free(((TraceVtabCursor *)pCursor)->spans);
+    sqlite3_free(pCursor);
+    return SQLITE_OK;
+}
+
+static int recordMatches(const TraceVtabCursor *pCur, const TraceRecord *pRecord)
+{
+    return (sqlite3_int64)pRecord->seq >= pCur->seqLo && (sqlite3_int64)pRecord->seq <= pCur->seqHi
+           && (!pCur->hasTxn || pRecord->transactionId == pCur->txn);
+}
+
+// Moves to the first matching record at or after `pos`, going on with the next span at the end of one.
+static void seekMatch(TraceVtabCursor *pCur)
+{
+    TraceVtab *pTab = (TraceVtab *)pCur->base.pVtab;
+    for (;;)
+    {
+        for (; pCur->pos < pCur->end; pCur->pos++)
+        {
+            const TraceRecord *pRecord = recordAt(pTab, pCur->pos);
+            if (pRecord && recordMatches(pCur, pRecord))
+            {
+                pCur->pRecord = pRecord;
+                return;
+            }
+        }
+        if (pCur->iSpan >= pCur->nSpans) break;
+        pCur->pos = pCur->spans[pCur->iSpan].first;
+        pCur->end = pCur->spans[pCur->iSpan].end;
+        pCur->iSpan++;
+    }
+    pCur->pRecord = NULL;
+}
+
+// Appends [first, last] to the cursor's spans, merged with the previous span
+// when they overlap or touch. Returns SQLITE_NOMEM if out of memory.
+static int addSpan(TraceVtabCursor *pCur, uint64_t first, uint64_t last, int *pnAlloc)
+{
+    TraceSpan *prev = pCur->nSpans > 0 ? &pCur->spans[pCur->nSpans - 1] : NULL;
+    if (prev && first >= prev->first && first <= prev->end)
+    {
+        if (last + 1 > prev->end) prev->end = last + 1;
+        return SQLITE_OK;
+    }
+    if (pCur->nSpans == *pnAlloc)
+    {
+        int nAlloc = *pnAlloc ? 2 * *pnAlloc : 16;
+        TraceSpan *spans = sqlite3_realloc64(pCur->spans, (sqlite3_uint64)nAlloc * sizeof(TraceSpan));
+        if (!spans) return SQLITE_NOMEM;
+        pCur->spans = spans;
+        *pnAlloc = nAlloc;
+    }
+    pCur->spans[pCur->nSpans].first = first;
+    pCur->spans[pCur->nSpans].end = last + 1;
+    pCur->nSpans++;
+    return SQLITE_OK;
+}
+
+// Plans the records of an indexed file to visit: the spans of the transactions
+// with the txn, or else the blocks that overlap the seq range. Records past the
+// last block of an unfinished index are always visited.
+static int planIndexedScan(TraceVtabCursor *pCur, TraceVtab *pTab)
+{
+    int nAlloc = 0;
+    int rc = SQLITE_OK;
+    int byTxn = pCur->hasTxn && pTab->indexFinished;
+    uint64_t covered = 0;
+
+    for (uint64_t i = 0; i < pTab->nIndexEntries && rc == SQLITE_OK; i++)
+    {
+        const TraceIndexEntry *entry = &pTab->indexEntries[i];
+        if (entry->kind == TRACE_INDEX_BLOCK && entry->lastRecord + 1 > covered) covered = entry->lastRecord + 1;
+        if (byTxn)
+        {
+            if (entry->kind != TRACE_INDEX_TRANSACTION || entry->transactionId != pCur->txn) continue;
+        } else if (entry->kind != TRACE_INDEX_BLOCK || (sqlite3_int64)entry->maxSeq < pCur->seqLo
+                   || (sqlite3_int64)entry->minSeq > pCur->seqHi)
+        {
+            continue;
+        }
+        rc = addSpan(pCur, entry->firstRecord, entry->lastRecord, &nAlloc);
+    }
+    if (rc == SQLITE_OK && !byTxn && !pTab->indexFinished && covered < pTab->count)
+    {
+        rc = addSpan(pCur, covered, pTab->count - 1, &nAlloc);
+    }
+
+    // The trace may have been cut short after its index was written.
+    for (int i = 0; i < pCur->nSpans; i++)
+    {
+        if (pCur->spans[i].end > pTab->count) pCur->spans[i].end = pTab->count;
+    }
+    return rc;
+}
+
+// Applies one seq constraint. `strict` excludes the bound itself; `lower` and
+// `upper` say which ends it limits. Reals round outwards and other types leave
+// the range alone, since SQLite re-checks every row.
+static void applySeqBound(TraceVtabCursor *pCur, sqlite3_value *pVal, int lower, int upper, int strict)
+{
+    sqlite3_int64 lo, hi;
+    switch (sqlite3_value_type(pVal))
+    {
+    case SQLITE_INTEGER:
+        lo = hi = sqlite3_value_int64(pVal);
+        if (strict && lo < INT64_MAX) lo++;
+        if (strict && hi > INT64_MIN) hi--;
+        break;
+    case SQLITE_FLOAT:
+    {
+        double v = sqlite3_value_double(pVal);
+        if (v != v) return;
+        if (v <= (double)INT64_MIN || v >= (double)INT64_MAX) return;
+        sqlite3_int64 t = (sqlite3_int64)v;
+        // floor(v) and ceil(v).
+        lo = (double)t > v ? t - 1 : t;
+        hi = (double)t < v ? t + 1 : t;
+        break;
+    }
+    default:
+        return;
+    }
+
+    if (lower && lo > pCur->seqLo) pCur->seqLo = lo;
+    if (upper && hi < pCur->seqHi) pCur->seqHi = hi;
+}
+
+static int traceVtabFilter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc,
+                           sqlite3_value **argv)
+{
+    TraceVtabCursor *pCur = (TraceVtabCursor *)pCursor;
+    TraceVtab *pTab = (TraceVtab *)pCursor->pVtab;
+    int iArg = 0;
+
+    pCur->seqLo = 0;
+    pCur->seqHi = INT64_MAX;
+    pCur->hasTxn = 0;
+    pCur->nSpans = pCur->iSpan = 0;
+    if (idxNum & TRACE_PLAN_SEQ_EQ) applySeqBound(pCur, argv[iArg++], 1, 1, 0);
+    if (idxNum & TRACE_PLAN_SEQ_GT) applySeqBound(pCur, argv[iArg++], 1, 0, 1);
+    if (idxNum & TRACE_PLAN_SEQ_GE) applySeqBound(pCur, argv[iArg++], 1, 0, 0);
+    if (idxNum & TRACE_PLAN_SEQ_LT) applySeqBound(pCur, argv[iArg++], 0, 1, 1);
+    if (idxNum & TRACE_PLAN_SEQ_LE) applySeqBound(pCur, argv[iArg++], 0, 1, 0);
+    if (idxNum & TRACE_PLAN_TXN_EQ)
+    {
+        sqlite3_value *pVal = argv[iArg++];
+        pCur->hasTxn = sqlite3_value_type(pVal) == SQLITE_INTEGER;
+        pCur->txn = (int32_t)sqlite3_value_int64(pVal);
+    }
+
+    if (pCur->seqLo > pCur->seqHi)
+    {
+        pCur->pos = pCur->end = 0;
+    } else if (pTab->ring)
+    {
+        // Only the last `capacity` seqs can still be in the ring.
+        uint64_t end = traceRingEnd(pTab->ring);
+        uint64_t capacity = traceRingCapacity(pTab->ring);
+        uint64_t oldest = end > capacity ? end - capacity : 0;
+        uint64_t lo = (uint64_t)pCur->seqLo;
+        uint64_t hi = (uint64_t)pCur->seqHi;
+        pCur->pos = lo > oldest ? lo : oldest;
+        pCur->end = hi < end ? hi + 1 : end;
+    } else if (pTab->indexMap && idxNum != 0)
+    {
+        pCur->pos = pCur->end = 0;
+        int rc = planIndexedScan(pCur, pTab);
+        if (rc != SQLITE_OK) return rc;
+    } else
+    {
+        pCur->pos = 0;
+        pCur->end = pTab->count;
+    }
+    seekMatch(pCur);
+    return SQLITE_OK;
+}
+
+static int traceVtabNext(sqlite3_vtab_cursor *pCursor)
+{
+    TraceVtabCursor *pCur = (TraceVtabCursor *)pCursor;
+    pCur->pos++;
+    seekMatch(pCur);
+    return SQLITE_OK;
+}
+
+static int traceVtabEof(sqlite3_vtab_cursor *pCursor)
+{
+    return ((TraceVtabCursor *)pCursor)->pRecord == NULL;
+}
+
+static int traceVtabColumn(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    TraceVtabCursor *pCur = (TraceVtabCursor *)pCursor;
+    TraceVtab *pTab = (TraceVtab *)pCursor->pVtab;
+
+    // A ring slot may have been reused since xNext: report NULLs rather than another record.
+    const TraceRecord *pRecord = pTab->ring ? traceRingGet(pTab->ring, pCur->pos) : pCur->pRecord;
+    if (!pRecord) return SQLITE_OK;
+
+    switch (i)
+    {
+    case TRACE_COL_SEQ:
+        sqlite3_result_int64(ctx, (sqlite3_int64)pRecord->seq);
+        break;
+    case TRACE_COL_TS:
+        sqlite3_result_int64(ctx, (sqlite3_int64)pRecord->ts);
+        break;
+    case TRACE_COL_TXN:
+        sqlite3_result_int(ctx, pRecord->transactionId);
+        break;
+    case TRACE_COL_THREAD:
+        sqlite3_result_int(ctx, pRecord->threadId);
+        break;
+    case TRACE_COL_OP:
+        sqlite3_result_text(ctx, opTypeName((OpType)pRecord->type), -1, SQLITE_STATIC);
+        break;
+    case TRACE_COL_TABLE:
+        sqlite3_result_int64(ctx, pRecord->table);
+        break;
+    case TRACE_COL_ROWID:
+        // BEGIN/COMMIT/ABORT carry no object.
+        if (pRecord->type != BEGIN && pRecord->type != COMMIT && pRecord->type != ABORT)
+        {
+            sqlite3_result_int64(ctx, pRecord->objectId);
+        }
+        break;
+    case TRACE_COL_VALUE_HASH:
+        if (pRecord->valueHash) sqlite3_result_int64(ctx, (sqlite3_int64)pRecord->valueHash);
+        break;
+    case TRACE_COL_STMT:
+        if (pRecord->statementId != TRACE_STATEMENT_NONE) sqlite3_result_int(ctx, pRecord->statementId);
+        break;
+    case TRACE_COL_SQL:
+    {
+        const char *zSql;
+        if (pTab->ring) zSql = traceStatementSql(pRecord->statementId);
+        else zSql = pRecord->statementId < pTab->nStatements ? pTab->statements[pRecord->statementId] : NULL;
+        if (zSql) sqlite3_result_text(ctx, zSql, -1, SQLITE_STATIC);
+        break;
+    }
+    default:
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int traceVtabRowid(sqlite3_vtab_cursor *pCursor, sqlite3_int64 *pRowid)
+{
+    *pRowid = (sqlite3_int64)((TraceVtabCursor *)pCursor)->pos;
+    return SQLITE_OK;
+}
+
+static sqlite3_module traceVtabModule = {
+    0,
+    traceVtabConnect,
+    traceVtabConnect,
+    traceVtabBestIndex,
+    traceVtabDisconnect,
+    traceVtabDisconnect,
+    traceVtabOpen,
+    traceVtabClose,
+    traceVtabFilter,
+    traceVtabNext,
+    traceVtabEof,
+    traceVtabColumn,
+    traceVtabRowid,
+};
+
+int sqlite3_trw_vtab_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
+{
+    return sqlite3_create_module(db, TRACE_VTAB_NAME, &traceVtabModule, NULL);
+}
@@ -108,6 +108,17 @@ typedef struct VdbeOp {
 #endif
 } VdbeOp;
 
+// P4 type of an OpenRead/OpenWrite on an index b-tree (mirrors vdbe.h).
+#define P4_KEYINFO (-8)
+
+// P2 flag of a Delete that only feeds the pre-update hook and removes nothing (mirrors sqliteInt.h).
+#define OPFLAG_ISNOOP 0x40
+
+// P1 of a Savepoint opcode (mirrors sqliteInt.h).
+#define SAVEPOINT_BEGIN 0
+#define SAVEPOINT_RELEASE 1
+#define SAVEPOINT_ROLLBACK 2
+
 const char *sqlite3OpcodeName(int);
 
 #endif /* SQLITE3_EXT_H */
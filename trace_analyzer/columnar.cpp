@@ -0,0 +1,339 @@
+#include "columnar.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace {
+constexpr uint64_t SIGN_BIT = 1ull << 63;
+// Dictionaries larger than this do not pay off against frame of reference.
+constexpr size_t MAX_DICTIONARY = 256;
+constexpr size_t OUTPUT_BUFFER_SIZE = 4 << 20;
+
+bool is_signed(Column column) {
+    return column == Column::Txn || column == Column::Row;
+}
+
+unsigned bit_width(uint64_t value) {
+    return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+size_t packed_words(size_t count, unsigned width) {
+    return (count * width + 63) / 64;
+}
+
+// Appends `values` - `base` in `width` bits each, least significant bits first.
+void pack(const uint64_t* values, size_t count, uint64_t base, unsigned width, std::vector<uint64_t>& words) {
+    const size_t start = words.size();
+    words.resize(start + packed_words(count, width), 0);
+    if (width == 0) return;
+    uint64_t* out = words.data() + start;
+    size_t bit = 0;
+    for (size_t i = 0; i < count; ++i, bit += width) {
+        const uint64_t value = values[i] - base;
+        const unsigned shift = bit % 64;
+        out[bit / 64] |= value << shift;
+        if (shift + width > 64) out[bit / 64 + 1] |= value >> (64 - shift);
+    }
+}
+
+void unpack(const uint64_t* words, size_t count, unsigned width, uint64_t base, uint64_t* out) {
+    if (width == 0) {
+        std::fill(out, out + count, base);
+        return;
+    }
+    const uint64_t mask = width == 64 ? ~0ull : (1ull << width) - 1;
+    size_t bit = 0;
+    for (size_t i = 0; i < count; ++i, bit += width) {
+        const unsigned shift = bit % 64;
+        uint64_t value = words[bit / 64] >> shift;
+        if (shift + width > 64) value |= words[bit / 64 + 1] << (64 - shift);
+        out[i] = base + (value & mask);
+    }
+}
+
+// Encodes `keys` with whichever encoding is smallest.
+ChunkHeader encode(Column column, const std::vector<uint64_t>& keys, std::vector<uint64_t>& words) {
+    ChunkHeader header{};
+    header.column = static_cast<uint8_t>(column);
+    header.count = static_cast<uint32_t>(keys.size());
+    words.clear();
+    if (keys.empty()) return header;
+
+    const auto [min, max] = std::minmax_element(keys.begin(), keys.end());
+    header.min = *min;
+    header.max = *max;
+    const unsigned width = bit_width(header.max - header.min);
+    const size_t n = keys.size();
+
+    size_t runs = 1;
+    uint64_t longest = 1;
+    uint64_t length = 1;
+    for (size_t i = 1; i < n; ++i) {
+        if (keys[i] == keys[i - 1]) {
+            longest = std::max(longest, ++length);
+        } else {
+            ++runs;
+            length = 1;
+        }
+    }
+    const unsigned length_width = bit_width(longest);
+
+    // Low-cardinality columns spread over a wide range (table roots, statement ids, hot rows).
+    std::vector<uint64_t> dictionary;
+    if (width > 8) {
+        std::unordered_set<uint64_t> distinct;
+        for (size_t i = 0; i < n && distinct.size() <= MAX_DICTIONARY; ++i) {
+            distinct.insert(keys[i]);
+        }
+        if (distinct.size() <= MAX_DICTIONARY) {
+            dictionary.assign(distinct.begin(), distinct.end());
+            std::sort(dictionary.begin(), dictionary.end());
+        }
+    }
+    const unsigned index_width = dictionary.empty() ? 0 : bit_width(dictionary.size() - 1);
+
+    const size_t plain_size = n;
+    const size_t packed_size = packed_words(n, width);
+    const size_t rle_size = 1 + packed_words(runs, width) + packed_words(runs, length_width);
+    const size_t dictionary_size =
+        dictionary.empty() ? plain_size + 1 : 1 + dictionary.size() + packed_words(n, index_width);
+    const size_t best = std::min({plain_size, packed_size, rle_size, dictionary_size});
+
+    if (best == packed_size) {
+        header.encoding = static_cast<uint8_t>(Encoding::BitPacked);
+        header.width = static_cast<uint8_t>(width);
+        pack(keys.data(), n, header.min, width, words);
+    } else if (best == rle_size) {
+        header.encoding = static_cast<uint8_t>(Encoding::Rle);
+        header.width = static_cast<uint8_t>(width);
+        std::vector<uint64_t> values;
+        std::vector<uint64_t> lengths;
+        values.reserve(runs);
+        lengths.reserve(runs);
+        for (size_t i = 0; i < n;) {
+            size_t j = i + 1;
+            while (j < n && keys[j] == keys[i]) ++j;
+            values.push_back(keys[i]);
+            lengths.push_back(j - i);
+            i = j;
+        }
+        words.push_back(static_cast<uint64_t>(runs) | static_cast<uint64_t>(length_width) << 32);
+        pack(values.data(), runs, header.min, width, words);
+        pack(lengths.data(), runs, 0, length_width, words);
+    } else if (best == dictionary_size) {
+        header.encoding = static_cast<uint8_t>(Encoding::Dictionary);
+        header.width = static_cast<uint8_t>(index_width);
+        words.push_back(dictionary.size());
+        words.insert(words.end(), dictionary.begin(), dictionary.end());
+        std::vector<uint64_t> indexes(n);
+        for (size_t i = 0; i < n; ++i) {
+            indexes[i] = std::lower_bound(dictionary.begin(), dictionary.end(), keys[i]) - dictionary.begin();
+        }
+        pack(indexes.data(), n, 0, index_width, words);
+    } else {
+        header.encoding = static_cast<uint8_t>(Encoding::Plain);
+        header.width = 64;
+        words.assign(keys.begin(), keys.end());
+    }
+    header.size = words.size() * sizeof(uint64_t);
+    return header;
+}
+} // namespace
+
+uint64_t column_key(Column column, int64_t value) {
+    return is_signed(column) ? static_cast<uint64_t>(value) ^ SIGN_BIT : static_cast<uint64_t>(value);
+}
+
+int64_t column_value(Column column, uint64_t key) {
+    return static_cast<int64_t>(is_signed(column) ? key ^ SIGN_BIT : key);
+}
+
+void record_keys(const TraceRecord& record, uint64_t keys[COLUMN_COUNT]) {
+    keys[static_cast<size_t>(Column::Seq)] = record.seq;
+    keys[static_cast<size_t>(Column::Ts)] = record.ts;
+    keys[static_cast<size_t>(Column::Op)] = record.type;
+    keys[static_cast<size_t>(Column::Flags)] = record.flags;
+    keys[static_cast<size_t>(Column::Txn)] = column_key(Column::Txn, record.transactionId);
+    keys[static_cast<size_t>(Column::Table)] = record.table;
+    keys[static_cast<size_t>(Column::Row)] = column_key(Column::Row, record.objectId);
+    keys[static_cast<size_t>(Column::ValueHash)] = record.valueHash;
+    keys[static_cast<size_t>(Column::Stmt)] = record.statementId;
+}
+
+ColumnarWriter::ColumnarWriter(const std::string& path) : out_(std::fopen(path.c_str(), "wb")) {
+    if (!out_) throw std::runtime_error("can't create " + path);
+    std::setvbuf(out_, nullptr, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    ColumnarHeader header{};
+    std::memcpy(header.magic, COLUMNAR_MAGIC, sizeof(header.magic));
+    header.version = COLUMNAR_VERSION;
+    header.trace_version = TRACE_FORMAT_VERSION;
+    header.columns = COLUMN_COUNT;
+    write(&header, sizeof(header));
+    for (auto& column : columns_) {
+        column.reserve(COLUMNAR_GROUP_SIZE);
+    }
+}
+
+ColumnarWriter::~ColumnarWriter() {
+    if (out_) std::fclose(out_);
+}
+
+void ColumnarWriter::write(const void* data, size_t size) {
+    offset_ += std::fwrite(data, 1, size, out_);
+}
+
+void ColumnarWriter::add(const TraceRecord& record) {
+    uint64_t keys[COLUMN_COUNT];
+    record_keys(record, keys);
+    for (size_t i = 0; i < COLUMN_COUNT; ++i) {
+        columns_[i].push_back(keys[i]);
+    }
+    if (columns_[0].size() == COLUMNAR_GROUP_SIZE) flush_group();
+}
+
+void ColumnarWriter::flush_group() {
+    if (columns_[0].empty()) return;
+
+    groups_.push_back({offset_, columns_[0].size()});
+    std::vector<uint64_t> words;
+    for (size_t i = 0; i < COLUMN_COUNT; ++i) {
+        const ChunkHeader header = encode(static_cast<Column>(i), columns_[i], words);
+        write(&header, sizeof(header));
+        write(words.data(), words.size() * sizeof(uint64_t));
+        columns_[i].clear();
+    }
+}
+
+void ColumnarWriter::finish() {
+    if (finished_) return;
+    finished_ = true;
+
+    flush_group();
+    write(groups_.data(), groups_.size() * sizeof(ColumnarGroup));
+    ColumnarTrailer trailer{};
+    std::memcpy(trailer.magic, COLUMNAR_TRAILER_MAGIC, sizeof(trailer.magic));
+    trailer.groups = groups_.size();
+    write(&trailer, sizeof(trailer));
+
+    const bool failed = std::ferror(out_) != 0;
+    const int closed = std::fclose(out_);
+    out_ = nullptr;
+    if (failed || closed != 0) throw std::runtime_error("can't write columnar trace");
+}
+
+ColumnarFile::ColumnarFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("can't open " + path);
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("can't stat " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ < sizeof(ColumnarHeader) + sizeof(ColumnarTrailer)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a columnar trace");
+    }
+    void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) throw std::runtime_error("can't map " + path);
+    data_ = static_cast<const uint8_t*>(map);
+
+    const auto* header = reinterpret_cast<const ColumnarHeader*>(data_);
+    const auto* trailer = reinterpret_cast<const ColumnarTrailer*>(data_ + size_) - 1;
+    const bool valid = std::memcmp(header->magic, COLUMNAR_MAGIC, sizeof(header->magic)) == 0
+                       && header->version == COLUMNAR_VERSION && header->columns == COLUMN_COUNT
+                       && std::memcmp(trailer->magic, COLUMNAR_TRAILER_MAGIC, sizeof(trailer->magic)) == 0
+                       && trailer->groups <= (size_ - sizeof(ColumnarHeader) - sizeof(ColumnarTrailer))
+                                                 / sizeof(ColumnarGroup);
+    if (!valid) {
+        munmap(map, size_);
+        throw std::runtime_error(path + " is not a complete version " + std::to_string(COLUMNAR_VERSION)
+                                 + " columnar trace");
+    }
+    group_count_ = trailer->groups;
+    groups_ = reinterpret_cast<const ColumnarGroup*>(trailer) - group_count_;
+
+    // Locate every chunk up front; payload sizes are checked against the directory's start.
+    const uint64_t end = reinterpret_cast<const uint8_t*>(groups_) - data_;
+    chunks_.reserve(group_count_ * COLUMN_COUNT);
+    for (size_t group = 0; group < group_count_; ++group) {
+        uint64_t offset = groups_[group].offset;
+        for (size_t column = 0; column < COLUMN_COUNT; ++column) {
+            const auto* chunk = reinterpret_cast<const ChunkHeader*>(data_ + offset);
+            if (offset + sizeof(ChunkHeader) > end || chunk->column != column || chunk->count != groups_[group].count
+                || chunk->size > end - offset - sizeof(ChunkHeader)) {
+                munmap(map, size_);
+                throw std::runtime_error(path + " has a damaged row group");
+            }
+            chunks_.push_back(offset);
+            offset += sizeof(ChunkHeader) + chunk->size;
+        }
+    }
+}
+
+ColumnarFile::~ColumnarFile() {
+    if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+uint64_t ColumnarFile::records() const {
+    uint64_t count = 0;
+    for (size_t group = 0; group < group_count_; ++group) {
+        count += groups_[group].count;
+    }
+    return count;
+}
+
+const ChunkHeader& ColumnarFile::chunk(size_t group, Column column) const {
+    return *reinterpret_cast<const ChunkHeader*>(data_ + chunks_[group * COLUMN_COUNT + static_cast<size_t>(column)]);
+}
+
+void ColumnarFile::decode(size_t group, Column column, std::vector<uint64_t>& out) const {
+    const ChunkHeader& header = chunk(group, column);
+    const auto* words = reinterpret_cast<const uint64_t*>(&header + 1);
+    const size_t n = header.count;
+    out.resize(n);
+
+    switch (static_cast<Encoding>(header.encoding)) {
+        case Encoding::Plain:
+            std::memcpy(out.data(), words, n * sizeof(uint64_t));
+            break;
+        case Encoding::BitPacked:
+            unpack(words, n, header.width, header.min, out.data());
+            break;
+        case Encoding::Rle: {
+            const size_t runs = words[0] & 0xffffffffu;
+            const unsigned length_width = static_cast<unsigned>(words[0] >> 32);
+            std::vector<uint64_t> values(runs);
+            std::vector<uint64_t> lengths(runs);
+            unpack(words + 1, runs, header.width, header.min, values.data());
+            unpack(words + 1 + packed_words(runs, header.width), runs, length_width, 0, lengths.data());
+            size_t i = 0;
+            for (size_t run = 0; run < runs && i < n; ++run) {
+                const size_t end = std::min(n, i + lengths[run]);
+                std::fill(out.begin() + i, out.begin() + end, values[run]);
+                i = end;
+            }
+            break;
+        }
+        case Encoding::Dictionary: {
+            const size_t entries = words[0];
+            const uint64_t* dictionary = words + 1;
+            unpack(dictionary + entries, n, header.width, 0, out.data());
+            for (auto& key : out) {
+                key = key < entries ? dictionary[key] : 0;
+            }
+            break;
+        }
+        default:
+            throw std::runtime_error("unknown chunk encoding " + std::to_string(header.encoding));
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mvtracer.h>
+#include <string>
+#include <vector>
+
+// Columnar trace store (.trwc) for analytics over large traces.
+//
+// Records are cut into row groups of up to COLUMNAR_GROUP_SIZE. A row group holds one chunk per column, each
+// with its own encoding and the min/max of its values, so that a query decodes only the columns it reads and
+// skips groups whose statistics rule them out. The file ends with a directory of the row groups:
+//
+//   ColumnarHeader
+//   row group: ChunkHeader payload (x COLUMN_COUNT), payloads padded to 8 bytes
+//   ...
+//   ColumnarGroup (x groups) ColumnarTrailer
+//
+// Every value is stored as an unsigned key that sorts like the value itself (signed columns have their sign
+// bit flipped), so that min/max, frame of reference and dictionaries work the same for every column.
+
+enum class Column : uint8_t { Seq, Ts, Op, Flags, Txn, Table, Row, ValueHash, Stmt, Count };
+
+constexpr size_t COLUMN_COUNT = static_cast<size_t>(Column::Count);
+
+enum class Encoding : uint8_t {
+    // 8 bytes per value.
+    Plain,
+    // Frame of reference: value - min in `width` bits.
+    BitPacked,
+    // Runs of equal values: run values as BitPacked, then run lengths in their own width.
+    Rle,
+    // Sorted distinct values, then each value's position among them in `width` bits.
+    Dictionary,
+};
+
+constexpr char COLUMNAR_MAGIC[4] = {'T', 'R', 'W', 'C'};
+constexpr char COLUMNAR_TRAILER_MAGIC[4] = {'T', 'R', 'W', 'E'};
+constexpr uint16_t COLUMNAR_VERSION = 1;
+constexpr size_t COLUMNAR_GROUP_SIZE = 1 << 16;
+
+struct ColumnarHeader {
+    char magic[4];
+    uint16_t version;
+    // TRACE_FORMAT_VERSION of the records the file was built from.
+    uint16_t trace_version;
+    uint32_t columns;
+    uint32_t reserved;
+};
+
+struct ChunkHeader {
+    uint8_t column;
+    uint8_t encoding;
+    uint8_t width;
+    uint8_t reserved;
+    uint32_t count;
+    // Smallest and largest key in the chunk.
+    uint64_t min;
+    uint64_t max;
+    // Payload bytes following the header, padding included.
+    uint64_t size;
+};
+
+struct ColumnarGroup {
+    // File offset of the group's first ChunkHeader.
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct ColumnarTrailer {
+    char magic[4];
+    uint32_t reserved;
+    uint64_t groups;
+};
+
+// Key of `value` in `column` and back.
+uint64_t column_key(Column column, int64_t value);
+int64_t column_value(Column column, uint64_t key);
+
+// The keys of `record`'s columns, in Column order.
+void record_keys(const TraceRecord& record, uint64_t keys[COLUMN_COUNT]);
+
+// Builds a .trwc file from records added in any order. Not thread-safe.
+class ColumnarWriter {
+public:
+    // Throws std::runtime_error if `path` cannot be created.
+    explicit ColumnarWriter(const std::string& path);
+    ~ColumnarWriter();
+
+    ColumnarWriter(const ColumnarWriter&) = delete;
+    ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+    void add(const TraceRecord& record);
+
+    // Writes the last group and the directory. Throws std::runtime_error on a write error.
+    void finish();
+
+    // Bytes written so far.
+    uint64_t size() const { return offset_; }
+
+private:
+    void flush_group();
+    void write(const void* data, size_t size);
+
+    FILE* out_;
+    uint64_t offset_ = 0;
+    std::vector<uint64_t> columns_[COLUMN_COUNT];
+    std::vector<ColumnarGroup> groups_;
+    bool finished_ = false;
+};
+
+// Read-only, memory-mapped view of a .trwc file.
+class ColumnarFile {
+public:
+    // Throws std::runtime_error if the file cannot be mapped or is not a complete .trwc file.
+    explicit ColumnarFile(const std::string& path);
+    ~ColumnarFile();
+
+    ColumnarFile(const ColumnarFile&) = delete;
+    ColumnarFile& operator=(const ColumnarFile&) = delete;
+
+    size_t groups() const { return group_count_; }
+    uint64_t records() const;
+    uint64_t group_size(size_t group) const { return groups_[group].count; }
+
+    // Header of `column`'s chunk in `group`: its encoding and statistics, without decoding it.
+    const ChunkHeader& chunk(size_t group, Column column) const;
+
+    // Decodes `column` of `group` into keys, replacing the contents of `out`.
+    void decode(size_t group, Column column, std::vector<uint64_t>& out) const;
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    const ColumnarGroup* groups_ = nullptr;
+    size_t group_count_ = 0;
+    // Per group, the offset of each column's chunk header.
+    std::vector<uint64_t> chunks_;
+};
+
+#endif // COLUMNAR_H
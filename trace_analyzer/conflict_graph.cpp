@@ -0,0 +1,450 @@
+#include "conflict_graph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+// Whether `a` and `b` share a key, counting the comparison in `stats`.
+bool conflict(const ObjectSet& a, const ObjectBloom& a_bloom, const ObjectSet& b, const ObjectBloom& b_bloom,
+              ConflictStats& stats) {
+    if (a.empty() || b.empty() || a.max() < b.min() || b.max() < a.min() || !a_bloom.may_intersect(b_bloom)) {
+        ++stats.screened;
+        return false;
+    }
+    ++stats.intersected;
+    return a.intersects(b);
+}
+
+void add_edge(std::vector<ConflictEdge>& edges, ConflictStats& stats, uint32_t from, uint32_t to, ConflictType type) {
+    edges.push_back({from, to, type});
+    ++stats.edges[static_cast<size_t>(type)];
+}
+
+// Runs `f(worker, begin, end)` over [0, n) in chunks of `grain`, each chunk on the next free of `threads`
+// workers.
+template <typename F> void parallel_for(size_t threads, size_t n, size_t grain, F f) {
+    const size_t workers = std::max<size_t>(1, std::min(threads, (n + grain - 1) / grain));
+    std::atomic<size_t> next{0};
+    const auto work = [&](size_t worker) {
+        for (size_t begin = next.fetch_add(grain); begin < n; begin = next.fetch_add(grain)) {
+            f(worker, begin, std::min(n, begin + grain));
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w) pool.emplace_back(work, w);
+    work(0);
+    for (auto& thread : pool) thread.join();
+}
+
+// One read or write of an object by the transaction of index `txn`.
+struct Access {
+    uint64_t object;
+    uint32_t txn;
+    bool write;
+};
+
+// Edge packed as target << 2 | type, which sorts the edges of a source by target.
+uint64_t pack_edge(uint32_t to, ConflictType type) {
+    return static_cast<uint64_t>(to) << 2 | static_cast<uint64_t>(type);
+}
+
+// Appends the edges of one object to `edges` as (from, packed edge), from its accesses ordered by transaction.
+void object_edges(const std::vector<TxnSets>& txns, const Access* first, const Access* last,
+                  std::vector<uint32_t>& writers, std::vector<std::pair<uint32_t, uint64_t>>& edges) {
+    writers.clear();
+    for (const Access* access = first; access != last; ++access) {
+        if (access->write) writers.push_back(access->txn);
+    }
+    // The version chain.
+    std::sort(writers.begin(), writers.end(), [&](uint32_t a, uint32_t b) { return txns[a].commit < txns[b].commit; });
+    for (size_t i = 1; i < writers.size(); ++i) {
+        edges.emplace_back(writers[i - 1], pack_edge(writers[i], ConflictType::WW));
+    }
+    for (const Access* access = first; access != last; ++access) {
+        if (access->write) continue;
+        const uint32_t reader = access->txn;
+        // The first version committed after the reader began, the one it did not see.
+        const auto next = std::upper_bound(writers.begin(), writers.end(), txns[reader].begin,
+                                           [&](uint64_t begin, uint32_t w) { return begin < txns[w].commit; });
+        if (next != writers.begin()) edges.emplace_back(next[-1], pack_edge(reader, ConflictType::WR));
+        // A reader that wrote the object itself precedes the later versions through its own.
+        if (next != writers.end() && *next != reader) edges.emplace_back(reader, pack_edge(*next, ConflictType::RW));
+    }
+}
+
+// Vertices of one part of the graph being split into components, all labeled `part`.
+struct SccTask {
+    uint32_t part;
+    std::vector<uint32_t> vertices;
+};
+
+constexpr uint32_t SCC_DONE = UINT32_MAX;
+} // namespace
+
+void TxnSetCollector::add(const TraceRecord& record) {
+    const TxnInstance txn = instances_.current(record.transactionId);
+    const uint64_t key = txn_key(txn);
+
+    switch (record.type) {
+    case BEGIN:
+        pending_[txn_key(instances_.begin(record.transactionId))].begin = record.seq;
+        break;
+    case COMMIT: {
+        const auto it = pending_.find(key);
+        if (it == pending_.end()) break;
+        TxnSets sets{txn, it->second.begin, record.seq, {}, {}, {}, {}};
+        for (const uint64_t object : it->second.reads) sets.read_bloom.add(object);
+        for (const uint64_t object : it->second.writes) sets.write_bloom.add(object);
+        sets.reads = ObjectSet(std::move(it->second.reads));
+        sets.writes = ObjectSet(std::move(it->second.writes));
+        committed_.push_back(std::move(sets));
+        pending_.erase(it);
+        break;
+    }
+    case ABORT:
+        pending_.erase(key);
+        break;
+    case SAVEPOINT:
+    case RELEASE:
+    case ROLLBACK_TO: {
+        auto& pending = pending_[key];
+        pending.writes.resize(pending.savepoints.apply(record, pending.writes.size()));
+        break;
+    }
+    case READ:
+        pending_[key].reads.push_back(object_key(record.table, record.objectId));
+        break;
+    case WRITE:
+        pending_[key].writes.push_back(object_key(record.table, record.objectId));
+        break;
+    default:
+        break;
+    }
+}
+
+std::vector<TxnSets> TxnSetCollector::finish() {
+    std::vector<TxnSets> txns = std::move(committed_);
+    committed_.clear();
+    pending_.clear();
+    std::stable_sort(txns.begin(), txns.end(), [](const TxnSets& a, const TxnSets& b) { return a.begin < b.begin; });
+    return txns;
+}
+
+std::vector<ConflictEdge> build_conflicts(const std::vector<TxnSets>& txns, ConflictStats& stats) {
+    std::vector<ConflictEdge> edges;
+    // Transactions begun so far that may still overlap the next one, i.e. have not committed before it began.
+    std::vector<uint32_t> active;
+    for (uint32_t b = 0; b < txns.size(); ++b) {
+        const TxnSets& later = txns[b];
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [&](uint32_t a) { return txns[a].commit < later.begin; }),
+                     active.end());
+
+        for (const uint32_t a : active) {
+            const TxnSets& earlier = txns[a];
+            ++stats.pairs;
+            if (conflict(earlier.writes, earlier.write_bloom, later.writes, later.write_bloom, stats)) {
+                if (earlier.commit < later.commit) add_edge(edges, stats, a, b, ConflictType::WW);
+                else add_edge(edges, stats, b, a, ConflictType::WW);
+            }
+            if (conflict(earlier.reads, earlier.read_bloom, later.writes, later.write_bloom, stats)) {
+                add_edge(edges, stats, a, b, ConflictType::RW);
+            }
+            if (conflict(later.reads, later.read_bloom, earlier.writes, earlier.write_bloom, stats)) {
+                add_edge(edges, stats, b, a, ConflictType::RW);
+            }
+        }
+        active.push_back(b);
+    }
+    return edges;
+}
+
+ConflictGraph build_conflict_graph(const std::vector<TxnSets>& txns, size_t threads, ConflictGraphStats& stats) {
+    const size_t n = txns.size();
+    // Several shards per thread even out hot objects.
+    const size_t shards = threads * 8;
+    const auto shard_of = [&](uint64_t object) { return ((object * 0x9e3779b97f4a7c15ull) >> 32) % shards; };
+
+    // Every access, bucketed by shard in each worker.
+    std::vector<std::vector<std::vector<Access>>> buckets(threads, std::vector<std::vector<Access>>(shards));
+    parallel_for(threads, n, 256, [&](size_t worker, size_t begin, size_t end) {
+        auto& mine = buckets[worker];
+        for (size_t t = begin; t < end; ++t) {
+            const uint32_t txn = static_cast<uint32_t>(t);
+            txns[t].reads.for_each([&](uint64_t object) { mine[shard_of(object)].push_back({object, txn, false}); });
+            txns[t].writes.for_each([&](uint64_t object) { mine[shard_of(object)].push_back({object, txn, true}); });
+        }
+    });
+
+    // Each shard's objects, one at a time: edges by source, packed.
+    std::vector<std::vector<std::pair<uint32_t, uint64_t>>> shard_edges(shards);
+    std::vector<size_t> shard_accesses(shards), shard_objects(shards);
+    parallel_for(threads, shards, 1, [&](size_t, size_t shard, size_t) {
+        std::vector<Access> accesses;
+        for (auto& worker : buckets) {
+            accesses.insert(accesses.end(), worker[shard].begin(), worker[shard].end());
+            std::vector<Access>().swap(worker[shard]);
+        }
+        std::sort(accesses.begin(), accesses.end(), [](const Access& a, const Access& b) {
+            return a.object != b.object ? a.object < b.object : a.txn < b.txn;
+        });
+        std::vector<uint32_t> writers;
+        for (size_t i = 0; i < accesses.size();) {
+            size_t j = i + 1;
+            while (j < accesses.size() && accesses[j].object == accesses[i].object) ++j;
+            object_edges(txns, &accesses[i], &accesses[j], writers, shard_edges[shard]);
+            ++shard_objects[shard];
+            i = j;
+        }
+        shard_accesses[shard] = accesses.size();
+    });
+
+    // Scatter into rows by source, then sort each row and drop the edges several objects gave.
+    std::unique_ptr<std::atomic<uint32_t>[]> fill(new std::atomic<uint32_t>[n + 1]);
+    for (size_t v = 0; v <= n; ++v) fill[v].store(0, std::memory_order_relaxed);
+    parallel_for(threads, shards, 1, [&](size_t, size_t shard, size_t) {
+        for (const auto& edge : shard_edges[shard]) fill[edge.first].fetch_add(1, std::memory_order_relaxed);
+    });
+    std::vector<size_t> row(n + 1, 0);
+    for (size_t v = 0; v < n; ++v) row[v + 1] = row[v] + fill[v].load(std::memory_order_relaxed);
+    for (size_t v = 0; v < n; ++v) fill[v].store(static_cast<uint32_t>(0), std::memory_order_relaxed);
+    std::vector<uint64_t> packed(row[n]);
+    parallel_for(threads, shards, 1, [&](size_t, size_t shard, size_t) {
+        for (const auto& edge : shard_edges[shard]) {
+            packed[row[edge.first] + fill[edge.first].fetch_add(1, std::memory_order_relaxed)] = edge.second;
+        }
+        std::vector<std::pair<uint32_t, uint64_t>>().swap(shard_edges[shard]);
+    });
+    std::vector<uint32_t> degree(n);
+    parallel_for(threads, n, 1024, [&](size_t, size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            const auto first = packed.begin() + row[v];
+            std::sort(first, packed.begin() + row[v + 1]);
+            degree[v] = static_cast<uint32_t>(std::unique(first, packed.begin() + row[v + 1]) - first);
+        }
+    });
+
+    ConflictGraph graph;
+    graph.offsets.resize(n + 1, 0);
+    for (size_t v = 0; v < n; ++v) graph.offsets[v + 1] = graph.offsets[v] + degree[v];
+    const size_t m = graph.offsets[n];
+    graph.targets.resize(m);
+    graph.types.resize(m);
+    for (size_t v = 0; v < n; ++v) fill[v].store(0, std::memory_order_relaxed);
+    parallel_for(threads, n, 1024, [&](size_t, size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            for (uint32_t i = 0; i < degree[v]; ++i) {
+                const uint64_t edge = packed[row[v] + i];
+                graph.targets[graph.offsets[v] + i] = static_cast<uint32_t>(edge >> 2);
+                graph.types[graph.offsets[v] + i] = static_cast<ConflictType>(edge & 3);
+                fill[edge >> 2].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    });
+    std::vector<uint64_t>().swap(packed);
+
+    // The same edges by target. Sources are filled in parallel, so each row is sorted after.
+    graph.source_offsets.resize(n + 1, 0);
+    for (size_t v = 0; v < n; ++v) {
+        graph.source_offsets[v + 1] = graph.source_offsets[v] + fill[v].load(std::memory_order_relaxed);
+        fill[v].store(0, std::memory_order_relaxed);
+    }
+    graph.sources.resize(m);
+    parallel_for(threads, n, 1024, [&](size_t, size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            for (uint32_t i = graph.offsets[v]; i < graph.offsets[v + 1]; ++i) {
+                const uint32_t to = graph.targets[i];
+                graph.sources[graph.source_offsets[to] + fill[to].fetch_add(1, std::memory_order_relaxed)] =
+                    static_cast<uint32_t>(v);
+            }
+        }
+    });
+    parallel_for(threads, n, 1024, [&](size_t, size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            const auto first = graph.sources.begin();
+            std::sort(first + graph.source_offsets[v], first + graph.source_offsets[v + 1]);
+        }
+    });
+
+    for (size_t shard = 0; shard < shards; ++shard) {
+        stats.accesses += shard_accesses[shard];
+        stats.objects += shard_objects[shard];
+    }
+    for (const ConflictType type : graph.types) ++stats.edges[static_cast<size_t>(type)];
+    return graph;
+}
+
+std::vector<uint32_t> strongly_connected_components(const ConflictGraph& graph, size_t threads) {
+    const size_t n = graph.vertices();
+    std::vector<uint32_t> component(n);
+    // Part of the graph each vertex is in, SCC_DONE once its component is known.
+    std::unique_ptr<std::atomic<uint32_t>[]> part(new std::atomic<uint32_t>[n]);
+    std::unique_ptr<std::atomic<uint32_t>[]> in_left(new std::atomic<uint32_t>[n]);
+    std::unique_ptr<std::atomic<uint32_t>[]> out_left(new std::atomic<uint32_t>[n]);
+    for (size_t v = 0; v < n; ++v) {
+        part[v].store(0, std::memory_order_relaxed);
+        in_left[v].store(graph.source_offsets[v + 1] - graph.source_offsets[v], std::memory_order_relaxed);
+        out_left[v].store(graph.offsets[v + 1] - graph.offsets[v], std::memory_order_relaxed);
+    }
+
+    // Trim: a vertex with no edge in or no edge out among the remaining ones is a component of its own, and
+    // removing it may leave its neighbours so. Whoever takes a vertex's last edge away removes it, so chains
+    // unwind within one pass.
+    const auto claim = [&](uint32_t v) {
+        uint32_t expected = 0;
+        return part[v].compare_exchange_strong(expected, SCC_DONE);
+    };
+    parallel_for(threads, n, 1024, [&](size_t, size_t begin, size_t end) {
+        std::vector<uint32_t> removed;
+        for (size_t v = begin; v < end; ++v) {
+            if (in_left[v].load() != 0 && out_left[v].load() != 0) continue;
+            if (!claim(static_cast<uint32_t>(v))) continue;
+            removed.push_back(static_cast<uint32_t>(v));
+            while (!removed.empty()) {
+                const uint32_t u = removed.back();
+                removed.pop_back();
+                component[u] = u;
+                for (uint32_t i = graph.offsets[u]; i < graph.offsets[u + 1]; ++i) {
+                    const uint32_t w = graph.targets[i];
+                    if (in_left[w].fetch_sub(1) == 1 && claim(w)) removed.push_back(w);
+                }
+                for (uint32_t i = graph.source_offsets[u]; i < graph.source_offsets[u + 1]; ++i) {
+                    const uint32_t w = graph.sources[i];
+                    if (out_left[w].fetch_sub(1) == 1 && claim(w)) removed.push_back(w);
+                }
+            }
+        }
+    });
+
+    // Forward-backward on what is left: the vertices both reachable from a pivot and reaching it within its
+    // part are its component, and every other component lies within the forward-only, the backward-only or
+    // the unreached vertices, three parts that are split independently.
+    std::deque<SccTask> tasks;
+    SccTask all{0, {}};
+    for (uint32_t v = 0; v < n; ++v) {
+        if (part[v].load(std::memory_order_relaxed) == 0) all.vertices.push_back(v);
+    }
+    if (all.vertices.empty()) return component;
+    tasks.push_back(std::move(all));
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    size_t pending = 1;
+    std::atomic<uint32_t> next_part{1};
+    // Bit 1: reached forward, bit 2: backward. Only the task owning a vertex touches its mark.
+    std::vector<uint8_t> mark(n, 0);
+
+    const auto reach = [&](uint32_t pivot, uint32_t label, uint8_t bit, const std::vector<uint32_t>& offsets,
+                           const std::vector<uint32_t>& adjacent) {
+        std::vector<uint32_t> stack{pivot};
+        mark[pivot] |= bit;
+        while (!stack.empty()) {
+            const uint32_t v = stack.back();
+            stack.pop_back();
+            for (uint32_t i = offsets[v]; i < offsets[v + 1]; ++i) {
+                const uint32_t w = adjacent[i];
+                if (part[w].load(std::memory_order_relaxed) != label || (mark[w] & bit)) continue;
+                mark[w] |= bit;
+                stack.push_back(w);
+            }
+        }
+    };
+
+    // Trims a new part as the whole graph was, alone: splitting takes edges away and leaves many vertices of
+    // the parts with none in or none out. Keeps the rest in `vertices`.
+    const auto trim_part = [&](uint32_t label, std::vector<uint32_t>& vertices) {
+        const auto inside = [&](uint32_t w) { return part[w].load(std::memory_order_relaxed) == label; };
+        std::vector<uint32_t> removed;
+        const auto remove = [&](uint32_t v) {
+            part[v].store(SCC_DONE, std::memory_order_relaxed);
+            component[v] = v;
+            removed.push_back(v);
+        };
+        for (const uint32_t v : vertices) {
+            uint32_t in = 0, out = 0;
+            for (uint32_t i = graph.source_offsets[v]; i < graph.source_offsets[v + 1]; ++i) in += inside(graph.sources[i]);
+            for (uint32_t i = graph.offsets[v]; i < graph.offsets[v + 1]; ++i) out += inside(graph.targets[i]);
+            in_left[v].store(in, std::memory_order_relaxed);
+            out_left[v].store(out, std::memory_order_relaxed);
+        }
+        for (const uint32_t v : vertices) {
+            if (in_left[v].load(std::memory_order_relaxed) == 0 || out_left[v].load(std::memory_order_relaxed) == 0) {
+                remove(v);
+            }
+        }
+        while (!removed.empty()) {
+            const uint32_t u = removed.back();
+            removed.pop_back();
+            for (uint32_t i = graph.offsets[u]; i < graph.offsets[u + 1]; ++i) {
+                const uint32_t w = graph.targets[i];
+                if (inside(w) && in_left[w].fetch_sub(1, std::memory_order_relaxed) == 1) remove(w);
+            }
+            for (uint32_t i = graph.source_offsets[u]; i < graph.source_offsets[u + 1]; ++i) {
+                const uint32_t w = graph.sources[i];
+                if (inside(w) && out_left[w].fetch_sub(1, std::memory_order_relaxed) == 1) remove(w);
+            }
+        }
+        vertices.erase(std::remove_if(vertices.begin(), vertices.end(), [&](uint32_t v) { return !inside(v); }),
+                       vertices.end());
+    };
+
+    const auto split = [&](SccTask task, std::vector<SccTask>& children) {
+        // Vertices are in BEGIN order and edges mostly follow it: a pivot from the middle splits the part about
+        // in half, where the first vertex would leave nearly all of it reachable forward.
+        const uint32_t pivot = task.vertices[task.vertices.size() / 2];
+        reach(pivot, task.part, 1, graph.offsets, graph.targets);
+        reach(pivot, task.part, 2, graph.source_offsets, graph.sources);
+        std::vector<uint32_t> parts[3];
+        for (const uint32_t v : task.vertices) {
+            const uint8_t m = mark[v];
+            mark[v] = 0;
+            if (m == 3) {
+                component[v] = pivot;
+                part[v].store(SCC_DONE, std::memory_order_relaxed);
+            } else {
+                parts[m].push_back(v);
+            }
+        }
+        for (auto& vertices : parts) {
+            if (vertices.empty()) continue;
+            if (vertices.size() == 1) {
+                component[vertices[0]] = vertices[0];
+                part[vertices[0]].store(SCC_DONE, std::memory_order_relaxed);
+                continue;
+            }
+            const uint32_t label = next_part++;
+            for (const uint32_t v : vertices) part[v].store(label, std::memory_order_relaxed);
+            trim_part(label, vertices);
+            if (!vertices.empty()) children.push_back({label, std::move(vertices)});
+        }
+    };
+
+    const auto work = [&] {
+        std::vector<SccTask> children;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return !tasks.empty() || pending == 0; });
+            if (tasks.empty()) return;
+            SccTask task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            split(std::move(task), children);
+            lock.lock();
+            pending += children.size();
+            for (auto& child : children) tasks.push_back(std::move(child));
+            children.clear();
+            --pending;
+            wake.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < threads; ++w) pool.emplace_back(work);
+    work();
+    for (auto& thread : pool) thread.join();
+    return component;
+}
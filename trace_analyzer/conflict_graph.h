@@ -0,0 +1,115 @@
+#ifndef CONFLICT_GRAPH_H
+#define CONFLICT_GRAPH_H
+
+#include "object_set.h"
+#include "phantom_checker.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mvtracer.h>
+#include <unordered_map>
+#include <vector>
+
+// Read and write sets of a committed transaction, as object keys.
+struct TxnSets {
+    TxnInstance id;
+    uint64_t begin;
+    uint64_t commit;
+    ObjectSet reads;
+    ObjectSet writes;
+    ObjectBloom read_bloom;
+    ObjectBloom write_bloom;
+};
+
+// Collects the read and write sets of every transaction from records fed in `seq` order. Like PhantomChecker,
+// it forgets the writes undone by ABORT and ROLLBACK_TO; reads stay, the transaction did make them. Only
+// committed transactions are kept.
+class TxnSetCollector {
+public:
+    void add(const TraceRecord& record);
+
+    // The committed transactions in BEGIN order. Leaves the collector empty.
+    std::vector<TxnSets> finish();
+
+private:
+    struct Pending {
+        uint64_t begin = 0;
+        std::vector<uint64_t> reads;
+        std::vector<uint64_t> writes;
+        Savepoints savepoints;
+    };
+
+    TxnInstances instances_;
+    // Keyed by txn_key().
+    std::unordered_map<uint64_t, Pending> pending_;
+    std::vector<TxnSets> committed_;
+};
+
+enum class ConflictType : uint8_t {
+    // Both wrote an object; from the first to commit to the other.
+    WW,
+    // The source read an object the target wrote, and did not see the write.
+    RW,
+    // The target read the version of an object the source wrote. Only build_conflict_graph makes these:
+    // build_conflicts pairs overlapping transactions, which cannot see each other's writes.
+    WR,
+};
+
+// Edge between two transactions of the `txns` given to build_conflicts, by index.
+struct ConflictEdge {
+    uint32_t from;
+    uint32_t to;
+    ConflictType type;
+};
+
+struct ConflictStats {
+    // Pairs of transactions that overlap in time.
+    size_t pairs = 0;
+    // Set comparisons (ww, and rw both ways) proven empty by the Bloom filters or disjoint key bounds, and the
+    // ones that had to intersect the sets.
+    size_t screened = 0;
+    size_t intersected = 0;
+    size_t edges[3] = {};
+};
+
+// Edges between the transactions of `txns` (in BEGIN order) that overlap: one whose commit comes after the
+// other's begin. Neither sees the other's writes, so an object both wrote is a WW edge and an object one read
+// and the other wrote is an RW edge from the reader. Transactions that do not overlap have no such conflict.
+std::vector<ConflictEdge> build_conflicts(const std::vector<TxnSets>& txns, ConflictStats& stats);
+
+// Dependency graph over the transactions of `txns` in compressed sparse row form: the edges out of
+// transaction `t` are `targets[offsets[t]]` up to `targets[offsets[t + 1]]`, ascending, with their types at
+// the same positions of `types`. `sources` and `source_offsets` hold the same edges by target.
+struct ConflictGraph {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> targets;
+    std::vector<ConflictType> types;
+    std::vector<uint32_t> source_offsets;
+    std::vector<uint32_t> sources;
+
+    size_t vertices() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t edges() const { return targets.size(); }
+};
+
+struct ConflictGraphStats {
+    // Reads and writes of all transactions, and the distinct objects they touch.
+    size_t accesses = 0;
+    size_t objects = 0;
+    // Edges by ConflictType, after merging the ones several objects gave the same pair.
+    size_t edges[3] = {};
+};
+
+// The dependency graph of `txns` (in BEGIN order), built per object on `threads` threads. Objects are sharded
+// by hash; each shard orders the writers of each of its objects by commit into the object's version chain,
+// with a WW edge from each writer to the next. A reader sees the last version committed before it began: a
+// WR edge from that version's writer, and an RW edge to the writer of the next version. Later versions are
+// reachable through the chain, so leaving out edges to them keeps the same cycles with far fewer edges.
+ConflictGraph build_conflict_graph(const std::vector<TxnSets>& txns, size_t threads, ConflictGraphStats& stats);
+
+// Strongly connected component of every vertex of `graph`, as the index of one of its vertices, computed on
+// `threads` threads: vertices that cannot be on a cycle are trimmed first, then the rest is split by forward
+// and backward reachability from a pivot, each part handed to the next free thread. Components of more than
+// one transaction are the dependency cycles.
+std::vector<uint32_t> strongly_connected_components(const ConflictGraph& graph, size_t threads);
+
+#endif // CONFLICT_GRAPH_H
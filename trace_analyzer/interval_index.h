@@ -0,0 +1,105 @@
+#ifndef INTERVAL_INDEX_H
+#define INTERVAL_INDEX_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Static interval tree over closed intervals [lo, hi], answering stabbing queries.
+//
+// The tree is implicit in an array sorted by `lo` (the layout used by cgranges): the element at index i sits
+// at level k when its k lowest bits are set, its children are i -/+ 2^(k-1), and `max_hi` holds the largest
+// `hi` of its subtree. Building is one sort plus a linear pass; a query visits O(log n + hits) elements and
+// needs no allocation.
+template <typename T> class IntervalIndex {
+public:
+    struct Entry {
+        int64_t lo;
+        int64_t hi;
+        int64_t max_hi;
+        T value;
+    };
+
+    void add(int64_t lo, int64_t hi, T value) {
+        entries_.push_back({lo, hi, hi, std::move(value)});
+        built_ = false;
+    }
+
+    size_t size() const { return entries_.size(); }
+
+    // In `lo` order once built.
+    const std::vector<Entry>& entries() const { return entries_; }
+
+    void build() {
+        std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) { return a.lo < b.lo; });
+        built_ = true;
+        max_level_ = -1;
+        const size_t n = entries_.size();
+        if (n == 0) return;
+
+        size_t last_i = 0;
+        int64_t last = 0;
+        for (size_t i = 0; i < n; i += 2) {
+            entries_[i].max_hi = entries_[i].hi;
+            last = entries_[i].hi;
+            last_i = i;
+        }
+        int k = 1;
+        for (; (size_t{1} << k) <= n; ++k) {
+            const size_t x = size_t{1} << (k - 1);
+            const size_t step = x << 2;
+            for (size_t i = (x << 1) - 1; i < n; i += step) {
+                const int64_t left = entries_[i - x].max_hi;
+                const int64_t right = i + x < n ? entries_[i + x].max_hi : last;
+                entries_[i].max_hi = std::max({entries_[i].hi, left, right});
+            }
+            // `last` tracks the max of the rightmost, possibly incomplete, subtree at this level.
+            last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+            if (last_i < n && entries_[last_i].max_hi > last) last = entries_[last_i].max_hi;
+        }
+        max_level_ = k - 1;
+    }
+
+    // Calls `visit(const Entry&)` for every interval containing `point`. build() must have been called.
+    template <typename Visitor> void stab(int64_t point, Visitor&& visit) const {
+        if (!built_ || max_level_ < 0) return;
+        const size_t n = entries_.size();
+
+        struct Frame {
+            size_t x;
+            int k;
+            bool left_done;
+        };
+        // Each level pushes at most two frames.
+        Frame stack[2 * 64];
+        int top = 0;
+        stack[top++] = {(size_t{1} << max_level_) - 1, max_level_, false};
+        while (top > 0) {
+            const Frame f = stack[--top];
+            if (f.k <= 3) {
+                // Small subtree: scanning it is cheaper than descending further.
+                const size_t i0 = f.x >> f.k << f.k;
+                const size_t i1 = std::min(n, i0 + (size_t{1} << (f.k + 1)) - 1);
+                for (size_t i = i0; i < i1 && entries_[i].lo <= point; ++i) {
+                    if (point <= entries_[i].hi) visit(entries_[i]);
+                }
+            } else if (!f.left_done) {
+                const size_t y = f.x - (size_t{1} << (f.k - 1));
+                stack[top++] = {f.x, f.k, true};
+                // Nodes past the end stand for incomplete subtrees and are always descended into.
+                if (y >= n || entries_[y].max_hi >= point) stack[top++] = {y, f.k - 1, false};
+            } else if (f.x < n && entries_[f.x].lo <= point) {
+                if (point <= entries_[f.x].hi) visit(entries_[f.x]);
+                stack[top++] = {f.x + (size_t{1} << (f.k - 1)), f.k - 1, false};
+            }
+        }
+    }
+
+private:
+    std::vector<Entry> entries_;
+    int max_level_ = -1;
+    bool built_ = false;
+};
+
+#endif // INTERVAL_INDEX_H
@@ -0,0 +1,201 @@
+#include "object_set.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OBJECT_SET_X86 1
+#endif
+
+namespace {
+constexpr unsigned BLOCK_BITS = 12;
+constexpr size_t BLOCK_WORDS = (size_t{1} << BLOCK_BITS) / 64;
+// Sizes further apart than this are intersected by galloping through the larger set.
+constexpr size_t GALLOP_RATIO = 32;
+
+using IntersectFn = size_t (*)(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, bool any);
+
+size_t merge_scalar(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, bool any) {
+    size_t count = 0;
+    size_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            if (any) return 1;
+            ++count;
+            ++i;
+            ++j;
+        }
+    }
+    return count;
+}
+
+#ifdef OBJECT_SET_X86
+// Compares four keys of `a` with four of `b` in every rotation, then moves past the block with the smaller last
+// key (both on a tie). Keys are unique, so a key of `a` matches at most once.
+__attribute__((target("avx2"))) size_t merge_avx2(const uint64_t* a, size_t na, const uint64_t* b, size_t nb,
+                                                   bool any) {
+    size_t count = 0;
+    size_t i = 0, j = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        __m256i hits = _mm256_cmpeq_epi64(va, vb);
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hits));
+        if (mask) {
+            if (any) return 1;
+            count += __builtin_popcount(mask);
+        }
+        const uint64_t a_last = a[i + 3];
+        const uint64_t b_last = b[j + 3];
+        if (a_last <= b_last) i += 4;
+        if (b_last <= a_last) j += 4;
+    }
+    return count + merge_scalar(a + i, na - i, b + j, nb - j, any);
+}
+#endif
+
+IntersectFn default_merge() {
+#ifdef OBJECT_SET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return merge_avx2;
+#endif
+    return merge_scalar;
+}
+
+IntersectFn merge_fn = default_merge();
+
+// Looks up each key of the small set in the large one, doubling the step from the last position found.
+size_t gallop(const uint64_t* small, size_t ns, const uint64_t* large, size_t nl, bool any) {
+    size_t count = 0;
+    size_t lo = 0;
+    for (size_t i = 0; i < ns && lo < nl; ++i) {
+        size_t step = 1;
+        size_t hi = lo;
+        while (hi < nl && large[hi] < small[i]) {
+            lo = hi + 1;
+            hi += step;
+            step <<= 1;
+        }
+        lo = std::lower_bound(large + lo, large + std::min(hi + 1, nl), small[i]) - large;
+        if (lo < nl && large[lo] == small[i]) {
+            if (any) return 1;
+            ++count;
+            ++lo;
+        }
+    }
+    return count;
+}
+} // namespace
+
+bool object_set_simd() {
+    return merge_fn != merge_scalar;
+}
+
+void set_object_set_simd(bool on) {
+    merge_fn = on ? default_merge() : merge_scalar;
+}
+
+ObjectSet::ObjectSet(std::vector<uint64_t> keys) {
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    size_ = keys.size();
+    if (keys.empty()) return;
+    min_ = keys.front();
+    max_ = keys.back();
+
+    size_t blocks = 1;
+    for (size_t i = 1; i < keys.size(); ++i) {
+        blocks += (keys[i] >> BLOCK_BITS) != (keys[i - 1] >> BLOCK_BITS);
+    }
+    // Dense once the blocks take less room than the keys.
+    if (blocks * (BLOCK_WORDS + 1) >= keys.size()) {
+        keys.shrink_to_fit();
+        keys_ = std::move(keys);
+        return;
+    }
+    blocks_.reserve(blocks);
+    words_.assign(blocks * BLOCK_WORDS, 0);
+    for (const uint64_t key : keys) {
+        if (blocks_.empty() || blocks_.back() != key >> BLOCK_BITS) blocks_.push_back(key >> BLOCK_BITS);
+        const uint64_t bit = key & ((uint64_t{1} << BLOCK_BITS) - 1);
+        words_[(blocks_.size() - 1) * BLOCK_WORDS + bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+size_t ObjectSet::bytes() const {
+    return (keys_.capacity() + blocks_.capacity() + words_.capacity()) * sizeof(uint64_t);
+}
+
+bool ObjectSet::contains(uint64_t key) const {
+    if (!dense()) return std::binary_search(keys_.begin(), keys_.end(), key);
+    const auto block = std::lower_bound(blocks_.begin(), blocks_.end(), key >> BLOCK_BITS);
+    if (block == blocks_.end() || *block != key >> BLOCK_BITS) return false;
+    const uint64_t bit = key & ((uint64_t{1} << BLOCK_BITS) - 1);
+    return words_[(block - blocks_.begin()) * BLOCK_WORDS + bit / 64] >> (bit % 64) & 1;
+}
+
+bool ObjectSet::intersects(const ObjectSet& other) const {
+    return intersect(other, true) != 0;
+}
+
+size_t ObjectSet::intersection_size(const ObjectSet& other) const {
+    return intersect(other, false);
+}
+
+size_t ObjectSet::intersect(const ObjectSet& other, bool any) const {
+    if (empty() || other.empty() || max_ < other.min_ || other.max_ < min_) return 0;
+
+    if (!dense() && !other.dense()) {
+        const ObjectSet& small = size_ <= other.size_ ? *this : other;
+        const ObjectSet& large = size_ <= other.size_ ? other : *this;
+        if (small.size_ * GALLOP_RATIO < large.size_) {
+            return gallop(small.keys_.data(), small.size_, large.keys_.data(), large.size_, any);
+        }
+        return merge_fn(keys_.data(), size_, other.keys_.data(), other.size_, any);
+    }
+
+    size_t count = 0;
+    if (dense() && other.dense()) {
+        size_t i = 0, j = 0;
+        while (i < blocks_.size() && j < other.blocks_.size()) {
+            if (blocks_[i] < other.blocks_[j]) {
+                ++i;
+            } else if (other.blocks_[j] < blocks_[i]) {
+                ++j;
+            } else {
+                const uint64_t* x = &words_[i * BLOCK_WORDS];
+                const uint64_t* y = &other.words_[j * BLOCK_WORDS];
+                for (size_t w = 0; w < BLOCK_WORDS; ++w) {
+                    count += __builtin_popcountll(x[w] & y[w]);
+                }
+                if (any && count) return 1;
+                ++i;
+                ++j;
+            }
+        }
+        return count;
+    }
+
+    // One sparse set walked through the blocks of the dense one; both are in key order.
+    const ObjectSet& sparse = dense() ? other : *this;
+    const ObjectSet& bitmap = dense() ? *this : other;
+    size_t block = 0;
+    for (const uint64_t key : sparse.keys_) {
+        while (block < bitmap.blocks_.size() && bitmap.blocks_[block] < key >> BLOCK_BITS) ++block;
+        if (block == bitmap.blocks_.size()) break;
+        if (bitmap.blocks_[block] != key >> BLOCK_BITS) continue;
+        const uint64_t bit = key & ((uint64_t{1} << BLOCK_BITS) - 1);
+        if (bitmap.words_[block * BLOCK_WORDS + bit / 64] >> (bit % 64) & 1) {
+            if (any) return 1;
+            ++count;
+        }
+    }
+    return count;
+}
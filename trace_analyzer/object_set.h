@@ -0,0 +1,98 @@
+#ifndef OBJECT_SET_H
+#define OBJECT_SET_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Immutable set of 64-bit object keys (see object_key), built once per transaction and then intersected with
+// the sets of the transactions it overlaps.
+//
+// A set is kept in the smaller of two forms:
+//  - sparse: the keys, sorted;
+//  - dense: a bitmap in blocks of 4096 keys, of which only the non-empty blocks are stored with their block
+//    ids, so a hot table's rows cost one bit each and the gaps between them nothing.
+//
+// Sparse sets are intersected four keys against four at a time with AVX2 where the CPU has it, and by
+// galloping through the larger one when their sizes differ a lot. Dense blocks are intersected a word at a
+// time.
+class ObjectSet {
+public:
+    ObjectSet() = default;
+    // `keys` may hold duplicates and be in any order.
+    explicit ObjectSet(std::vector<uint64_t> keys);
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool dense() const { return !blocks_.empty(); }
+    uint64_t min() const { return min_; }
+    uint64_t max() const { return max_; }
+    // Memory held by the set's keys or blocks.
+    size_t bytes() const;
+
+    bool contains(uint64_t key) const;
+    // Whether the sets share a key; stops at the first one.
+    bool intersects(const ObjectSet& other) const;
+    size_t intersection_size(const ObjectSet& other) const;
+
+    // Calls `f(key)` for every key, ascending.
+    template <typename F> void for_each(F f) const {
+        if (!dense()) {
+            for (const uint64_t key : keys_) f(key);
+            return;
+        }
+        for (size_t block = 0; block < blocks_.size(); ++block) {
+            for (size_t w = 0; w < 64; ++w) {
+                for (uint64_t word = words_[block * 64 + w]; word; word &= word - 1) {
+                    f(blocks_[block] << 12 | w * 64 | static_cast<uint64_t>(__builtin_ctzll(word)));
+                }
+            }
+        }
+    }
+
+private:
+    size_t intersect(const ObjectSet& other, bool any) const;
+
+    std::vector<uint64_t> keys_;
+    // Ids (key >> 12) of the non-empty blocks, ascending, and their 64 words each.
+    std::vector<uint64_t> blocks_;
+    std::vector<uint64_t> words_;
+    size_t size_ = 0;
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Pre-screen for ObjectSet::intersects: one bit of 1024 per key. Two sets that share a key share its bit, so
+// filters with no bit in common prove the sets disjoint without looking at them. A single hash keeps the
+// filters of small sets sparse, which is what makes the AND of two of them empty.
+class ObjectBloom {
+public:
+    void add(uint64_t key) {
+        const uint64_t bit = (key * 0x9e3779b97f4a7c15ull) >> 54;
+        words_[bit >> 6] |= 1ull << (bit & 63);
+    }
+
+    bool may_intersect(const ObjectBloom& other) const {
+        uint64_t common = 0;
+        for (size_t i = 0; i < words_.size(); ++i) common |= words_[i] & other.words_[i];
+        return common != 0;
+    }
+
+private:
+    std::array<uint64_t, 16> words_{};
+};
+
+// Key of the object a READ or WRITE record touches: the table's root page in the top 24 bits and the low 40
+// bits of the rowid, or of the index key hash for index entries, below it. Rowids beyond 2^40 and key hashes
+// may share keys, which can only add conflicts.
+inline uint64_t object_key(uint32_t table, int64_t row) {
+    return static_cast<uint64_t>(table) << 40 | (static_cast<uint64_t>(row) & ((1ull << 40) - 1));
+}
+
+// Whether sparse sets are intersected with AVX2. On by default where the CPU supports it; turning it on
+// elsewhere has no effect.
+bool object_set_simd();
+void set_object_set_simd(bool on);
+
+#endif // OBJECT_SET_H
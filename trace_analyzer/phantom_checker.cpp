@@ -0,0 +1,135 @@
+#include "phantom_checker.h"
+
+#include "interval_index.h"
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <tuple>
+
+namespace {
+constexpr uint64_t NOT_COMMITTED = std::numeric_limits<uint64_t>::max();
+} // namespace
+
+size_t Savepoints::apply(const TraceRecord& record, size_t writes) {
+    // Savepoint levels start at 1.
+    const size_t level = static_cast<size_t>(record.objectId);
+    if (level == 0) return writes;
+
+    switch (record.type) {
+    case SAVEPOINT:
+        marks_.resize(level - 1, writes);
+        marks_.push_back(writes);
+        break;
+    case RELEASE:
+        if (level <= marks_.size()) marks_.resize(level - 1);
+        break;
+    case ROLLBACK_TO:
+        if (level > marks_.size()) break;
+        // The savepoint itself stays open.
+        marks_.resize(level);
+        return marks_.back();
+    default:
+        break;
+    }
+    return writes;
+}
+
+PhantomChecker::Span PhantomChecker::span(const TxnInstance& txn) const {
+    const auto it = spans_.find(txn_key(txn));
+    return it == spans_.end() ? Span{0, NOT_COMMITTED} : it->second;
+}
+
+size_t PhantomChecker::ranges() const {
+    size_t count = ranges_.size();
+    for (const auto& entry : pending_) {
+        count += entry.second.ranges.size();
+    }
+    return count;
+}
+
+void PhantomChecker::finish(const TxnInstance& txn, bool committed) {
+    const auto it = pending_.find(txn_key(txn));
+    if (it == pending_.end()) return;
+
+    if (committed) {
+        ranges_.insert(ranges_.end(), it->second.ranges.begin(), it->second.ranges.end());
+        writes_.insert(writes_.end(), it->second.writes.begin(), it->second.writes.end());
+    } else {
+        discarded_ += it->second.writes.size();
+        spans_.erase(txn_key(txn));
+    }
+    pending_.erase(it);
+}
+
+void PhantomChecker::add(const TraceRecord& record) {
+    const TxnInstance txn = instances_.current(record.transactionId);
+
+    switch (record.type) {
+    case BEGIN:
+        spans_[txn_key(instances_.begin(record.transactionId))] = {record.seq, NOT_COMMITTED};
+        break;
+    case COMMIT:
+        spans_[txn_key(txn)].commit = record.seq;
+        finish(txn, true);
+        break;
+    case ABORT:
+        finish(txn, false);
+        break;
+    case SAVEPOINT:
+    case RELEASE:
+    case ROLLBACK_TO: {
+        auto& pending = pending_[txn_key(txn)];
+        const size_t keep = pending.savepoints.apply(record, pending.writes.size());
+        discarded_ += pending.writes.size() - keep;
+        pending.writes.resize(keep);
+        break;
+    }
+    case RANGE:
+        pending_[txn_key(txn)].ranges.push_back(
+            {txn, record.table, record.objectId, record.upperBound, record.seq, record.flags, record.statementId});
+        break;
+    case WRITE:
+        pending_[txn_key(txn)].writes.push_back(
+            {txn, record.table, record.objectId, record.objectId, record.seq, record.flags, record.statementId});
+        break;
+    default:
+        break;
+    }
+}
+
+std::vector<PhantomEdge> PhantomChecker::check() const {
+    std::unordered_map<uint32_t, IntervalIndex<const Access*>> by_table;
+    for (const auto& range : ranges_) {
+        by_table[range.table].add(range.lo, range.hi, &range);
+    }
+    for (const auto& entry : pending_) {
+        for (const auto& range : entry.second.ranges) {
+            by_table[range.table].add(range.lo, range.hi, &range);
+        }
+    }
+    for (auto& entry : by_table) {
+        entry.second.build();
+    }
+
+    std::vector<PhantomEdge> edges;
+    std::set<std::tuple<uint64_t, uint64_t, uint32_t>> reported;
+    for (const auto& write : writes_) {
+        const auto index = by_table.find(write.table);
+        if (index == by_table.end()) continue;
+        const Span writer = span(write.txn);
+
+        const WriteStab stab(write.lo, write.flags);
+        index->second.stab(stab.point, [&](const auto& entry) {
+            const Access& range = *entry.value;
+            if (range.txn == write.txn || !stab.contains(range.hi)) return;
+            // The reader saw the row if the writer committed before the range was read, and the two do not
+            // conflict at all if the writer only started after the reader had committed.
+            if (writer.commit < range.seq || writer.begin > span(range.txn).commit) return;
+            if (!reported.emplace(txn_key(range.txn), txn_key(write.txn), write.table).second) return;
+            edges.push_back({range.txn, write.txn, write.table, range.lo, range.hi, write.lo, stab.key_hash,
+                             range.seq, write.seq, range.stmt, write.stmt});
+        });
+    }
+    return edges;
+}
@@ -0,0 +1,138 @@
+#ifndef PHANTOM_CHECKER_H
+#define PHANTOM_CHECKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mvtracer.h>
+#include <unordered_map>
+#include <vector>
+
+// One execution of a transaction. Transaction ids are reused (the default tracer context uses the thread id),
+// so every BEGIN starts a new instance.
+struct TxnInstance {
+    int32_t id;
+    uint32_t instance;
+
+    bool operator==(const TxnInstance& other) const { return id == other.id && instance == other.instance; }
+};
+
+// Packs an instance into one map key.
+inline uint64_t txn_key(const TxnInstance& txn) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(txn.id)) << 32 | txn.instance;
+}
+
+// The bookkeeping every checker fed records in `seq` order shares: which instance of its id a record belongs to,
+// the savepoints of each running transaction, and which ranges a write falls into.
+
+// Numbers the instances of each transaction id: BEGIN starts the next one, the other records of the id belong to
+// the latest.
+class TxnInstances {
+public:
+    TxnInstance begin(int32_t txn_id) { return {txn_id, ++instances_[txn_id]}; }
+    TxnInstance current(int32_t txn_id) { return {txn_id, instances_[txn_id]}; }
+
+private:
+    std::unordered_map<int32_t, uint32_t> instances_;
+};
+
+// Open savepoints of a running transaction, as the number of writes it had made when each was taken, outermost
+// first.
+class Savepoints {
+public:
+    // Applies a SAVEPOINT, RELEASE or ROLLBACK_TO record to a transaction that has made `writes` writes so far.
+    // Returns how many of them survive: fewer only after a ROLLBACK_TO, which undoes the writes made since.
+    size_t apply(const TraceRecord& record, size_t writes);
+
+private:
+    std::vector<size_t> marks_;
+};
+
+// Where a WRITE record stabs the ranges of its table, and which of the ranges found there contain it. Deletes
+// count like any other write: the row leaves the range. An index key hash has no order: it is looked up at
+// TRACE_KEY_MIN, and only ranges open at both ends of the index contain it.
+struct WriteStab {
+    int64_t point;
+    bool key_hash;
+
+    WriteStab(int64_t row, uint8_t flags)
+        : point(flags & TRACE_FLAG_INDEX ? TRACE_KEY_MIN : row), key_hash(flags & TRACE_FLAG_INDEX) {}
+
+    // Whether a range ending at `hi` that the stab found contains the write.
+    bool contains(int64_t hi) const { return !key_hash || hi == TRACE_KEY_MAX; }
+};
+
+// A write by a concurrent transaction into a range another transaction had already read, which the reader
+// therefore could not see: an rw anti-dependency reader -> writer on a row the reader's predicate covers.
+struct PhantomEdge {
+    TxnInstance reader;
+    TxnInstance writer;
+    uint32_t table;
+    int64_t lo;
+    int64_t hi;
+    // Rowid written, or the index key hash when `index_key` is set.
+    int64_t row;
+    bool index_key;
+    uint64_t range_seq;
+    uint64_t write_seq;
+    // Statements that read the range and made the write, TRACE_STATEMENT_NONE if unknown.
+    uint16_t range_stmt;
+    uint16_t write_stmt;
+};
+
+// Offline phantom detection. Records are fed in `seq` order; check() indexes the RANGE records of every table
+// in an interval tree and stabs it with each committed write.
+//
+// Accesses are buffered per running transaction and dropped as soon as they are undone: all of them at ABORT,
+// the writes made since a savepoint at ROLLBACK_TO. Only what survives to COMMIT is kept, so rolled back work
+// never produces an edge. Ranges of transactions still running at the end of the trace are checked as well.
+// Writes are matched against ranges as WriteStab says.
+class PhantomChecker {
+public:
+    void add(const TraceRecord& record);
+
+    // Returns one edge per (reader, writer, table), the first one in write order.
+    std::vector<PhantomEdge> check() const;
+
+    size_t ranges() const;
+    size_t writes() const { return writes_.size(); }
+    // Writes discarded by ABORT or ROLLBACK_TO.
+    size_t discarded() const { return discarded_; }
+
+private:
+    struct Access {
+        TxnInstance txn;
+        uint32_t table;
+        int64_t lo;
+        int64_t hi;
+        uint64_t seq;
+        // TRACE_FLAG_* bits of the record.
+        uint8_t flags;
+        uint16_t stmt;
+    };
+
+    struct Span {
+        uint64_t begin;
+        uint64_t commit;
+    };
+
+    // Accesses of a transaction that has not finished yet.
+    struct Pending {
+        std::vector<Access> ranges;
+        std::vector<Access> writes;
+        Savepoints savepoints;
+    };
+
+    Span span(const TxnInstance& txn) const;
+    void finish(const TxnInstance& txn, bool committed);
+
+    TxnInstances instances_;
+    // Keyed by (id << 32 | instance).
+    std::unordered_map<uint64_t, Span> spans_;
+    // Keyed like `spans_`.
+    std::unordered_map<uint64_t, Pending> pending_;
+    std::vector<Access> ranges_;
+    std::vector<Access> writes_;
+    size_t discarded_ = 0;
+};
+
+#endif // PHANTOM_CHECKER_H
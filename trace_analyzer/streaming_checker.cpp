@@ -0,0 +1,242 @@
+#include "streaming_checker.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+constexpr uint64_t NOT_COMMITTED = std::numeric_limits<uint64_t>::max();
+// Ranges scanned linearly before they are indexed.
+constexpr size_t MIN_INDEXED = 32;
+// Hash, set and deque nodes of a transaction, for the peak estimate.
+constexpr size_t TXN_OVERHEAD = 96;
+} // namespace
+
+StreamingPhantomChecker::Txn& StreamingPhantomChecker::lookup(int32_t txn_id) {
+    const TxnInstance txn = instances_.current(txn_id);
+    const uint64_t key = txn_key(txn);
+    const auto [it, inserted] = txns_.try_emplace(key);
+    if (inserted) {
+        // Begun before the trace started.
+        it->second.id = txn;
+        it->second.begin = 0;
+        it->second.commit = NOT_COMMITTED;
+        it->second.abandoned = false;
+        active_.emplace(0, key);
+    }
+    return it->second;
+}
+
+void StreamingPhantomChecker::report(const PhantomEdge& edge) {
+    ++edges_;
+    on_edge_(edge);
+}
+
+void StreamingPhantomChecker::commit(Txn& txn, uint64_t seq) {
+    const uint64_t key = txn_key(txn.id);
+    txn.commit = seq;
+
+    // One edge per (reader, table), for the first write that makes it.
+    std::set<std::pair<uint64_t, uint32_t>> reported;
+    for (const Write& write : txn.writes) {
+        const auto table = tables_.find(write.table);
+        if (table == tables_.end()) continue;
+
+        const WriteStab stab(write.row, write.flags);
+        const auto visit = [&](const IntervalIndex<RangeRef>::Entry& entry) {
+            const RangeRef& range = entry.value;
+            if (range.txn == key || !stab.contains(entry.hi)) return;
+            // Ranges of evicted and aborted transactions are gone from `txns_`.
+            const auto reader = txns_.find(range.txn);
+            if (reader == txns_.end() || txn.commit < range.seq || txn.begin > reader->second.commit) return;
+            if (!reported.emplace(range.txn, write.table).second) return;
+
+            const PhantomEdge edge{reader->second.id, txn.id, write.table, entry.lo, entry.hi, write.row,
+                                   stab.key_hash, range.seq, write.seq, range.stmt, write.stmt};
+            if (reader->second.commit != NOT_COMMITTED || reader->second.abandoned) {
+                report(edge);
+            } else {
+                reader->second.held.push_back(edge);
+                ++live_held_;
+            }
+        };
+        for (const auto& level : table->second.levels) {
+            level.stab(stab.point, visit);
+        }
+        for (const auto& entry : table->second.recent) {
+            if (entry.lo <= stab.point && stab.point <= entry.hi) visit(entry);
+        }
+    }
+
+    for (const auto& edge : txn.held) {
+        report(edge);
+    }
+    writes_ += txn.writes.size();
+    live_writes_ -= txn.writes.size();
+    live_held_ -= txn.held.size();
+    std::vector<Write>().swap(txn.writes);
+    txn.savepoints = Savepoints();
+    std::vector<PhantomEdge>().swap(txn.held);
+
+    active_.erase({txn.begin, key});
+    committed_.emplace_back(seq, key);
+}
+
+void StreamingPhantomChecker::drop(uint64_t key) {
+    const auto it = txns_.find(key);
+    if (it == txns_.end()) return;
+
+    const std::vector<uint32_t> range_tables = std::move(it->second.range_tables);
+    live_writes_ -= it->second.writes.size();
+    live_held_ -= it->second.held.size();
+    active_.erase({it->second.begin, key});
+    txns_.erase(it);
+
+    for (const uint32_t root : range_tables) {
+        TableRanges& ranges = tables_[root];
+        // Merged into one level once half of the table's ranges are dead.
+        if (++ranges.dead * 2 > ranges.size) {
+            std::vector<RangeEntry> entries = std::move(ranges.recent);
+            ranges.recent.clear();
+            for (auto& level : ranges.levels) {
+                entries.insert(entries.end(), level.entries().begin(), level.entries().end());
+                level = IntervalIndex<RangeRef>();
+            }
+            settle(ranges, std::move(entries));
+        }
+    }
+}
+
+void StreamingPhantomChecker::evict() {
+    const uint64_t watermark = active_.empty() ? NOT_COMMITTED : active_.begin()->first;
+    while (!committed_.empty() && committed_.front().first < watermark) {
+        const uint64_t key = committed_.front().second;
+        committed_.pop_front();
+        drop(key);
+    }
+}
+
+void StreamingPhantomChecker::add_range(uint32_t table, int64_t lo, int64_t hi, const RangeRef& ref) {
+    TableRanges& ranges = tables_[table];
+    ranges.recent.push_back({lo, hi, hi, ref});
+    ++ranges.size;
+    ++live_ranges_;
+    if (ranges.recent.size() == MIN_INDEXED) {
+        std::vector<RangeEntry> entries = std::move(ranges.recent);
+        ranges.recent.clear();
+        settle(ranges, std::move(entries));
+    }
+}
+
+// Puts `entries` into the first empty level with room for them, merging the levels below it in.
+void StreamingPhantomChecker::settle(TableRanges& ranges, std::vector<RangeEntry> entries) {
+    size_t level = 0;
+    for (; level < ranges.levels.size(); ++level) {
+        IntervalIndex<RangeRef>& index = ranges.levels[level];
+        if (index.size() == 0 && entries.size() <= MIN_INDEXED << level) break;
+        entries.insert(entries.end(), index.entries().begin(), index.entries().end());
+        index = IntervalIndex<RangeRef>();
+    }
+    if (level == ranges.levels.size()) ranges.levels.emplace_back();
+
+    IntervalIndex<RangeRef>& index = ranges.levels[level];
+    for (const auto& entry : entries) {
+        if (txns_.count(entry.value.txn)) index.add(entry.lo, entry.hi, entry.value);
+    }
+    index.build();
+
+    const size_t dropped = entries.size() - index.size();
+    ranges.size -= dropped;
+    ranges.dead -= std::min(ranges.dead, dropped);
+    live_ranges_ -= dropped;
+}
+
+void StreamingPhantomChecker::update_peaks() {
+    const size_t bytes = txns_.size() * (sizeof(Txn) + TXN_OVERHEAD)
+                         + live_ranges_ * (sizeof(IntervalIndex<RangeRef>::Entry) + sizeof(uint32_t))
+                         + live_writes_ * sizeof(Write) + live_held_ * sizeof(PhantomEdge);
+    peak_transactions_ = std::max(peak_transactions_, txns_.size());
+    peak_ranges_ = std::max(peak_ranges_, live_ranges_);
+    peak_bytes_ = std::max(peak_bytes_, bytes);
+}
+
+void StreamingPhantomChecker::add(const TraceRecord& record) {
+    switch (record.type) {
+    case BEGIN: {
+        // A transaction still running under the id can no longer write: it only stays around as a reader, and
+        // stops holding the watermark.
+        const auto previous = txns_.find(txn_key(instances_.current(record.transactionId)));
+        if (previous != txns_.end() && previous->second.commit == NOT_COMMITTED) {
+            Txn& abandoned = previous->second;
+            active_.erase({abandoned.begin, previous->first});
+            abandoned.abandoned = true;
+            // Nothing can take its ranges away any more.
+            for (const auto& edge : abandoned.held) {
+                report(edge);
+            }
+            live_writes_ -= abandoned.writes.size();
+            live_held_ -= abandoned.held.size();
+            std::vector<Write>().swap(abandoned.writes);
+            std::vector<PhantomEdge>().swap(abandoned.held);
+        }
+        const TxnInstance txn = instances_.begin(record.transactionId);
+        txns_[txn_key(txn)] = Txn{txn, record.seq, NOT_COMMITTED, false, {}, {}, {}, {}};
+        active_.emplace(record.seq, txn_key(txn));
+        evict();
+        break;
+    }
+    case COMMIT:
+        commit(lookup(record.transactionId), record.seq);
+        evict();
+        break;
+    case ABORT: {
+        Txn& txn = lookup(record.transactionId);
+        discarded_ += txn.writes.size();
+        ranges_ -= txn.range_tables.size();
+        drop(txn_key(txn.id));
+        evict();
+        break;
+    }
+    case SAVEPOINT:
+    case RELEASE:
+    case ROLLBACK_TO: {
+        Txn& txn = lookup(record.transactionId);
+        const size_t keep = txn.savepoints.apply(record, txn.writes.size());
+        discarded_ += txn.writes.size() - keep;
+        live_writes_ -= txn.writes.size() - keep;
+        txn.writes.resize(keep);
+        break;
+    }
+    case RANGE: {
+        Txn& txn = lookup(record.transactionId);
+        txn.range_tables.push_back(record.table);
+        ++ranges_;
+        add_range(record.table, record.objectId, record.upperBound,
+                  {txn_key(txn.id), record.seq, record.statementId});
+        break;
+    }
+    case WRITE:
+        lookup(record.transactionId)
+            .writes.push_back({record.table, record.objectId, record.seq, record.flags, record.statementId});
+        ++live_writes_;
+        break;
+    default:
+        break;
+    }
+    update_peaks();
+}
+
+void StreamingPhantomChecker::finish() {
+    std::vector<std::pair<uint64_t, uint64_t>> running;
+    for (const auto& [key, txn] : txns_) {
+        if (txn.commit == NOT_COMMITTED && !txn.held.empty()) running.emplace_back(txn.begin, key);
+    }
+    std::sort(running.begin(), running.end());
+    for (const auto& entry : running) {
+        Txn& txn = txns_[entry.second];
+        for (const auto& edge : txn.held) {
+            report(edge);
+        }
+        live_held_ -= txn.held.size();
+        txn.held.clear();
+    }
+}
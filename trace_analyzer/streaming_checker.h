@@ -0,0 +1,134 @@
+#ifndef STREAMING_CHECKER_H
+#define STREAMING_CHECKER_H
+
+#include "interval_index.h"
+#include "phantom_checker.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mvtracer.h>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Phantom detection in one pass over a trace of any length, finding the same edges as PhantomChecker with memory
+// bounded by how many transactions overlap rather than by the length of the history.
+//
+// A write can only be a phantom for a range read by a transaction that overlaps the writer. So every write is
+// checked when its transaction commits, against the ranges of the transactions still running and of those that
+// committed after the writer began. The ranges of a committed transaction are needed only while a transaction
+// that began before it committed is still running. The low watermark is the begin of the oldest running
+// transaction. A committed transaction whose commit falls below it can take part in no further edge, so it is
+// evicted along with its ranges. A transaction whose BEGIN is not in the trace counts as begun at its start, and
+// holds the watermark until it finishes. One that never finishes, because its id began another transaction, only
+// stays on as a reader of its ranges, as PhantomChecker keeps the ranges of transactions still running.
+//
+// Records must be fed in `seq` order. An edge whose reader is still running is held back until the reader
+// commits, since an ABORT would take its ranges away, so edges come out in the order their readers commit.
+class StreamingPhantomChecker {
+public:
+    using EdgeCallback = std::function<void(const PhantomEdge&)>;
+
+    explicit StreamingPhantomChecker(EdgeCallback on_edge) : on_edge_(std::move(on_edge)) {}
+
+    void add(const TraceRecord& record);
+
+    // Reports the edges held back for readers still running at the end of the trace; call after the last add().
+    void finish();
+
+    size_t ranges() const { return ranges_; }
+    // Committed writes.
+    size_t writes() const { return writes_; }
+    // Writes discarded by ABORT or ROLLBACK_TO.
+    size_t discarded() const { return discarded_; }
+    size_t edges() const { return edges_; }
+    // Transactions still running, committed ones not evicted yet.
+    size_t running() const { return active_.size(); }
+    size_t retained() const { return committed_.size(); }
+
+    // High-water marks of what was kept at once, and of the approximate bytes it took.
+    size_t peak_transactions() const { return peak_transactions_; }
+    size_t peak_ranges() const { return peak_ranges_; }
+    size_t peak_bytes() const { return peak_bytes_; }
+
+private:
+    struct RangeRef {
+        uint64_t txn;
+        uint64_t seq;
+        uint16_t stmt;
+    };
+
+    using RangeEntry = IntervalIndex<RangeRef>::Entry;
+
+    // Ranges read from one table, in indexes that are merged like the digits of a binary counter: level i holds
+    // up to MIN_INDEXED << i ranges or is empty, so adding a range costs O(log n) amortized and a stab visits
+    // O(log n) indexes. The newest ranges are scanned linearly until there are MIN_INDEXED of them. Merges
+    // leave out the ranges of evicted and aborted transactions.
+    struct TableRanges {
+        std::vector<IntervalIndex<RangeRef>> levels;
+        std::vector<RangeEntry> recent;
+        size_t size = 0;
+        // Ranges of evicted or aborted transactions still held.
+        size_t dead = 0;
+    };
+
+    struct Write {
+        uint32_t table;
+        int64_t row;
+        uint64_t seq;
+        // TRACE_FLAG_* bits of the record.
+        uint8_t flags;
+        uint16_t stmt;
+    };
+
+    struct Txn {
+        TxnInstance id;
+        uint64_t begin;
+        uint64_t commit;
+        // Its id began another transaction while it was running: it only remains a reader.
+        bool abandoned;
+        // Table of each range read, to account for them when the transaction goes.
+        std::vector<uint32_t> range_tables;
+        // Writes since BEGIN; checked and dropped at COMMIT.
+        std::vector<Write> writes;
+        Savepoints savepoints;
+        // Edges to writers that committed while this transaction was running, until it commits.
+        std::vector<PhantomEdge> held;
+    };
+
+    Txn& lookup(int32_t txn_id);
+    void report(const PhantomEdge& edge);
+    void commit(Txn& txn, uint64_t seq);
+    void drop(uint64_t key);
+    void evict();
+    void add_range(uint32_t table, int64_t lo, int64_t hi, const RangeRef& ref);
+    void settle(TableRanges& ranges, std::vector<RangeEntry> entries);
+    void update_peaks();
+
+    EdgeCallback on_edge_;
+    TxnInstances instances_;
+    // Running and retained transactions, keyed by txn_key().
+    std::unordered_map<uint64_t, Txn> txns_;
+    // Running transactions by (begin, key): the first one sets the low watermark.
+    std::set<std::pair<uint64_t, uint64_t>> active_;
+    // Retained transactions by (commit, key), oldest commit first.
+    std::deque<std::pair<uint64_t, uint64_t>> committed_;
+    std::unordered_map<uint32_t, TableRanges> tables_;
+
+    size_t ranges_ = 0;
+    size_t writes_ = 0;
+    size_t discarded_ = 0;
+    size_t edges_ = 0;
+    // What is kept right now, for the peaks.
+    size_t live_ranges_ = 0;
+    size_t live_writes_ = 0;
+    size_t live_held_ = 0;
+    size_t peak_transactions_ = 0;
+    size_t peak_ranges_ = 0;
+    size_t peak_bytes_ = 0;
+};
+
+#endif // STREAMING_CHECKER_H
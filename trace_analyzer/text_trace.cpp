@@ -0,0 +1,302 @@
+#include "text_trace.h"
+#include "trace_file.h"
+
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_TRACE_X86 1
+#endif
+
+namespace {
+constexpr std::string_view OP_MARKER = "$$Op: ";
+constexpr size_t BLOCK_SIZE = 64;
+// More tabs than any record has fields; the rest can only be inside a payload.
+constexpr size_t MAX_FIELDS = 16;
+
+// Bit i of the result is set if p[i] is '$' or a tab.
+uint64_t classify_scalar(const char* p) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        mask |= static_cast<uint64_t>(p[i] == '$' || p[i] == '\t') << i;
+    }
+    return mask;
+}
+
+#ifdef TEXT_TRACE_X86
+uint64_t classify_sse2(const char* p) {
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i tab = _mm_set1_epi8('\t');
+    uint64_t mask = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(bytes, dollar), _mm_cmpeq_epi8(bytes, tab));
+        mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(hits))) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) uint64_t classify_avx2(const char* p) {
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    const __m256i lo_hits = _mm256_or_si256(_mm256_cmpeq_epi8(lo, dollar), _mm256_cmpeq_epi8(lo, tab));
+    const __m256i hi_hits = _mm256_or_si256(_mm256_cmpeq_epi8(hi, dollar), _mm256_cmpeq_epi8(hi, tab));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(lo_hits))
+           | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(hi_hits))) << 32;
+}
+#endif
+
+// Walks the '$' and tab characters of [begin, limit) in order, classifying 64 bytes at a time.
+class Structurals {
+public:
+    Structurals(const char* begin, const char* limit, uint64_t (*classify)(const char*))
+        : classify_(classify), base_(begin), next_(begin), limit_(limit) {}
+
+    // The next '$' or tab, `limit` if there is none.
+    const char* next() {
+        while (!bits_) {
+            if (next_ >= limit_) return limit_;
+            load();
+        }
+        const char* p = base_ + __builtin_ctzll(bits_);
+        bits_ &= bits_ - 1;
+        return p;
+    }
+
+    // Drops everything before `p`.
+    void skip_to(const char* p) {
+        if (p >= next_) {
+            next_ = p;
+            bits_ = 0;
+        } else if (p > base_) {
+            bits_ &= ~0ull << (p - base_);
+        }
+    }
+
+private:
+    void load() {
+        base_ = next_;
+        if (limit_ - base_ >= static_cast<ptrdiff_t>(BLOCK_SIZE)) {
+            bits_ = classify_(base_);
+        } else {
+            // The tail of the text, padded with bytes that are not structural.
+            char block[BLOCK_SIZE] = {};
+            std::memcpy(block, base_, limit_ - base_);
+            bits_ = classify_(block);
+        }
+        next_ = base_ + BLOCK_SIZE;
+    }
+
+    uint64_t (*classify_)(const char*);
+    const char* base_;
+    const char* next_;
+    const char* limit_;
+    uint64_t bits_ = 0;
+};
+
+uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t mix64(uint64_t a, uint64_t b) {
+    const __uint128_t r = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+template <typename T> T parse_number(std::string_view text, int base = 10) {
+    T value{};
+    std::from_chars(text.data(), text.data() + text.size(), value, base);
+    return value;
+}
+
+int64_t parse_bound(std::string_view text, int64_t unbounded) {
+    return text == "-inf" || text == "+inf" ? unbounded : parse_number<int64_t>(text);
+}
+
+bool parse_op(std::string_view name, uint8_t& type) {
+    static const std::array<std::string_view, OP_TYPE_COUNT> names = [] {
+        std::array<std::string_view, OP_TYPE_COUNT> names;
+        for (uint8_t op = 0; op < OP_TYPE_COUNT; ++op) names[op] = op_type_name(op);
+        return names;
+    }();
+    for (uint8_t op = 0; op < OP_TYPE_COUNT; ++op) {
+        if (name.size() == names[op].size() && name[0] == names[op][0] && name == names[op]) {
+            type = op;
+            return true;
+        }
+    }
+    return false;
+}
+
+void parse_field(std::string_view key, std::string_view value, TraceRecord& record) {
+    switch (key.empty() ? 0 : key[0]) {
+        case 'T':
+            if (key == "Tx") record.transactionId = parse_number<int32_t>(value);
+            else if (key == "Table") record.table = parse_number<uint32_t>(value);
+            break;
+        case 'S':
+            if (key == "Stmt") record.statementId = parse_number<uint16_t>(value);
+            break;
+        case 'O':
+            if (key == "Obj") record.objectId = parse_number<int64_t>(value);
+            break;
+        case 'L':
+            if (key == "Level") record.objectId = parse_number<int64_t>(value);
+            else if (key == "Lo") record.objectId = parse_bound(value, TRACE_KEY_MIN);
+            break;
+        case 'H':
+            if (key == "Hi") record.upperBound = parse_bound(value, TRACE_KEY_MAX);
+            break;
+        case 'K':
+            if (key == "Key") {
+                record.objectId = static_cast<int64_t>(parse_number<uint64_t>(value, 16));
+                record.flags |= TRACE_FLAG_INDEX;
+            } else if (key == "Kind") {
+                if (value == "delete" || value == "index-delete") record.flags |= TRACE_FLAG_DELETE;
+                if (value == "index-insert" || value == "index-delete") record.flags |= TRACE_FLAG_INDEX;
+            }
+            break;
+        case 'D':
+            if (key == "Dir" && value == "desc") record.flags |= TRACE_FLAG_BACKWARD;
+            break;
+        case 'C':
+            if (key == "Cols" && value.substr(0, 2) == "0x") {
+                record.columns = parse_number<uint64_t>(value.substr(2), 16);
+            }
+            break;
+        case 'r':
+        case 'w':
+            if (key == "rHash" || key == "wHash") record.valueHash = parse_number<uint64_t>(value, 16);
+            break;
+        default:
+            // Other fields (savepoint names) have no place in a TraceRecord.
+            break;
+    }
+}
+
+// Fills `record` from the text between `$$Op: ` and `$$`, whose first `count` tabs are at `tabs`.
+bool parse_record(const char* body, const char* end, const char* const* tabs, size_t count, TraceRecord& record) {
+    const char* op_end = count ? tabs[0] : end;
+    if (op_end == body || !parse_op(std::string_view(body, op_end - body), record.type)) return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        const char* p = tabs[i] + 1;
+        const char* field_end = i + 1 < count ? tabs[i + 1] : end;
+        while (p < field_end && *p == ' ') ++p;
+        const char* colon = static_cast<const char*>(std::memchr(p, ':', field_end - p));
+        if (!colon || field_end - colon < 2) continue;
+        const std::string_view key(p, colon - p);
+        const char* value = colon + 2;
+
+        // A payload is the rest of the record, tabs included, and ends at its first NUL like its `%s` printing.
+        if (key == "wVal") {
+            const void* nul = std::memchr(value, '\0', end - value);
+            record.valueHash = trace_hash64(value, (nul ? static_cast<const char*>(nul) : end) - value);
+            break;
+        }
+
+        const char* value_end = field_end;
+        while (value_end > value && value_end[-1] == ' ') --value_end;
+        parse_field(key, std::string_view(value, value_end - value), record);
+    }
+    return true;
+}
+} // namespace
+
+TextScan best_text_scan() {
+#ifdef TEXT_TRACE_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? TextScan::Avx2 : TextScan::Sse2;
+#else
+    return TextScan::Scalar;
+#endif
+}
+
+const char* text_scan_name(TextScan scan) {
+    switch (scan) {
+        case TextScan::Avx2:
+            return "avx2";
+        case TextScan::Sse2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+uint64_t trace_hash64(const void* data, size_t len) {
+    constexpr uint64_t k0 = 0xa0761d6478bd642full;
+    constexpr uint64_t k1 = 0xe7037ed1a0b428dbull;
+    constexpr uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+
+    const auto* p = static_cast<const unsigned char*>(data);
+    uint64_t h = k0 ^ mix64(len, k1);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        h = mix64(read64(p + i) ^ k1, read64(p + i + 8) ^ h);
+    }
+    if (i + 8 <= len) {
+        h = mix64(read64(p + i) ^ k1, h ^ k2);
+        i += 8;
+    }
+    if (i < len) {
+        uint64_t tail = 0;
+        std::memcpy(&tail, p + i, len - i);
+        h = mix64(tail ^ k2, h ^ k1);
+    }
+    return mix64(h ^ k0, len ^ k2);
+}
+
+TextTraceParser::TextTraceParser(TextScan scan) : classify_(classify_scalar) {
+#ifdef TEXT_TRACE_X86
+    if (scan == TextScan::Avx2) classify_ = classify_avx2;
+    else if (scan == TextScan::Sse2) classify_ = classify_sse2;
+#else
+    (void)scan;
+#endif
+}
+
+const char* TextTraceParser::parse(const char* begin, const char* end, const char* limit,
+                                   std::vector<TraceRecord>& out) {
+    Structurals structurals(begin, limit, classify_);
+    const char* parsed = begin;
+    for (const char* p = structurals.next(); p < end; p = structurals.next()) {
+        if (*p != '$' || static_cast<size_t>(limit - p) < OP_MARKER.size()
+            || std::memcmp(p, OP_MARKER.data(), OP_MARKER.size()) != 0) {
+            continue;
+        }
+        const char* body = p + OP_MARKER.size();
+        structurals.skip_to(body);
+
+        // The record ends at the first "$$\n" (or "$$" at the end of the text).
+        const char* tabs[MAX_FIELDS];
+        size_t count = 0;
+        const char* stop = limit;
+        for (const char* q = structurals.next(); q < limit; q = structurals.next()) {
+            if (*q == '\t') {
+                if (count < MAX_FIELDS) tabs[count++] = q;
+            } else if (limit - q >= 2 && q[1] == '$' && (limit - q == 2 || q[2] == '\n')) {
+                stop = q;
+                break;
+            }
+        }
+        if (stop == limit) {
+            // Cut short, e.g. by a crash: nothing after it can be a record either.
+            ++malformed_;
+            return parsed;
+        }
+
+        TraceRecord record{};
+        if (parse_record(body, stop, tabs, count, record)) out.push_back(record);
+        else ++malformed_;
+        parsed = stop + 2;
+        structurals.skip_to(parsed);
+    }
+    return parsed;
+}
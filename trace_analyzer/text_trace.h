@@ -0,0 +1,48 @@
+#ifndef TEXT_TRACE_H
+#define TEXT_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mvtracer.h>
+#include <vector>
+
+// Parser for the text format of printTransactionOp:
+//
+//   \n$$Op: WRITE\t Tx: 3\t Stmt: 1\t Obj: 42 \t wVal: payload$$\n
+//
+// Records may be mixed with any other output (the shell's, typically); everything outside of a `$$Op: ` ...
+// `$$\n` pair is skipped. A record's fields follow its op and transaction as tab-separated `Key: value` pairs,
+// and `wVal` runs to the end of the record, so payloads may hold tabs. A payload holding `$$\n` or `$$Op: `
+// cannot be told apart from the end of its record or the start of another one.
+//
+// The text is scanned 64 bytes at a time for `$` and tabs, 16 (SSE2) or 32 (AVX2) bytes per comparison where the
+// CPU has them; records and fields are then cut at the positions found, without looking at the bytes again.
+
+enum class TextScan { Scalar, Sse2, Avx2 };
+
+// The widest scan the CPU supports.
+TextScan best_text_scan();
+const char* text_scan_name(TextScan scan);
+
+// traceHash64, which the analyzers do not link; a wVal payload is hashed with it into valueHash.
+uint64_t trace_hash64(const void* data, size_t len);
+
+class TextTraceParser {
+public:
+    explicit TextTraceParser(TextScan scan = best_text_scan());
+
+    // Appends the records whose `$$Op: ` marker starts in [begin, end) to `out`. A record that starts before
+    // `end` may run on up to `limit`. Records get no seq, timestamp or thread; every other field the text
+    // holds is filled in as writeTransactionOp would have. Returns the end of the last record parsed, or
+    // `begin` if there was none. Not thread-safe; use one parser per thread.
+    const char* parse(const char* begin, const char* end, const char* limit, std::vector<TraceRecord>& out);
+
+    // Records whose op was not recognized and which were dropped, over every parse() so far.
+    size_t malformed() const { return malformed_; }
+
+private:
+    uint64_t (*classify_)(const char* block);
+    size_t malformed_ = 0;
+};
+
+#endif // TEXT_TRACE_H
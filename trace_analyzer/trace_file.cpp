@@ -0,0 +1,79 @@
+#include "trace_file.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TraceFile::TraceFile(const std::string& path) : path_(path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("can't open trace " + path);
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("can't stat trace " + path);
+    }
+    map_size_ = static_cast<size_t>(st.st_size);
+    if (map_size_ < sizeof(TraceFileHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a trace");
+    }
+
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        throw std::runtime_error("can't map trace " + path);
+    }
+    madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+    const auto* header = static_cast<const TraceFileHeader*>(map_);
+    if (std::memcmp(header->magic, TRACE_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != TRACE_FORMAT_VERSION || header->recordSize != sizeof(TraceRecord)) {
+        munmap(map_, map_size_);
+        map_ = nullptr;
+        throw std::runtime_error(path + " is not a version " + std::to_string(TRACE_FORMAT_VERSION) + " trace");
+    }
+
+    records_ = reinterpret_cast<const TraceRecord*>(static_cast<const char*>(map_) + sizeof(TraceFileHeader));
+    // A partially written trailing record (e.g. a crashed writer) is ignored.
+    count_ = (map_size_ - sizeof(TraceFileHeader)) / sizeof(TraceRecord);
+}
+
+TraceFile::TraceFile(TraceFile&& other) noexcept
+    : path_(std::move(other.path_)), map_(other.map_), map_size_(other.map_size_), records_(other.records_),
+      count_(other.count_) {
+    other.map_ = nullptr;
+    other.map_size_ = 0;
+    other.records_ = nullptr;
+    other.count_ = 0;
+}
+
+TraceFile::~TraceFile() {
+    if (map_) munmap(map_, map_size_);
+}
+
+std::unordered_map<uint16_t, std::string> load_statements(const std::string& trace_path) {
+    std::unordered_map<uint16_t, std::string> statements;
+    std::ifstream in(trace_path + ".sql");
+    std::string line;
+    while (std::getline(in, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        const long id = std::strtol(line.c_str(), nullptr, 10);
+        if (id <= 0 || id > TRACE_MAX_STATEMENTS) continue;
+        statements[static_cast<uint16_t>(id)] = line.substr(tab + 1);
+    }
+    return statements;
+}
+
+const char* op_type_name(uint8_t type) {
+    static const char* const names[OP_TYPE_COUNT] = {"BEGIN", "COMMIT",    "WRITE",   "READ",       "RANGE",
+                                                     "ABORT", "SAVEPOINT", "RELEASE", "ROLLBACK_TO"};
+    return type < OP_TYPE_COUNT ? names[type] : "UNKNOWN";
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+#include <cstddef>
+#include <mvtracer.h>
+#include <string>
+#include <unordered_map>
+
+// Read-only, memory-mapped view of a binary trace written by the BINARY sink.
+// Records are used in place; nothing is copied.
+class TraceFile {
+public:
+    // Throws std::runtime_error if the file cannot be mapped or is not a trace of the current format version.
+    explicit TraceFile(const std::string& path);
+    ~TraceFile();
+
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+    TraceFile(TraceFile&& other) noexcept;
+    TraceFile& operator=(TraceFile&& other) = delete;
+
+    const TraceRecord* begin() const { return records_; }
+    const TraceRecord* end() const { return records_ + count_; }
+    size_t size() const { return count_; }
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    const TraceRecord* records_ = nullptr;
+    size_t count_ = 0;
+};
+
+// Name of an OpType as opTypeName prints it; the analyzers do not link the tracer.
+const char* op_type_name(uint8_t type);
+
+// Statement table written next to a trace (`<trace>.sql`, see writeStatementTable): normalized SQL by statement
+// id. Empty if the file does not exist.
+std::unordered_map<uint16_t, std::string> load_statements(const std::string& trace_path);
+
+#endif // TRACE_FILE_H
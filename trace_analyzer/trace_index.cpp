@@ -0,0 +1,102 @@
+#include "trace_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TraceIndex::TraceIndex(const TraceFile& trace) : count_(trace.size()) {
+    const std::string path = trace.path() + ".idx";
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TraceIndexHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a trace index");
+    }
+    map_size_ = static_cast<size_t>(st.st_size);
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        throw std::runtime_error("can't map index " + path);
+    }
+
+    const auto* header = static_cast<const TraceIndexHeader*>(map_);
+    if (std::memcmp(header->magic, TRACE_INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != TRACE_FORMAT_VERSION || header->entrySize != sizeof(TraceIndexEntry)) {
+        munmap(map_, map_size_);
+        map_ = nullptr;
+        throw std::runtime_error(path + " is not a version " + std::to_string(TRACE_FORMAT_VERSION) + " index");
+    }
+
+    const char* base = static_cast<const char*>(map_);
+    entries_ = reinterpret_cast<const TraceIndexEntry*>(base + sizeof(TraceIndexHeader));
+    entry_count_ = (map_size_ - sizeof(TraceIndexHeader)) / sizeof(TraceIndexEntry);
+
+    if (map_size_ >= sizeof(TraceIndexHeader) + sizeof(TraceIndexTrailer)) {
+        const auto* trailer = reinterpret_cast<const TraceIndexTrailer*>(base + map_size_) - 1;
+        if (std::memcmp(trailer->magic, TRACE_INDEX_TRAILER_MAGIC, sizeof(trailer->magic)) == 0
+            && sizeof(TraceIndexHeader) + trailer->entries * sizeof(TraceIndexEntry) + sizeof(TraceIndexTrailer)
+                   == map_size_) {
+            entry_count_ = trailer->entries;
+            finished_ = true;
+        }
+    }
+}
+
+TraceIndex::~TraceIndex() {
+    if (map_) munmap(map_, map_size_);
+}
+
+std::vector<RecordSpan> TraceIndex::whole() const {
+    if (count_ == 0) return {};
+    return {{0, count_ - 1}};
+}
+
+namespace {
+// Appends [first, last], clipped to the trace, merging it into the previous span when they touch.
+void add_span(std::vector<RecordSpan>& spans, uint64_t first, uint64_t last, size_t count) {
+    if (first >= count) return;
+    if (last >= count) last = count - 1;
+    if (!spans.empty() && first >= spans.back().first && first <= spans.back().last + 1) {
+        if (last > spans.back().last) spans.back().last = last;
+        return;
+    }
+    spans.push_back({first, last});
+}
+} // namespace
+
+std::vector<RecordSpan> TraceIndex::seq_range(uint64_t lo, uint64_t hi) const {
+    if (!map_) return whole();
+
+    std::vector<RecordSpan> spans;
+    uint64_t covered = 0;
+    for (size_t i = 0; i < entry_count_; ++i) {
+        const TraceIndexEntry& entry = entries_[i];
+        if (entry.kind != TRACE_INDEX_BLOCK) continue;
+        covered = std::max<uint64_t>(covered, entry.lastRecord + 1);
+        if (entry.maxSeq < lo || entry.minSeq > hi) continue;
+        add_span(spans, entry.firstRecord, entry.lastRecord, count_);
+    }
+    // Records written after the last complete block of an unfinished index.
+    if (!finished_ && covered < count_) add_span(spans, covered, count_ - 1, count_);
+    return spans;
+}
+
+std::vector<RecordSpan> TraceIndex::transaction(int32_t id) const {
+    if (!map_ || !finished_) return whole();
+
+    std::vector<RecordSpan> spans;
+    for (size_t i = 0; i < entry_count_; ++i) {
+        const TraceIndexEntry& entry = entries_[i];
+        if (entry.kind == TRACE_INDEX_TRANSACTION && entry.transactionId == id) {
+            add_span(spans, entry.firstRecord, entry.lastRecord, count_);
+        }
+    }
+    return spans;
+}
@@ -0,0 +1,52 @@
+#ifndef TRACE_INDEX_H
+#define TRACE_INDEX_H
+
+#include "trace_file.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Records [first, last] of a trace.
+struct RecordSpan {
+    uint64_t first;
+    uint64_t last;
+};
+
+// Read-only, memory-mapped view of the index written next to a binary trace (`<trace>.idx`, see
+// traceIndexCreate). Lookups return the spans of records that can hold what was asked for; callers still
+// check the records themselves, since blocks and transactions interleave with other records.
+class TraceIndex {
+public:
+    // Maps the index of `trace`. Without an index file, every lookup returns the whole trace. Throws
+    // std::runtime_error if the index exists but is not one of the current format version.
+    explicit TraceIndex(const TraceFile& trace);
+    ~TraceIndex();
+
+    TraceIndex(const TraceIndex&) = delete;
+    TraceIndex& operator=(const TraceIndex&) = delete;
+
+    bool exists() const { return map_ != nullptr; }
+    // Finished indexes list every transaction; unfinished ones only complete blocks.
+    bool finished() const { return finished_; }
+
+    // Spans that may hold records with seq in [lo, hi], in file order.
+    std::vector<RecordSpan> seq_range(uint64_t lo, uint64_t hi) const;
+
+    // Spans of the transactions with `id`, one per BEGIN, in file order. Scans the whole trace when the index
+    // is not finished.
+    std::vector<RecordSpan> transaction(int32_t id) const;
+
+private:
+    std::vector<RecordSpan> whole() const;
+
+    size_t count_;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    const TraceIndexEntry* entries_ = nullptr;
+    size_t entry_count_ = 0;
+    bool finished_ = false;
+};
+
+#endif // TRACE_INDEX_H
@@ -0,0 +1,102 @@
+#include "trace_merge.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+bool is_ordered(const TraceFile& file, MergeKey key) {
+    for (const TraceRecord* record = file.begin(); record + 1 < file.end(); ++record) {
+        const bool ordered = key == MergeKey::Seq ? record[0].seq <= record[1].seq : record[0].ts <= record[1].ts;
+        if (!ordered) return false;
+    }
+    return true;
+}
+
+TraceMerger::TraceMerger(const std::vector<TraceFile>& files, MergeKey key, size_t window)
+    : key_(key), window_(window) {
+    for (const auto& file : files) {
+        sources_.push_back({file.begin(), file.end()});
+        if (window_ == 0) continue;
+        Source& source = sources_.back();
+        while (source.pos != source.end && source.ahead.size() <= window_) {
+            source.ahead.push_back(source.pos++);
+        }
+        std::make_heap(source.ahead.begin(), source.ahead.end(), [this](auto a, auto b) { return later(a, b); });
+    }
+
+    // Play the initial tournament bottom-up, keeping the loser of each match.
+    const size_t k = sources_.size();
+    tree_.assign(k > 0 ? k : 1, 0);
+    std::vector<size_t> winners(2 * k);
+    for (size_t i = 0; i < k; ++i) {
+        winners[k + i] = i;
+    }
+    for (size_t node = k; node-- > 1;) {
+        const size_t a = winners[2 * node];
+        const size_t b = winners[2 * node + 1];
+        winners[node] = less(b, a) ? b : a;
+        tree_[node] = less(b, a) ? a : b;
+    }
+    tree_[0] = k > 1 ? winners[1] : 0;
+}
+
+const TraceRecord* TraceMerger::head(size_t i) const {
+    const Source& source = sources_[i];
+    if (window_ > 0) return source.ahead.empty() ? nullptr : source.ahead.front();
+    return source.pos == source.end ? nullptr : source.pos;
+}
+
+void TraceMerger::advance(size_t i) {
+    Source& source = sources_[i];
+    if (window_ == 0) {
+        ++source.pos;
+        return;
+    }
+
+    const auto later = [this](auto a, auto b) { return this->later(a, b); };
+    const uint64_t k = key(*source.ahead.front());
+    if (source.started && k < source.last) {
+        throw std::runtime_error("record " + std::to_string(k) + " is further out of order than the "
+                                 + std::to_string(window_) + " record window");
+    }
+    source.last = k;
+    source.started = true;
+    std::pop_heap(source.ahead.begin(), source.ahead.end(), later);
+    source.ahead.pop_back();
+    if (source.pos != source.end) {
+        source.ahead.push_back(source.pos++);
+        std::push_heap(source.ahead.begin(), source.ahead.end(), later);
+    }
+}
+
+bool TraceMerger::later(const TraceRecord* a, const TraceRecord* b) const {
+    return key(*a) > key(*b) || (key(*a) == key(*b) && a > b);
+}
+
+bool TraceMerger::less(size_t a, size_t b) const {
+    const TraceRecord* x = head(a);
+    const TraceRecord* y = head(b);
+    if (!x) return false;
+    if (!y) return true;
+    const uint64_t kx = key(*x);
+    const uint64_t ky = key(*y);
+    return kx < ky || (kx == ky && a < b);
+}
+
+const TraceRecord* TraceMerger::next() {
+    if (sources_.empty()) return nullptr;
+
+    size_t winner = tree_[0];
+    const TraceRecord* record = head(winner);
+    if (!record) return nullptr;
+    advance(winner);
+
+    // Only the path of the winner's file changes: replay it against the stored losers.
+    const size_t k = sources_.size();
+    for (size_t node = (winner + k) / 2; node >= 1; node /= 2) {
+        if (less(tree_[node], winner)) std::swap(tree_[node], winner);
+    }
+    tree_[0] = winner;
+    return record;
+}
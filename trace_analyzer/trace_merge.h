@@ -0,0 +1,77 @@
+#ifndef TRACE_MERGE_H
+#define TRACE_MERGE_H
+
+#include "trace_file.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class MergeKey { Seq, Timestamp };
+
+// Whether the records of `file` are in ascending `key` order, which merging requires. Files written by one
+// connection or one thread are; a file shared by several threads is only nearly in seq order.
+bool is_ordered(const TraceFile& file, MergeKey key);
+
+// K-way merge of ordered traces by seq or timestamp through a tournament (loser) tree: each record costs
+// log2(k) comparisons against the losers on the path of its file. Records are returned in place from the
+// mapped files, so nothing is copied or buffered; equal keys come out in file order.
+//
+// With a `window`, files only need to be nearly in order, as one shared by several threads is: each file is
+// first put in order through a heap of the next `window` + 1 of its records, so a record may be up to `window`
+// places out of order within its file. Memory stays bounded by the window of each file. next() throws
+// std::runtime_error on a record further out of place than that.
+class TraceMerger {
+public:
+    TraceMerger(const std::vector<TraceFile>& files, MergeKey key = MergeKey::Seq, size_t window = 0);
+
+    // The next record in merged order, nullptr once every file is exhausted.
+    const TraceRecord* next();
+
+private:
+    struct Source {
+        const TraceRecord* pos;
+        const TraceRecord* end;
+        // With a window: the records read ahead of `pos` as a min-heap, and the key of the last one returned.
+        std::vector<const TraceRecord*> ahead;
+        uint64_t last = 0;
+        bool started = false;
+    };
+
+    uint64_t key(const TraceRecord& record) const { return key_ == MergeKey::Seq ? record.seq : record.ts; }
+    // The next record of source `i` in its order, nullptr when exhausted.
+    const TraceRecord* head(size_t i) const;
+    // Moves source `i` past its head.
+    void advance(size_t i);
+    // Order of the `ahead` heaps: whether `a` comes after `b` in its file's order, equal keys in file order.
+    bool later(const TraceRecord* a, const TraceRecord* b) const;
+    // Exhausted sources lose against everything.
+    bool less(size_t a, size_t b) const;
+
+    std::vector<Source> sources_;
+    // tree_[0] is the current winner, tree_[1..k-1] the loser of the match played at each node. Leaf i
+    // hangs below node (i + k) / 2.
+    std::vector<size_t> tree_;
+    MergeKey key_;
+    size_t window_;
+};
+
+// Reorder window the tools use for files not in seq order, in records; see TraceMerger.
+constexpr size_t DEFAULT_REORDER_WINDOW = 1 << 20;
+
+// Calls `f(record)` for every record of `files` in seq order, merged by a TraceMerger. If any file is not in seq
+// order, as one shared by several threads is only nearly, each file is reordered through its own window of
+// `window` records, so memory stays bounded by the window rather than the history. Returns whether every file was
+// in order. Throws std::runtime_error on a record further out of place in its file than the window.
+template <typename F> bool for_each_in_seq_order(const std::vector<TraceFile>& files, size_t window, F f) {
+    const auto ordered = [](const TraceFile& file) { return is_ordered(file, MergeKey::Seq); };
+    const bool in_order = std::all_of(files.begin(), files.end(), ordered);
+    TraceMerger merger(files, MergeKey::Seq, in_order ? 0 : window);
+    for (const TraceRecord* record = merger.next(); record; record = merger.next()) {
+        f(*record);
+    }
+    return in_order;
+}
+
+#endif // TRACE_MERGE_H
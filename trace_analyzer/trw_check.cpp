@@ -0,0 +1,139 @@
+#include "phantom_checker.h"
+#include "streaming_checker.h"
+#include "trace_file.h"
+#include "trace_merge.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <unordered_map>
+#include <vector>
+
+// Checks binary traces for phantoms: writes into key ranges that a concurrent transaction scanned.
+// Usage: trw_check [--stream] [--window N] trace.bin [trace.bin ...]
+// Records of all files are merged by their global sequence number (see TraceMerger). When files are not in seq
+// order, each is put in order through its own window of N records (1M by default) before they are merged,
+// instead of being sorted whole. Exits with 1 when phantoms were found.
+// Statements are named from the statement tables next to the traces (trace.bin.sql), when there are any.
+// --stream checks in one pass with StreamingPhantomChecker, for traces whose history does not fit in memory, and
+// reports the peak memory it took.
+
+std::string format_key(int64_t key) {
+    if (key == TRACE_KEY_MIN) return "-inf";
+    if (key == TRACE_KEY_MAX) return "+inf";
+    return std::to_string(key);
+}
+
+void print_edge(const PhantomEdge& edge, std::set<uint16_t>& named) {
+    char row[32];
+    if (edge.index_key) std::snprintf(row, sizeof(row), "key %016llx", static_cast<unsigned long long>(edge.row));
+    else std::snprintf(row, sizeof(row), "row %lld", static_cast<long long>(edge.row));
+    std::printf("PHANTOM T%d#%u -> T%d#%u\t table %u\t range [%s, %s] @%llu\t %s @%llu\n", edge.reader.id,
+                edge.reader.instance, edge.writer.id, edge.writer.instance, edge.table, format_key(edge.lo).c_str(),
+                format_key(edge.hi).c_str(), static_cast<unsigned long long>(edge.range_seq), row,
+                static_cast<unsigned long long>(edge.write_seq));
+    if (edge.range_stmt != TRACE_STATEMENT_NONE || edge.write_stmt != TRACE_STATEMENT_NONE) {
+        std::printf("\t read by S%u, written by S%u\n", edge.range_stmt, edge.write_stmt);
+        named.insert({edge.range_stmt, edge.write_stmt});
+    }
+}
+
+void print_statements(const std::set<uint16_t>& named, const std::unordered_map<uint16_t, std::string>& statements) {
+    for (const uint16_t id : named) {
+        const auto it = statements.find(id);
+        if (id != TRACE_STATEMENT_NONE && it != statements.end()) std::printf("S%u\t %s\n", id, it->second.c_str());
+    }
+}
+
+int check_streaming(const std::vector<TraceFile>& files, size_t window,
+                    const std::unordered_map<uint16_t, std::string>& statements) {
+    std::set<uint16_t> named;
+    StreamingPhantomChecker checker([&](const PhantomEdge& edge) { print_edge(edge, named); });
+    const auto start = std::chrono::steady_clock::now();
+    size_t count = 0;
+    try {
+        for_each_in_seq_order(files, window, [&](const TraceRecord& record) {
+            checker.add(record);
+            ++count;
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    checker.finish();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    print_statements(named, statements);
+
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    std::printf("%zu records, %zu ranges, %zu writes (%zu rolled back), %zu phantom edges\n", count,
+                checker.ranges(), checker.writes(), checker.discarded(), checker.edges());
+    std::printf("%.3f s (%.2fM records/s); peak %zu transactions, %zu ranges, %zu KB of checker state; max RSS %ld "
+                "KB, mapped trace pages included\n",
+                seconds, seconds > 0 ? count / seconds / 1e6 : 0.0, checker.peak_transactions(),
+                checker.peak_ranges(), checker.peak_bytes() >> 10, usage.ru_maxrss);
+    return checker.edges() == 0 ? 0 : 1;
+}
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--stream] [--window N] trace.bin [trace.bin ...]\n";
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    bool streaming = false;
+    size_t window = DEFAULT_REORDER_WINDOW;
+    int arg = 1;
+    for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        if (std::strcmp(argv[arg], "--stream") == 0) {
+            streaming = true;
+        } else if (std::strcmp(argv[arg], "--window") == 0 && arg + 1 < argc) {
+            window = std::max(1ull, std::strtoull(argv[++arg], nullptr, 10));
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (arg == argc) return usage(argv[0]);
+
+    std::vector<TraceFile> files;
+    // Statement ids are process-wide, so traces of one process share a table.
+    std::unordered_map<uint16_t, std::string> statements;
+    try {
+        for (int i = arg; i < argc; ++i) {
+            files.emplace_back(argv[i]);
+            statements.merge(load_statements(argv[i]));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    if (streaming) return check_streaming(files, window, statements);
+
+    PhantomChecker checker;
+    size_t count = 0;
+    try {
+        for_each_in_seq_order(files, window, [&](const TraceRecord& record) {
+            checker.add(record);
+            ++count;
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    const auto edges = checker.check();
+
+    std::set<uint16_t> named;
+    for (const auto& edge : edges) {
+        print_edge(edge, named);
+    }
+    print_statements(named, statements);
+    std::printf("%zu records, %zu ranges, %zu writes (%zu rolled back), %zu phantom edges\n", count,
+                checker.ranges(), checker.writes(), checker.discarded(), edges.size());
+    return edges.empty() ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+#include "columnar.h"
+#include "trace_file.h"
+#include "trace_merge.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Converts binary traces to the columnar store and summarizes columnar traces.
+// Usage: trw_columnar convert [--window N] out.trwc trace.bin [trace.bin ...]
+//        trw_columnar stats trace.trwc [--table ROOT]
+// convert writes the records of the inputs in seq order, merged as trw_check does: inputs not in seq order are
+// reordered through a window of N records each (1M by default). stats decodes only the columns it needs, and with --table skips the row groups whose table chunk
+// cannot hold ROOT.
+
+constexpr size_t TOP = 10;
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " convert [--window N] out.trwc trace.bin [trace.bin ...]\n"
+              << "       " << argv0 << " stats trace.trwc [--table ROOT]\n";
+    return 2;
+}
+
+int convert(const std::string& out_path, const std::vector<std::string>& in_paths, size_t window) {
+    std::vector<TraceFile> files;
+    uint64_t in_size = 0;
+    for (const auto& path : in_paths) {
+        files.emplace_back(path);
+        in_size += sizeof(TraceFileHeader) + files.back().size() * sizeof(TraceRecord);
+    }
+
+    ColumnarWriter writer(out_path);
+    uint64_t count = 0;
+    const bool ordered = for_each_in_seq_order(files, window, [&](const TraceRecord& record) {
+        writer.add(record);
+        ++count;
+    });
+    writer.finish();
+
+    std::printf("%llu records%s, %llu bytes -> %llu bytes (%.1fx)\n", static_cast<unsigned long long>(count),
+                ordered ? "" : " (unordered, reordered)", static_cast<unsigned long long>(in_size),
+                static_cast<unsigned long long>(writer.size()),
+                writer.size() ? static_cast<double>(in_size) / static_cast<double>(writer.size()) : 0.0);
+    return 0;
+}
+
+struct Stats {
+    uint64_t records = 0;
+    uint64_t ops[OP_TYPE_COUNT + 1] = {};
+    std::unordered_map<uint32_t, uint64_t> table_writes;
+    std::unordered_map<int64_t, uint64_t> txn_reads;
+    // Keyed by (table, row).
+    std::map<std::pair<uint32_t, int64_t>, uint64_t> row_writes;
+
+    void merge(const Stats& other) {
+        records += other.records;
+        for (size_t i = 0; i <= OP_TYPE_COUNT; ++i) ops[i] += other.ops[i];
+        for (const auto& [table, n] : other.table_writes) table_writes[table] += n;
+        for (const auto& [txn, n] : other.txn_reads) txn_reads[txn] += n;
+        for (const auto& [row, n] : other.row_writes) row_writes[row] += n;
+    }
+};
+
+void collect(const ColumnarFile& file, size_t group, bool by_table, uint64_t table, Stats& stats) {
+    std::vector<uint64_t> ops;
+    std::vector<uint64_t> tables;
+    std::vector<uint64_t> txns;
+    std::vector<uint64_t> rows;
+    file.decode(group, Column::Op, ops);
+    file.decode(group, Column::Table, tables);
+    file.decode(group, Column::Txn, txns);
+    file.decode(group, Column::Row, rows);
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (by_table && tables[i] != table) continue;
+        ++stats.records;
+        ++stats.ops[std::min<uint64_t>(ops[i], OP_TYPE_COUNT)];
+        if (ops[i] == WRITE) {
+            ++stats.table_writes[static_cast<uint32_t>(tables[i])];
+            ++stats.row_writes[{static_cast<uint32_t>(tables[i]), column_value(Column::Row, rows[i])}];
+        } else if (ops[i] == READ) {
+            ++stats.txn_reads[column_value(Column::Txn, txns[i])];
+        }
+    }
+}
+
+// The `n` entries of `counts` with the highest counts, highest first.
+template <typename Map> std::vector<std::pair<typename Map::key_type, uint64_t>> top(const Map& counts, size_t n) {
+    std::vector<std::pair<typename Map::key_type, uint64_t>> entries(counts.begin(), counts.end());
+    const auto by_count = [](const auto& a, const auto& b) { return a.second > b.second; };
+    n = std::min(n, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), by_count);
+    entries.resize(n);
+    return entries;
+}
+
+int stats(const std::string& path, bool by_table, uint64_t table) {
+    const ColumnarFile file(path);
+
+    std::vector<size_t> groups;
+    for (size_t group = 0; group < file.groups(); ++group) {
+        const ChunkHeader& chunk = file.chunk(group, Column::Table);
+        if (!by_table || (chunk.min <= table && table <= chunk.max)) groups.push_back(group);
+    }
+
+    const size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), groups.size()));
+    std::vector<Stats> partial(workers);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w] {
+            for (size_t i = next++; i < groups.size(); i = next++) {
+                collect(file, groups[i], by_table, table, partial[w]);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    Stats total;
+    for (const auto& stats : partial) total.merge(stats);
+
+    std::printf("%llu records in %zu of %zu row groups\n", static_cast<unsigned long long>(total.records),
+                groups.size(), file.groups());
+    std::printf("\nevents by op:\n");
+    for (uint8_t op = 0; op <= OP_TYPE_COUNT; ++op) {
+        if (total.ops[op]) std::printf("  %-12s %llu\n", op_type_name(op), static_cast<unsigned long long>(total.ops[op]));
+    }
+    std::printf("\nwrites by table:\n");
+    for (const auto& [root, n] : top(total.table_writes, total.table_writes.size())) {
+        std::printf("  table %-6u %llu\n", root, static_cast<unsigned long long>(n));
+    }
+    std::printf("\ntransactions with the most reads:\n");
+    for (const auto& [txn, n] : top(total.txn_reads, TOP)) {
+        std::printf("  T%-10lld %llu\n", static_cast<long long>(txn), static_cast<unsigned long long>(n));
+    }
+    std::printf("\nmost written rows:\n");
+    for (const auto& [row, n] : top(total.row_writes, TOP)) {
+        std::printf("  table %u row %lld: %llu\n", row.first, static_cast<long long>(row.second),
+                    static_cast<unsigned long long>(n));
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) return usage(argv[0]);
+    try {
+        if (std::strcmp(argv[1], "convert") == 0) {
+            const bool windowed = argc >= 4 && std::strcmp(argv[2], "--window") == 0;
+            const int out = windowed ? 4 : 2;
+            if (argc >= out + 2) {
+                const size_t window =
+                    windowed ? std::max(1ull, std::strtoull(argv[3], nullptr, 10)) : DEFAULT_REORDER_WINDOW;
+                return convert(argv[out], std::vector<std::string>(argv + out + 1, argv + argc), window);
+            }
+        }
+        if (std::strcmp(argv[1], "stats") == 0 && (argc == 3 || (argc == 5 && std::strcmp(argv[3], "--table") == 0))) {
+            return stats(argv[2], argc == 5, argc == 5 ? std::strtoull(argv[4], nullptr, 10) : 0);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    return usage(argv[0]);
+}
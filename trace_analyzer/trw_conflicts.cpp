@@ -0,0 +1,158 @@
+#include "conflict_graph.h"
+#include "object_set.h"
+#include "trace_file.h"
+#include "trace_merge.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Builds the conflict graph of the committed transactions of binary traces: WW and RW edges between
+// transactions that overlap in time, found by intersecting their read and write sets (see build_conflicts).
+// Usage: trw_conflicts [--scalar] [--graph [--threads N]] [--edges] [--window N] trace.bin [trace.bin ...]
+// Records of all files are merged by seq as trw_check does, reordering files not in seq order through a window of
+// N records each (1M by default). --edges prints every edge, --scalar intersects
+// without AVX2. --graph instead builds the dependency graph of all transactions from the version chain of
+// each object (see build_conflict_graph) on N threads, all cores by default, and finds its cycles; --edges
+// then also prints the transactions of each cycle.
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0
+              << " [--scalar] [--graph [--threads N]] [--edges] [--window N] trace.bin [trace.bin ...]\n";
+    return 2;
+}
+
+const char* conflict_type_name(ConflictType type) {
+    switch (type) {
+    case ConflictType::WW:
+        return "WW";
+    case ConflictType::RW:
+        return "RW";
+    case ConflictType::WR:
+        return "WR";
+    }
+    return "?";
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void graph(const std::vector<TxnSets>& txns, size_t threads, bool print_edges) {
+    auto start = std::chrono::steady_clock::now();
+    ConflictGraphStats stats;
+    const ConflictGraph graph = build_conflict_graph(txns, threads, stats);
+    const double build_seconds = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    const std::vector<uint32_t> component = strongly_connected_components(graph, threads);
+    const double scc_seconds = seconds_since(start);
+
+    std::vector<std::vector<uint32_t>> members(txns.size());
+    for (uint32_t t = 0; t < component.size(); ++t) members[component[t]].push_back(t);
+    size_t cycles = 0, cyclic = 0, largest = 0;
+    for (const auto& txns_of : members) {
+        if (txns_of.size() < 2) continue;
+        ++cycles;
+        cyclic += txns_of.size();
+        largest = std::max(largest, txns_of.size());
+    }
+
+    if (print_edges) {
+        for (uint32_t from = 0; from < graph.vertices(); ++from) {
+            for (uint32_t i = graph.offsets[from]; i < graph.offsets[from + 1]; ++i) {
+                const TxnInstance& a = txns[from].id;
+                const TxnInstance& b = txns[graph.targets[i]].id;
+                std::printf("%s T%d#%u -> T%d#%u\n", conflict_type_name(graph.types[i]), a.id, a.instance, b.id,
+                            b.instance);
+            }
+        }
+        for (const auto& txns_of : members) {
+            if (txns_of.size() < 2) continue;
+            std::printf("cycle:");
+            for (const uint32_t t : txns_of) std::printf(" T%d#%u", txns[t].id.id, txns[t].id.instance);
+            std::printf("\n");
+        }
+    }
+    std::printf("%zu committed transactions, %zu accesses to %zu objects\n", txns.size(), stats.accesses,
+                stats.objects);
+    std::printf("%zu WW, %zu WR and %zu RW edges in %.3f s on %zu threads\n",
+                stats.edges[static_cast<size_t>(ConflictType::WW)], stats.edges[static_cast<size_t>(ConflictType::WR)],
+                stats.edges[static_cast<size_t>(ConflictType::RW)], build_seconds, threads);
+    std::printf("%zu cycles over %zu transactions, the largest of %zu, in %.3f s\n", cycles, cyclic, largest,
+                scc_seconds);
+}
+
+int main(int argc, char* argv[]) {
+    bool print_edges = false;
+    bool by_object = false;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t window = DEFAULT_REORDER_WINDOW;
+    int arg = 1;
+    for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        if (std::strcmp(argv[arg], "--graph") == 0) {
+            by_object = true;
+        } else if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threads = std::max(1l, std::strtol(argv[++arg], nullptr, 10));
+        } else if (std::strcmp(argv[arg], "--scalar") == 0) {
+            set_object_set_simd(false);
+        } else if (std::strcmp(argv[arg], "--edges") == 0) {
+            print_edges = true;
+        } else if (std::strcmp(argv[arg], "--window") == 0 && arg + 1 < argc) {
+            window = std::max(1ull, std::strtoull(argv[++arg], nullptr, 10));
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (arg == argc) return usage(argv[0]);
+
+    std::vector<TraceFile> files;
+    TxnSetCollector collector;
+    try {
+        for (int i = arg; i < argc; ++i) {
+            files.emplace_back(argv[i]);
+        }
+        for_each_in_seq_order(files, window, [&](const TraceRecord& record) { collector.add(record); });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    const std::vector<TxnSets> txns = collector.finish();
+    if (by_object) {
+        graph(txns, threads, print_edges);
+        return 0;
+    }
+
+    size_t dense = 0, bytes = 0;
+    for (const auto& txn : txns) {
+        dense += txn.reads.dense() + txn.writes.dense();
+        bytes += txn.reads.bytes() + txn.writes.bytes() + 2 * sizeof(ObjectBloom);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    ConflictStats stats;
+    const auto edges = build_conflicts(txns, stats);
+    const double seconds = seconds_since(start);
+
+    if (print_edges) {
+        for (const auto& edge : edges) {
+            const TxnInstance& from = txns[edge.from].id;
+            const TxnInstance& to = txns[edge.to].id;
+            std::printf("%s T%d#%u -> T%d#%u\n", conflict_type_name(edge.type), from.id, from.instance, to.id,
+                        to.instance);
+        }
+    }
+    std::printf("%zu committed transactions, %zu sets (%zu dense) in %zu KB\n", txns.size(), 2 * txns.size(), dense,
+                bytes >> 10);
+    std::printf("%zu overlapping pairs: %zu set comparisons screened out, %zu intersected (%s)\n", stats.pairs,
+                stats.screened, stats.intersected, object_set_simd() ? "avx2" : "scalar");
+    std::printf("%zu WW and %zu RW edges in %.3f s\n", stats.edges[static_cast<size_t>(ConflictType::WW)],
+                stats.edges[static_cast<size_t>(ConflictType::RW)], seconds);
+    return 0;
+}
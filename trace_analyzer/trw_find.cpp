@@ -0,0 +1,61 @@
+#include "trace_file.h"
+#include "trace_index.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+// Prints the records of one transaction or of a seq range of a binary trace, reading only the parts of the
+// trace its index (trace.bin.idx) points at.
+// Usage: trw_find trace.bin --txn ID
+//        trw_find trace.bin --seq LO HI
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " trace.bin --txn ID\n"
+              << "       " << argv0 << " trace.bin --seq LO HI\n";
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    const bool by_txn = argc == 4 && std::strcmp(argv[2], "--txn") == 0;
+    const bool by_seq = argc == 5 && std::strcmp(argv[2], "--seq") == 0;
+    if (!by_txn && !by_seq) return usage(argv[0]);
+
+    try {
+        const TraceFile file(argv[1]);
+        const TraceIndex index(file);
+        const std::unordered_map<uint16_t, std::string> statements = load_statements(argv[1]);
+
+        const int32_t txn = by_txn ? static_cast<int32_t>(std::strtol(argv[3], nullptr, 10)) : 0;
+        const uint64_t lo = by_seq ? std::strtoull(argv[3], nullptr, 10) : 0;
+        const uint64_t hi = by_seq ? std::strtoull(argv[4], nullptr, 10) : 0;
+        const auto spans = by_txn ? index.transaction(txn) : index.seq_range(lo, hi);
+
+        size_t scanned = 0;
+        size_t found = 0;
+        for (const auto& span : spans) {
+            for (const TraceRecord* record = file.begin() + span.first; record <= file.begin() + span.last; ++record) {
+                ++scanned;
+                if (by_txn ? record->transactionId != txn : record->seq < lo || record->seq > hi) continue;
+                ++found;
+                std::printf("%llu\t%llu\tT%d\t%s\ttable %u\trow %lld\tthread %d",
+                            static_cast<unsigned long long>(record->seq), static_cast<unsigned long long>(record->ts), record->transactionId,
+                            op_type_name(record->type), record->table, static_cast<long long>(record->objectId),
+                            record->threadId);
+                const auto sql = statements.find(record->statementId);
+                if (sql != statements.end()) std::printf("\tS%u %s", record->statementId, sql->second.c_str());
+                std::printf("\n");
+            }
+        }
+        std::fprintf(stderr, "%zu of %zu records matched, %zu read%s\n", found, file.size(), scanned,
+                     index.exists() ? "" : " (no index)");
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "text_trace.h"
+#include "trace_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Converts a text trace (printTransactionOp's `$$Op:` records, possibly mixed with other output) to a binary
+// trace. Usage: trw_import [--threads N] [--scalar] out.bin trace.txt
+// The text is cut into chunks that are parsed in parallel and written in order; records are numbered by their
+// position in the text, which becomes their seq. Text traces carry no timestamps or threads, so those are 0.
+
+constexpr size_t CHUNK_SIZE = 16 << 20;
+constexpr size_t OUTPUT_BUFFER_SIZE = 4 << 20;
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--threads N] [--scalar] out.bin trace.txt\n";
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    TextScan scan = best_text_scan();
+    int arg = 1;
+    for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threads = std::max(1l, std::strtol(argv[++arg], nullptr, 10));
+        } else if (std::strcmp(argv[arg], "--scalar") == 0) {
+            scan = TextScan::Scalar;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (argc - arg != 2) return usage(argv[0]);
+    const char* out_path = argv[arg];
+    const char* in_path = argv[arg + 1];
+
+    const int fd = open(in_path, O_RDONLY);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "can't open " << in_path << "\n";
+        return 2;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "can't map " << in_path << "\n";
+        return 2;
+    }
+    if (map) madvise(map, size, MADV_SEQUENTIAL);
+    const char* text = static_cast<const char*>(map);
+    const char* text_end = text + size;
+
+    FILE* out = std::fopen(out_path, "wb");
+    if (!out) {
+        std::cerr << "can't create " << out_path << "\n";
+        return 2;
+    }
+    std::setvbuf(out, nullptr, _IOFBF, OUTPUT_BUFFER_SIZE);
+    TraceFileHeader header{};
+    std::memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FORMAT_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    std::fwrite(&header, sizeof(header), 1, out);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<TextTraceParser> parsers(threads, TextTraceParser(scan));
+    std::vector<std::vector<TraceRecord>> records(threads);
+    std::vector<const char*> parsed(threads);
+    uint64_t seq = 0;
+    // Each round parses up to `threads` chunks; a record belongs to the chunk its marker starts in.
+    for (const char* round = text; round < text_end;) {
+        const size_t chunks = std::min<size_t>(threads, (text_end - round + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < chunks; ++i) {
+            const char* begin = round + i * CHUNK_SIZE;
+            const char* end = std::min(text_end, begin + CHUNK_SIZE);
+            workers.emplace_back([&, i, begin, end] {
+                records[i].clear();
+                parsed[i] = parsers[i].parse(begin, end, text_end, records[i]);
+            });
+        }
+        for (auto& worker : workers) worker.join();
+
+        const char* next = std::min(text_end, round + chunks * CHUNK_SIZE);
+        for (size_t i = 0; i < chunks; ++i) {
+            for (auto& record : records[i]) record.seq = seq++;
+            std::fwrite(records[i].data(), sizeof(TraceRecord), records[i].size(), out);
+            // The last record of the round may run into the next one.
+            next = std::max(next, parsed[i]);
+        }
+        round = next;
+    }
+
+    const bool failed = std::ferror(out) != 0;
+    if (std::fclose(out) != 0 || failed) {
+        std::cerr << "can't write " << out_path << "\n";
+        return 2;
+    }
+    if (map) munmap(map, size);
+
+    size_t malformed = 0;
+    for (const auto& parser : parsers) malformed += parser.malformed();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::fprintf(stderr, "%llu records from %zu bytes in %.3f s (%.0f MB/s, %s, %zu threads)", static_cast<unsigned long long>(seq),
+                 size, seconds, seconds > 0 ? size / seconds / 1e6 : 0.0, text_scan_name(scan), threads);
+    if (malformed) std::fprintf(stderr, ", %zu malformed records dropped", malformed);
+    std::fprintf(stderr, "\n");
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "trace_file.h"
+#include "trace_merge.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+// Merges per-thread or per-connection binary traces into one trace ordered by seq (or by timestamp).
+// Usage: trw_merge [--by seq|ts] out.bin trace.bin [trace.bin ...]
+// Every input must already be in that order. Runs of consecutive records from one input are written straight
+// from its mapping, so the merge only touches each record once. The inputs' statement tables are combined into
+// out.bin.sql.
+
+constexpr size_t OUTPUT_BUFFER_SIZE = 4 << 20;
+
+int usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--by seq|ts] out.bin trace.bin [trace.bin ...]\n";
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    MergeKey key = MergeKey::Seq;
+    int first = 1;
+    if (argc > 2 && std::strcmp(argv[1], "--by") == 0) {
+        if (std::strcmp(argv[2], "ts") == 0) key = MergeKey::Timestamp;
+        else if (std::strcmp(argv[2], "seq") != 0) return usage(argv[0]);
+        first = 3;
+    }
+    if (argc - first < 2) return usage(argv[0]);
+    const std::string out_path = argv[first];
+
+    std::vector<TraceFile> files;
+    std::unordered_map<uint16_t, std::string> statements;
+    try {
+        for (int i = first + 1; i < argc; ++i) {
+            files.emplace_back(argv[i]);
+            statements.merge(load_statements(argv[i]));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    for (const auto& file : files) {
+        if (!is_ordered(file, key)) {
+            std::cerr << file.path() << " is not in " << (key == MergeKey::Seq ? "seq" : "timestamp") << " order\n";
+            return 2;
+        }
+    }
+
+    FILE* out = std::fopen(out_path.c_str(), "wb");
+    if (!out) {
+        std::cerr << "can't create " << out_path << "\n";
+        return 2;
+    }
+    std::setvbuf(out, nullptr, _IOFBF, OUTPUT_BUFFER_SIZE);
+    TraceFileHeader header{};
+    std::memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FORMAT_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    std::fwrite(&header, sizeof(header), 1, out);
+
+    TraceMerger merger(files, key);
+    const TraceRecord* run = nullptr;
+    size_t run_length = 0;
+    size_t count = 0;
+    for (const TraceRecord* record = merger.next(); record; record = merger.next(), ++count) {
+        if (run && record == run + run_length) {
+            ++run_length;
+            continue;
+        }
+        if (run) std::fwrite(run, sizeof(TraceRecord), run_length, out);
+        run = record;
+        run_length = 1;
+    }
+    if (run) std::fwrite(run, sizeof(TraceRecord), run_length, out);
+
+    const bool failed = std::ferror(out) != 0;
+    if (std::fclose(out) != 0 || failed) {
+        std::cerr << "can't write " << out_path << "\n";
+        return 2;
+    }
+
+    if (!statements.empty()) {
+        FILE* table = std::fopen((out_path + ".sql").c_str(), "w");
+        if (!table) {
+            std::cerr << "can't create " << out_path << ".sql\n";
+            return 2;
+        }
+        for (uint32_t id = 1; id <= TRACE_MAX_STATEMENTS; ++id) {
+            const auto it = statements.find(static_cast<uint16_t>(id));
+            if (it != statements.end()) std::fprintf(table, "%u\t%s\n", id, it->second.c_str());
+        }
+        std::fclose(table);
+    }
+    std::printf("%zu records from %zu traces\n", count, files.size());
+    return 0;
+}